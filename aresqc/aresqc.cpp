@@ -9,19 +9,36 @@
 #include <vector>
 #include <memory>
 #include <direct.h>
+#include <algorithm>
+#include <chrono>
 
 #include "libaresq/Aresq.h"
+#include "libaresq/IgnoreMatcher.h"
+#include "libaresq/IgnoreProfile.h"
 
 int doencdec(bool enc);
+int doignore(const char *ignorefile, const char *pathlist, int rounds);
 
 int main(int argc, char* argv[])
 {
 	if (argc == 2 && (strcmp(argv[1], "-e") == 0 || strcmp(argv[1], "-d") == 0))
 		return doencdec(argv[1][1] == 'e');
+	// aresqc -i <ignore file> <path list> [rounds]
+	if ((argc == 4 || argc == 5) && strcmp(argv[1], "-i") == 0)
+		return doignore(argv[2], argv[3], argc == 5 ? atoi(argv[4]) : 10);
 
 	//*** DEBUG
 	chdir("D:\\aresq");
 
+	// aresqc -g <data dir> <backup> <path> <local file>
+	if (argc == 6 && strcmp(argv[1], "-g") == 0)
+	{
+		Aresq aresq;
+		if (aresq.init(argv[2]) != 0)
+			PELOG_ERROR_RETURN((PLV_ERROR, "init failed\n"), -1);
+		return aresq.get(argv[3], argv[4], argv[5]) == Aresq::OK ? 0 : 1;
+	}
+
 	std::string datadir = ".";
 	if (argc > 1)
 		datadir = argv[1];
@@ -45,4 +62,75 @@ int doencdec(bool enc)
 		printf("%s\n", s.c_str());
 	}
 	return 0;
-}
\ No newline at end of file
+}
+
+// replay a list of paths against an ignore file, to benchmark changes of ignore rules offline.
+// one path relative to the backup root per line, dirs end with '/'
+int doignore(const char *ignorefile, const char *pathlist, int rounds)
+{
+	typedef std::chrono::high_resolution_clock Clock;
+	std::vector<IgnoreMatcher::Pattern> patterns;
+	{
+		FileHandle fp = OpenFile(ignorefile, _NCT("r"));
+		if (!fp)
+			PELOG_ERROR_RETURN((PLV_ERROR, "Cannot open %s\n", ignorefile), -1);
+		IgnoreMatcher::parse(fp, patterns);
+	}
+	std::vector<std::string> paths;
+	std::vector<bool> isdirs;
+	{
+		FileHandle fp = OpenFile(pathlist, _NCT("r"));
+		if (!fp)
+			PELOG_ERROR_RETURN((PLV_ERROR, "Cannot open %s\n", pathlist), -1);
+		char buf[4096];
+		while (fgets(buf, sizeof(buf), fp))
+		{
+			size_t len = strcspn(buf, "\r\n");
+			for (size_t i = 0; i < len; ++i)
+			{
+				if (buf[i] == '\\')
+					buf[i] = '/';
+			}
+			bool isdir = len > 0 && buf[len - 1] == '/';
+			if (isdir)
+				--len;
+			if (len == 0)
+				continue;
+			paths.emplace_back(buf, len);
+			isdirs.push_back(isdir);
+		}
+	}
+
+	Clock::time_point start = Clock::now();
+	IgnoreMatcher matcher;
+	if (matcher.build(patterns) != 0)
+		PELOG_ERROR_RETURN((PLV_ERROR, "Compile ignore patterns failed %s\n", ignorefile), -1);
+	double buildms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+	std::vector<int> results(paths.size());
+	start = Clock::now();
+	for (int r = 0; r < std::max(rounds, 1); ++r)
+	{
+		for (size_t i = 0; i < paths.size(); ++i)
+			results[i] = matcher.match(paths[i].c_str(), paths[i].length(), isdirs[i]);
+	}
+	double matchns = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+	size_t ignored = std::count_if(results.begin(), results.end(), [](int res) { return res > 0; });
+	printf("%d patterns, %d paths, %d ignored\n", (int)patterns.size(), (int)paths.size(), (int)ignored);
+	printf("build %.2f ms, match %.1f ns/path over %d rounds\n",
+		buildms, paths.empty() ? 0.0 : matchns / paths.size() / std::max(rounds, 1), std::max(rounds, 1));
+
+	// each pattern on its own
+	IgnoreProfile profile;
+	profile.reset(patterns);
+	size_t mismatch = 0;
+	for (size_t i = 0; i < paths.size(); ++i)
+	{
+		if (profile.match(paths[i].c_str(), paths[i].length(), isdirs[i]) != results[i] && mismatch++ < 10)
+			printf("MISMATCH %s%s\n", paths[i].c_str(), isdirs[i] ? "/" : "");
+	}
+	if (mismatch > 0)
+		printf("%d paths differ from uncompiled patterns\n", (int)mismatch);
+	printf("%s", profile.report().c_str());
+	return mismatch > 0 ? 1 : 0;
+}
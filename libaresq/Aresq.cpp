@@ -2,6 +2,8 @@
 
 #include "Aresq.h"
 #include <random>
+#include <algorithm>
+#include <chrono>
 
 #define LIBCONFIG_STATIC
 #include "libconfig/libconfig.h"
@@ -39,9 +41,11 @@ int Aresq::init(const std::string &datadir)
 	// recorddir
 	recorddir = datadir + "/records";
 
-	// AresqIgnore
+	// AresqIgnore. profiling collects statistics of each pattern, reported at the end of a run
+	int ignoreprofile = false;
+	config_lookup_bool(&config, "general.ignoreprofile", &ignoreprofile);
 	ignore = std::make_unique<AresqIgnore>();
-	if (ignore->loadglobal((datadir + '/' + "aresqignore").c_str(), true) != 0)
+	if (ignore->loadglobal((datadir + '/' + "aresqignore").c_str(), true, ignoreprofile != 0) != 0)
 		PELOG_ERROR_RETURN((PLV_ERROR, "Global ignore file %s failed\n", (datadir + '/' + "aresqignore").c_str()), -1);
 
 	// remote
@@ -53,6 +57,17 @@ int Aresq::init(const std::string &datadir)
 	int keephist = true;
 	config_lookup_bool(&config, "general.history", &keephist);
 
+	// memory for one dir listing before spilling to temp files, in MB
+	int listmem = 64;
+	config_lookup_int(&config, "general.listmem", &listmem);
+	if (listmem <= 0)
+		listmem = 64;
+
+	// files modified within this are likely still being written, retried after the full refresh
+	config_lookup_int(&config, "general.settle", &settle);
+	if (settle < 0)
+		settle = 0;
+
 	// backups
 	{
 		config_setting_t *cbks = config_lookup(&config, "backups");
@@ -71,9 +86,15 @@ int Aresq::init(const std::string &datadir)
 			backups.back()->name = name;
 			backups.back()->dir = path;
 			if (backups.back()->root.load(backups.back()->id, name, path,
-					(recorddir + '/' + name).c_str(), keephist != 0, ignore.get()) != 0)
+					(recorddir + '/' + name).c_str(), keephist != 0, (size_t)listmem << 20, ignore.get()) != 0)
 				PELOG_ERROR_RETURN((PLV_ERROR, "Init ackup idx(%d) %s failed\n", i, name), -1);
+			backups.back()->root.setSettle((uint32_t)settle);
 		}
+		// new files may be copies of those in other backups
+		for (std::unique_ptr<Backup> &backup : backups)
+			for (std::unique_ptr<Backup> &peer : backups)
+				if (peer != backup)
+					backup->root.addPeer(&peer->root);
 	}
 
 	return 0;
@@ -97,11 +118,55 @@ int Aresq::run()
 				break;
 			state = root.perform(action, remote.get());
 		}
+		if (root.collectFiles(remote.get(), true) != Aresq::OK)
+			PELOG_ERROR_RETURN((PLV_ERROR, "Queued files failed\n"), -1);
 		AuAssert(root.verify());
 	}
+	// files still being written, waiting for up to 10 settle windows for them to stop changing.
+	// those left are taken by the next refresh
+	for (int64_t waited = 0;;)
+	{
+		uint32_t next = 0;
+		for (std::unique_ptr<Backup> &backup : backups)
+		{
+			Root &root = backup->root;
+			Root::Action action;
+			uint32_t wait = 0;
+			while (root.settleStep(action, wait) > 0)
+			{
+				int res = root.perform(action, remote.get());
+				if (res == Aresq::NOTFOUND)
+					PELOG_LOG((PLV_WARNING, "Settled file missing %s\n", action.name));
+				else if (res != Aresq::OK)
+					PELOG_ERROR_RETURN((PLV_ERROR, "Settled file failed %d %s\n", res, action.name), -1);
+			}
+			if (root.collectFiles(remote.get(), true) != Aresq::OK)
+				PELOG_ERROR_RETURN((PLV_ERROR, "Queued files failed\n"), -1);
+			if (wait != 0 && (next == 0 || wait < next))
+				next = wait;
+		}
+		if (next == 0 || waited + next > (int64_t)settle * 10)
+			break;
+		std::this_thread::sleep_for(std::chrono::seconds(next));
+		waited += next;
+	}
+	ignore->profileReport();
 	return 0;
 }
 
+int Aresq::get(const char *name, const char *path, const char *lfile)
+{
+	for (std::unique_ptr<Backup> &backup : backups)
+	{
+		if (backup->name != name)
+			continue;
+		std::string rpath = path;
+		std::replace(rpath.begin(), rpath.end(), '\\', '/');
+		return remote->getFile(name, rpath.c_str(), rpath.length(), lfile);
+	}
+	PELOG_ERROR_RETURN((PLV_ERROR, "Backup %s not found\n", name), Aresq::NOTFOUND);
+}
+
 const char *cycode = "faieugrf;owtnpi4u5hutkerfbuoery4ug3";
 const char *cypat = "*#**#";
 const char *codebook = "6psUoSXW3rVZhI1z";
@@ -36,12 +36,15 @@ public:
 	int init(const std::string &datadir);
 
 	int run();
+	// restore one file of backup `name` from the remote into `lfile`
+	int get(const char *name, const char *path, const char *lfile);
 
 	static std::string encpwd(const char *code);
 	static std::string decpwd(const char *code);
 
 private:
 	std::string recorddir;
+	int settle = 30;	// seconds a file is left alone after it is modified
 
 	struct Backup
 	{
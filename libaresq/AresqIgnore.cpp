@@ -1,5 +1,8 @@
 #include "stdafx.h"
 #include "AresqIgnore.h"
+#include <atomic>
+#include "IgnoreMatcher.h"
+#include "IgnoreProfile.h"
 #include "fsadapter.h"
 #include "pe_log.h"
 
@@ -9,39 +12,72 @@ public:
 	IgnoreList();
 	~IgnoreList();
 
-	int load(const char *ignorefilename);
+	int load(const char *ignorefilename, bool profiling = false);
+	// reload if the file has changed, and free rule sets no longer in use. watcher thread only
 	int update(bool force = false);
-	// >0: ignore, <0: keep and stop testing, 0: not ignore but continue testing if there are more lists
-	int isignore(const char *filename, bool isdir);
+	// >0: ignore, 0: kept by a negative pattern, <0: no pattern matches, continue testing if there are more lists
+	// wait-free, may be called from any thread
+	int isignore(const char *filename, bool isdir) const;
+	// get the current rules, which stay valid until leave(). wait-free
+	const IgnoreMatcher *enter(size_t &slot) const;
+	void leave(size_t slot) const;
+
+	// profiling of each pattern, queries take a lock when enabled
+	bool profiling() const { return profile != nullptr; }
+	void profileMatch(const char *filename, size_t len, bool isdir) const;
+	void profileReport() const;
 private:
-	struct Pattern
+	IgnoreList(const IgnoreList &) = delete;
+	IgnoreList &operator =(const IgnoreList &) = delete;
+
+	// the current rules are replaced as a whole and never modified after published.
+	// a replaced one is freed after all readers that might have seen it have left:
+	// a reader announces the epoch it enters at in a slot, the old rules are tagged with the epoch
+	// they are replaced in, and freed when every busy slot is beyond that
+	void publish(const IgnoreMatcher *newmatcher);
+	void reclaim();
+	std::atomic<const IgnoreMatcher *> matcher;
+	std::atomic<uint64_t> epoch;
+	enum { MAXREADERS = 64 };	// concurrent queries. more would just spin for a free slot
+	mutable std::atomic<uint64_t> readers[MAXREADERS];	// 0 for free slot
+	struct Retired
 	{
-		std::string pat;
-		bool neg = false;
-		bool dir = false;
+		const IgnoreMatcher *matcher;
+		uint64_t epoch;
 	};
-	std::vector<Pattern> patterns;
+	std::vector<Retired> retired;
+
 	std::string filename;
 	uint64_t filetime = 0;
-	uint64_t updatetime = 0;
+
+	std::unique_ptr<IgnoreProfile> profile;	// NULL if not profiling
+	mutable std::mutex profilelock;
 };
 
-IgnoreList::IgnoreList()
+IgnoreList::IgnoreList() : matcher(NULL), epoch(1)
 {
+	for (size_t i = 0; i < MAXREADERS; ++i)
+		readers[i].store(0);
 }
 
 
 IgnoreList::~IgnoreList()
 {
+	// no readers any more
+	delete matcher.load();
+	for (size_t i = 0; i < retired.size(); ++i)
+		delete retired[i].matcher;
 }
 
-int IgnoreList::load(const char *ignorefilename)
+int IgnoreList::load(const char *ignorefilename, bool profiling /*= false*/)
 {
 	uint64_t ftime = 0;
 	uint64_t fsize = 0;
 	if (getFileAttr("", ignorefilename, strlen(ignorefilename), ftime, fsize) != 0)
 		PELOG_ERROR_RETURN((PLV_ERROR, "Cannot access %s\n", ignorefilename), -1);
 	filename = ignorefilename;
+	if (profiling)
+		profile.reset(new IgnoreProfile);
 	update(true);
 	return 0;
 }
@@ -50,73 +86,121 @@ int IgnoreList::update(bool force /*= false*/)
 {
 	uint64_t ftime = 0;
 	uint64_t fsize = 0;
+	reclaim();
 	if (getFileAttr("", filename.c_str(), filename.length(), ftime, fsize) != 0)
 	{
-		patterns.clear();
-		PELOG_ERROR_RETURN((PLV_ERROR, "Cannot access %s\n", filename.c_str()), -1);
+		if (filetime != 0)
+		{
+			filetime = 0;
+			publish(NULL);
+			PELOG_ERROR_RETURN((PLV_ERROR, "Cannot access %s\n", filename.c_str()), -1);
+		}
+		return -1;
 	}
 	if (!force && ftime - 1 <= filetime && ftime + 1 >= filetime)
-		PELOG_LOG_RETURN((PLV_VERBOSE, "%s not modified\n", filename.c_str()), 0);
+		PELOG_LOG_RETURN((PLV_DEBUG, "%s not modified\n", filename.c_str()), 0);
 
-	updatetime = time64(NULL);
 	FileHandle fp = OpenFile(filename.c_str(), _NCT("r"));
 	if (!fp)
 		PELOG_ERROR_RETURN((PLV_ERROR, "Cannot access %s\n", filename.c_str()), -2);
 	filetime = ftime;
-	patterns.clear();
-	char buf[1024];
-	while (fgets(buf, 1024, fp))
-	{
-		bool neg = false, dir = false;
-		char *pb = NULL, *pe = NULL;
-		for (pb = buf; *pb > 0 && isspace(*pb); ++pb)
-			;
-		if (!*pb || *pb == '#')
-			continue;
-		if (*pb == '!')
-		{
-			neg = true;
-			++pb;
-		}
-		for (pe = pb; *pe; ++pe)
-			;
-		for (--pe; *pe > 0 && isspace(*pe); --pe)
-			;
-		++pe;
-		if (pe[-1] == '/')
-		{
-			dir = true;
-			--pe;
-		}
-		if (pe <= pb)
-			continue;
-		patterns.emplace_back();
-		patterns.back().pat.assign(pb, pe);
-		patterns.back().dir = dir;
-		patterns.back().neg = neg;
-	}
+	std::vector<IgnoreMatcher::Pattern> patterns;
+	IgnoreMatcher::parse(fp, patterns);
 
+	std::unique_ptr<IgnoreMatcher> newmatcher(new IgnoreMatcher);
+	if (newmatcher->build(patterns) != 0)
+	{
+		publish(NULL);
+		PELOG_ERROR_RETURN((PLV_ERROR, "Compile ignore patterns failed %s\n", filename.c_str()), -1);
+	}
+	PELOG_LOG((PLV_INFO, "Ignore rules loaded: %d patterns from %s\n", (int)newmatcher->size(), filename.c_str()));
+	if (profile)
+	{
+		// stats are by pattern index, report the old rules before starting over
+		if (profile->queries() > 0)
+			profileReport();
+		std::lock_guard<std::mutex> lock(profilelock);
+		profile->reset(patterns);
+	}
+	publish(newmatcher.release());
 	return 0;
 }
 
-bool gitignore_glob_match(const std::string &text, const std::string &glob);
+void IgnoreList::publish(const IgnoreMatcher *newmatcher)
+{
+	const IgnoreMatcher *old = matcher.exchange(newmatcher);
+	if (!old)
+		return;
+	// readers entered before this epoch may still be using old
+	Retired r = { old, epoch.fetch_add(1) };
+	retired.push_back(r);
+	reclaim();
+}
+
+void IgnoreList::reclaim()
+{
+	if (retired.empty())
+		return;
+	uint64_t oldest = UINT64_MAX;
+	for (size_t i = 0; i < MAXREADERS; ++i)
+	{
+		uint64_t e = readers[i].load();
+		if (e != 0 && e < oldest)
+			oldest = e;
+	}
+	size_t kept = 0;
+	for (size_t i = 0; i < retired.size(); ++i)
+	{
+		if (retired[i].epoch < oldest)
+			delete retired[i].matcher;
+		else
+			retired[kept++] = retired[i];
+	}
+	retired.resize(kept);
+}
+
+// >0: ignore, 0: kept by a negative pattern, <0: no pattern matches, continue testing if there are more lists
+int IgnoreList::isignore(const char *filename, bool isdir) const
+{
+	size_t slot = 0;
+	const IgnoreMatcher *rules = enter(slot);
+	int res = rules ? rules->match(filename, strlen(filename), isdir) : -1;
+	leave(slot);
+	if (profile)
+		profileMatch(filename, strlen(filename), isdir);
+	return res;
+}
+
+void IgnoreList::profileMatch(const char *filename, size_t len, bool isdir) const
+{
+	std::lock_guard<std::mutex> lock(profilelock);
+	profile->match(filename, len, isdir);
+}
 
-// >0: ignore, <0: keep and stop testing, 0: not ignore but continue testing if there are more lists
-int IgnoreList::isignore(const char *filename, bool isdir)
+void IgnoreList::profileReport() const
 {
-	uint64_t curtime = time64(NULL);
-	if (curtime > updatetime + 60 || curtime < updatetime - 60)
-		update();
-	updatetime = curtime;
-	std::string sfilename(filename);
-	for (auto &ipat = patterns.crbegin(); ipat != patterns.crend(); ++ipat)
+	std::string report;
 	{
-		if (ipat->dir && !isdir)
-			continue;
-		if (gitignore_glob_match(sfilename, ipat->pat))
-			return ipat->neg ? 0 : 1;
+		std::lock_guard<std::mutex> lock(profilelock);
+		report = profile->report();
 	}
-	return -1;
+	PELOG_LOG((PLV_INFO, "Ignore profile of %s: %s", filename.c_str(), report.c_str()));
+}
+
+const IgnoreMatcher *IgnoreList::enter(size_t &slot) const
+{
+	// take a free slot and announce current epoch in it. threads start at different slots so
+	// normally the first try succeeds
+	uint64_t cur = epoch.load();
+	slot = std::hash<std::thread::id>()(std::this_thread::get_id()) % MAXREADERS;
+	for (uint64_t expect = 0; !readers[slot].compare_exchange_strong(expect, cur); expect = 0)
+		slot = (slot + 1) % MAXREADERS;
+	return matcher.load();
+}
+
+void IgnoreList::leave(size_t slot) const
+{
+	readers[slot].store(0);
 }
 
 
@@ -126,16 +210,171 @@ AresqIgnore::AresqIgnore() : grule(new IgnoreList)
 
 AresqIgnore::~AresqIgnore()
 {
+	if (watcher.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(watchlock);
+			stopping = true;
+		}
+		watchcv.notify_all();
+		watcher.join();
+	}
 }
 
-int AresqIgnore::loadglobal(const char *filename, bool forcecreate)
+int AresqIgnore::loadglobal(const char *filename, bool forcecreate, bool profiling)
 {
 	if (forcecreate)
 		FileHandle fp = OpenFile(filename, _NCT("ab+"));
-	return grule->load(filename);
+	int res = grule->load(filename, profiling);
+	if (res == 0 && !watcher.joinable())
+		watcher = std::thread(&AresqIgnore::watch, this);
+	return res;
 }
 
-bool AresqIgnore::isignore(const char *filename, bool isdir)
+void AresqIgnore::profileReport() const
 {
+	if (grule->profiling())
+		grule->profileReport();
+}
+
+// reload the global rules in background, so queries never stall on file io
+void AresqIgnore::watch()
+{
+	std::unique_lock<std::mutex> lock(watchlock);
+	while (!watchcv.wait_for(lock, std::chrono::seconds(RELOADINTERVAL), [this]{ return stopping; }))
+	{
+		lock.unlock();
+		grule->update();
+		lock.lock();
+	}
+}
+
+bool AresqIgnore::isignore(const char *filename, bool isdir, const Scope *scopes, size_t nscope)
+{
+	// rules of deeper dirs go first
+	for (size_t i = 0; i < nscope; ++i)
+	{
+		AuAssert(strlen(filename) >= scopes[i].off);
+		int res = scopes[i].rules->match(filename + scopes[i].off, strlen(filename + scopes[i].off), isdir);
+		if (res >= 0)
+			return res > 0;
+	}
 	return grule->isignore(filename, isdir) > 0;
+}
+
+AresqIgnore::DirFilter::DirFilter(const AresqIgnore &ignore, const char *dir, size_t len,
+	const Scope *scopes /*= NULL*/, size_t nscope /*= 0*/) : glist(ignore.grule.get()), slot(0)
+{
+	rules.resize(nscope + 1);
+	for (size_t i = 0; i < nscope; ++i)
+	{
+		// dir relative to the scope, len + 1 == off for the scope dir itself
+		size_t off = std::min(scopes[i].off, len);
+		rules[i].rules = scopes[i].rules;
+		scopes[i].rules->prefix(dir + off, len - off, rules[i].prefix);
+	}
+	if (glist->profiling())
+		profiledir.assign(dir, len);
+	Rules &global = rules.back();
+	global.rules = glist->enter(slot);
+	if (global.rules)
+		global.rules->prefix(dir, len, global.prefix);
+	else
+		rules.pop_back();
+}
+
+AresqIgnore::DirFilter::~DirFilter()
+{
+	glist->leave(slot);
+}
+
+bool AresqIgnore::DirFilter::none() const
+{
+	for (size_t i = 0; i < rules.size(); ++i)
+	{
+		if (!rules[i].prefix.none())
+			return false;
+	}
+	return true;
+}
+
+bool AresqIgnore::DirFilter::isignore(const char *name, size_t nlen, bool isdir) const
+{
+	for (size_t i = 0; i < rules.size(); ++i)
+	{
+		int res = rules[i].rules->match(rules[i].prefix, name, nlen, isdir);
+		if (res >= 0)
+			return res > 0;
+	}
+	return false;
+}
+
+void AresqIgnore::DirFilter::isignore(FsList &items) const
+{
+	// <0 until decided
+	std::vector<int8_t> res(items.size(), -1);
+	for (size_t i = 0; i < rules.size(); ++i)
+	{
+		if (!rules[i].prefix.none())
+			rules[i].rules->match(rules[i].prefix, items, res.data());
+	}
+	for (size_t i = 0; i < items.size(); ++i)
+	{
+		if (res[i] > 0)
+			items[i].isignore(true);
+	}
+	if (glist->profiling())
+	{
+		std::string path;
+		for (size_t i = 0; i < items.size(); ++i)
+		{
+			path = profiledir;
+			if (!path.empty())
+				path += '/';
+			path.append(items.name(i), items[i].nlen);
+			glist->profileMatch(path.c_str(), path.length(), items[i].isdir());
+		}
+	}
+}
+
+std::shared_ptr<const IgnoreMatcher> AresqIgnore::dirRules(int rootid, uint32_t rid, const char *dir)
+{
+	uint64_t key = (uint64_t)(uint32_t)rootid << 32 | rid;
+	abufchar filename;
+	buildPath(dir, DIRIGNORE, filename);
+	uint64_t ftime = 0;
+	uint64_t fsize = 0;
+	if (getFileAttr("", filename, strlen(filename), ftime, fsize) != 0)
+	{
+		dircache.erase(key);
+		return NULL;
+	}
+	// record ids are reused, so check the name as well
+	auto it = dircache.find(key);
+	if (it != dircache.end() && it->second.filetime == ftime && it->second.filesize == fsize &&
+			it->second.filename == filename.buf())
+		return it->second.rules;
+
+	PELOG_LOG((PLV_VERBOSE, "Loading %s\n", filename.buf()));
+	std::shared_ptr<IgnoreMatcher> rules;
+	FileHandle fp = OpenFile(filename, _NCT("r"));
+	if (fp)
+	{
+		std::vector<IgnoreMatcher::Pattern> patterns;
+		IgnoreMatcher::parse(fp, patterns);
+		rules = std::make_shared<IgnoreMatcher>();
+		if (rules->build(patterns) != 0)
+			rules.reset();
+	}
+	if (!rules)
+	{
+		dircache.erase(key);
+		PELOG_ERROR_RETURN((PLV_ERROR, "Cannot load %s\n", filename.buf()), NULL);
+	}
+	DirCache &cache = dircache[key];
+	cache.filename = filename.buf();
+	cache.filetime = ftime;
+	cache.filesize = fsize;
+	cache.rules = rules;
+	return rules;
 }
\ No newline at end of file
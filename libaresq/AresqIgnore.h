@@ -5,19 +5,87 @@
 #include <time.h>
 #include <stdint.h>
 #include <memory>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "IgnoreMatcher.h"
+
+class FsList;
 
 class IgnoreList;
 
+// per directory ignore file, patterns relative to the dir it resides in
+#define DIRIGNORE ".aresqignore"
+
 class AresqIgnore
 {
 public:
 	AresqIgnore();
 	~AresqIgnore();
-	bool isignore(const char *filename, bool isdir);
 
-	int loadglobal(const char *filename, bool forcecreate = true);
+	// rules of a dir, and offset in the root relative path where paths beneath that dir start
+	struct Scope
+	{
+		const IgnoreMatcher *rules;
+		size_t off;
+	};
+	// `scopes` ordered from the deepest dir up. the first one with a matching pattern decides,
+	// then the global rules. global rules are reloaded in background, so this is safe to call
+	// from multiple threads as long as the scopes are not released meanwhile
+	bool isignore(const char *filename, bool isdir, const Scope *scopes = NULL, size_t nscope = 0);
+
+	// tests entries of one dir. rules are reduced to what can match beneath the dir once, instead of
+	// going through the dir path for each entry. the global rules in use are kept until destroyed
+	class DirFilter
+	{
+	public:
+		// `dir` relative to the root, "" for the root itself
+		DirFilter(const AresqIgnore &ignore, const char *dir, size_t len, const Scope *scopes = NULL, size_t nscope = 0);
+		~DirFilter();
+		// nothing in the dir can be ignored, testing may be skipped
+		bool none() const;
+		bool isignore(const char *name, size_t nlen, bool isdir) const;
+		// set isignore of all entries of a listing of the dir, in one pass for each rule set
+		void isignore(FsList &items) const;
+	private:
+		DirFilter(const DirFilter &) = delete;
+		DirFilter &operator =(const DirFilter &) = delete;
+		struct Rules
+		{
+			const IgnoreMatcher *rules;
+			IgnoreMatcher::Prefix prefix;
+		};
+		std::vector<Rules> rules;	// deepest first, global last
+		const IgnoreList *glist;
+		size_t slot;	// reader slot of glist
+		std::string profiledir;	// the dir, only kept when profiling global rules
+	};
+	// compiled DIRIGNORE of `dir`, NULL if there is none. cached by record id of the dir and
+	// reloaded when the file changes. not thread safe, called by refresh of each dir
+	std::shared_ptr<const IgnoreMatcher> dirRules(int rootid, uint32_t rid, const char *dir);
+
+	// `profiling`: collect statistics of each global pattern, see IgnoreProfile
+	int loadglobal(const char *filename, bool forcecreate = true, bool profiling = false);
+	// log statistics of global patterns if profiling
+	void profileReport() const;
 
 private:
 	std::unique_ptr<IgnoreList> grule;
+	// watcher of the global rules
+	enum { RELOADINTERVAL = 10 };	// seconds between checks of the global ignore file
+	void watch();
+	std::thread watcher;
+	std::mutex watchlock;
+	std::condition_variable watchcv;
+	bool stopping = false;
 	std::vector<std::unique_ptr<IgnoreList>> rules;
+	struct DirCache
+	{
+		std::string filename;
+		uint64_t filetime = 0;
+		uint64_t filesize = 0;
+		std::shared_ptr<const IgnoreMatcher> rules;
+	};
+	std::unordered_map<uint64_t, DirCache> dircache;	// by rootid << 32 | rid
 };
\ No newline at end of file
@@ -0,0 +1,74 @@
+#include "stdafx.h"
+#include "Chunker.h"
+
+#include <inttypes.h>
+#include <algorithm>
+extern "C"
+{
+#include "libsmb2/sha.h"
+}
+#ifdef _MSC_VER
+#	define snprintf _snprintf
+#endif
+
+// mask bits are taken from the top, which depend on the most bytes of the rolling window.
+// more bits before AVGSIZE and less after it keep most chunks near AVGSIZE
+static const uint64_t MASKS = ~0ULL << (64 - 22);
+static const uint64_t MASKL = ~0ULL << (64 - 18);
+
+struct GearTable
+{
+	uint64_t gear[256];
+	GearTable()
+	{
+		// splitmix64, fixed seed
+		uint64_t x = 0x41526573714344ULL;
+		for (int i = 0; i < 256; ++i)
+		{
+			uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+			z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+			z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+			gear[i] = z ^ (z >> 31);
+		}
+	}
+};
+static const GearTable gt;
+
+size_t Chunker::cut(const void *data, size_t len)
+{
+	if (len <= MINSIZE)
+		return len;
+	const uint8_t *p = (const uint8_t *)data;
+	size_t normal = std::min(len, (size_t)AVGSIZE);
+	size_t end = std::min(len, (size_t)MAXSIZE);
+	uint64_t h = 0;
+	size_t i = MINSIZE;	// no boundary can be in the first MINSIZE bytes, skip hashing them
+	for (; i < normal; ++i)
+	{
+		h = (h << 1) + gt.gear[p[i]];
+		if (!(h & MASKS))
+			return i + 1;
+	}
+	for (; i < end; ++i)
+	{
+		h = (h << 1) + gt.gear[p[i]];
+		if (!(h & MASKL))
+			return i + 1;
+	}
+	return end;
+}
+
+std::string Chunker::id(const void *data, size_t len)
+{
+	// SHA-256, as a chunk of the same id is taken as stored and never sent or compared again
+	SHA256Context ctx;
+	uint8_t digest[SHA256HashSize];
+	SHA256Reset(&ctx);
+	SHA256Input(&ctx, (const uint8_t *)data, (unsigned int)len);
+	SHA256Result(&ctx, digest);
+	char buf[IDSIZE + 1];
+	for (int i = 0; i < SHA256HashSize; ++i)
+		snprintf(buf + i * 2, 3, "%02x", digest[i]);
+	snprintf(buf + SHA256HashSize * 2, sizeof(buf) - SHA256HashSize * 2, "-%" PRIx64, (uint64_t)len);
+	return buf;
+}
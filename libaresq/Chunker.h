@@ -0,0 +1,28 @@
+#pragma once
+
+#include <string>
+#include <stdint.h>
+#include <stddef.h>
+
+// Content-defined chunking, FastCDC with normalized chunk sizes.
+//
+// Boundaries are decided by a rolling gear hash of the last bytes, so they move along with the
+// contents when data are inserted or removed, and unchanged parts of a file give the same chunks.
+// The gear table is generated from a fixed seed; changing it or the sizes moves all boundaries,
+// which only costs chunks to be stored again.
+class Chunker
+{
+public:
+	enum
+	{
+		MINSIZE = 256 * 1024,
+		AVGSIZE = 1024 * 1024,
+		MAXSIZE = 4 * 1024 * 1024,
+		IDSIZE = 64 + 1 + 16,	// longest id
+	};
+
+	// length of the first chunk of `data`. `len` should be at least MAXSIZE, unless it is the end of the file
+	static size_t cut(const void *data, size_t len);
+	// content address of a chunk: its SHA-256 and the length, in hex
+	static std::string id(const void *data, size_t len);
+};
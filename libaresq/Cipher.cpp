@@ -0,0 +1,580 @@
+#include "stdafx.h"
+#include "Cipher.h"
+
+#include <string.h>
+#include <random>
+#include <algorithm>
+extern "C"
+{
+#include "libsmb2/sha.h"
+}
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#	define AR_AESNI 1
+#	include <wmmintrin.h>
+#	include <tmmintrin.h>
+#	include <smmintrin.h>
+#	ifdef _MSC_VER
+#		include <intrin.h>
+#		define AESNI_TARGET
+#	else
+#		include <cpuid.h>
+#		define AESNI_TARGET __attribute__((target("aes,pclmul,ssse3,sse4.1")))
+#	endif
+#endif
+
+static const uint8_t SBOX[256] =
+{
+	0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+	0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+	0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+	0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+	0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+	0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+	0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+	0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+	0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+	0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+	0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+	0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+	0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+	0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+	0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+	0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+};
+
+static inline uint8_t xtime(uint8_t x) { return (uint8_t)((x << 1) ^ ((x >> 7) * 0x1b)); }
+static inline uint32_t load32be(const uint8_t *p) { return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3]; }
+static inline uint32_t bswap32(uint32_t v) { return (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) | (v << 24); }
+static inline uint64_t load64be(const uint8_t *p)
+{
+	uint64_t v = 0;
+	for (int i = 0; i < 8; ++i)
+		v = (v << 8) | p[i];
+	return v;
+}
+static inline void store64be(uint8_t *p, uint64_t v)
+{
+	for (int i = 7; i >= 0; --i, v >>= 8)
+		p[i] = (uint8_t)v;
+}
+
+// SubBytes, ShiftRows and MixColumns of one byte at once, for the portable version.
+// te[1..3] are te[0] rotated, for bytes in the other rows
+struct AesTables
+{
+	uint32_t te[4][256];
+	AesTables()
+	{
+		for (int i = 0; i < 256; ++i)
+		{
+			uint8_t s = SBOX[i], s2 = xtime(s), s3 = s2 ^ s;
+			uint32_t w = (uint32_t)s2 << 24 | (uint32_t)s << 16 | (uint32_t)s << 8 | s3;
+			for (int t = 0; t < 4; ++t, w = (w >> 8) | (w << 24))
+				te[t][i] = w;
+		}
+	}
+};
+static const AesTables at;
+
+// x = x * H in GF(2^128), 4 bits at a time with tables of multiples of H, as in mbed TLS
+static const uint64_t LAST4[16] =
+{
+	0x0000, 0x1c20, 0x3840, 0x2460, 0x7080, 0x6ca0, 0x48c0, 0x54e0,
+	0xe100, 0xfd20, 0xd940, 0xc560, 0x9180, 0x8da0, 0xa9c0, 0xb5e0,
+};
+
+static void gtablePortable(const uint8_t h[16], uint64_t hh[16], uint64_t hl[16])
+{
+	uint64_t vh = load64be(h), vl = load64be(h + 8);
+	hh[0] = hl[0] = 0;
+	hh[8] = vh;
+	hl[8] = vl;
+	for (int i = 4; i > 0; i >>= 1)
+	{
+		uint64_t t = (vl & 1) * 0xe1000000ULL;
+		vl = (vh << 63) | (vl >> 1);
+		vh = (vh >> 1) ^ (t << 32);
+		hh[i] = vh;
+		hl[i] = vl;
+	}
+	for (int i = 2; i <= 8; i *= 2)
+		for (int j = 1; j < i; ++j)
+		{
+			hh[i + j] = hh[i] ^ hh[j];
+			hl[i + j] = hl[i] ^ hl[j];
+		}
+}
+
+static void gmulPortable(uint8_t x[16], const uint64_t hh[16], const uint64_t hl[16])
+{
+	uint64_t zh = hh[x[15] & 0xf], zl = hl[x[15] & 0xf];
+	for (int i = 15; i >= 0; --i)
+	{
+		int lo = x[i] & 0xf, hi = x[i] >> 4;
+		if (i != 15)
+		{
+			int rem = (int)(zl & 0xf);
+			zl = (zh << 60) | (zl >> 4);
+			zh = (zh >> 4) ^ (LAST4[rem] << 48) ^ hh[lo];
+			zl ^= hl[lo];
+		}
+		int rem = (int)(zl & 0xf);
+		zl = (zh << 60) | (zl >> 4);
+		zh = (zh >> 4) ^ (LAST4[rem] << 48) ^ hh[hi];
+		zl ^= hl[hi];
+	}
+	store64be(x, zh);
+	store64be(x + 8, zl);
+}
+
+#ifdef AR_AESNI
+// GHASH multiply of byte reversed operands, from the Intel carry-less multiplication white paper.
+// split into the 256 bit product and its reduction, which is linear, so that products of several
+// blocks can be added up and reduced once
+AESNI_TARGET static inline void clmul(__m128i a, __m128i b, __m128i &lo, __m128i &hi)
+{
+	__m128i t3 = _mm_clmulepi64_si128(a, b, 0x00);
+	__m128i t4 = _mm_clmulepi64_si128(a, b, 0x10);
+	__m128i t5 = _mm_clmulepi64_si128(a, b, 0x01);
+	__m128i t6 = _mm_clmulepi64_si128(a, b, 0x11);
+	t4 = _mm_xor_si128(t4, t5);
+	lo = _mm_xor_si128(t3, _mm_slli_si128(t4, 8));
+	hi = _mm_xor_si128(t6, _mm_srli_si128(t4, 8));
+}
+
+AESNI_TARGET static inline __m128i gfreduce(__m128i t3, __m128i t6)
+{
+	__m128i t2, t4, t5;
+	// shift the 256 bit product left by 1, for the reflected bit order
+	__m128i t7 = _mm_srli_epi32(t3, 31);
+	__m128i t8 = _mm_srli_epi32(t6, 31);
+	t3 = _mm_slli_epi32(t3, 1);
+	t6 = _mm_slli_epi32(t6, 1);
+	__m128i t9 = _mm_srli_si128(t7, 12);
+	t8 = _mm_slli_si128(t8, 4);
+	t7 = _mm_slli_si128(t7, 4);
+	t3 = _mm_or_si128(t3, t7);
+	t6 = _mm_or_si128(t6, t8);
+	t6 = _mm_or_si128(t6, t9);
+	// reduce modulo x^128 + x^7 + x^2 + x + 1
+	t7 = _mm_slli_epi32(t3, 31);
+	t8 = _mm_slli_epi32(t3, 30);
+	t9 = _mm_slli_epi32(t3, 25);
+	t7 = _mm_xor_si128(t7, t8);
+	t7 = _mm_xor_si128(t7, t9);
+	t8 = _mm_srli_si128(t7, 4);
+	t7 = _mm_slli_si128(t7, 12);
+	t3 = _mm_xor_si128(t3, t7);
+	t2 = _mm_srli_epi32(t3, 1);
+	t4 = _mm_srli_epi32(t3, 2);
+	t5 = _mm_srli_epi32(t3, 7);
+	t2 = _mm_xor_si128(t2, t4);
+	t2 = _mm_xor_si128(t2, t5);
+	t2 = _mm_xor_si128(t2, t8);
+	t3 = _mm_xor_si128(t3, t2);
+	return _mm_xor_si128(t6, t3);
+}
+
+AESNI_TARGET static inline __m128i gfmul(__m128i a, __m128i b)
+{
+	__m128i lo, hi;
+	clmul(a, b, lo, hi);
+	return gfreduce(lo, hi);
+}
+
+// acc = (acc + c0) * h4 + c1 * h3 + c2 * h2 + c3 * h1, reduced once
+AESNI_TARGET static inline __m128i ghash4(__m128i acc, const __m128i *c, const __m128i *h)
+{
+	__m128i lo, hi, l, u;
+	clmul(_mm_xor_si128(acc, c[0]), h[3], lo, hi);
+	clmul(c[1], h[2], l, u);
+	lo = _mm_xor_si128(lo, l);
+	hi = _mm_xor_si128(hi, u);
+	clmul(c[2], h[1], l, u);
+	lo = _mm_xor_si128(lo, l);
+	hi = _mm_xor_si128(hi, u);
+	clmul(c[3], h[0], l, u);
+	return gfreduce(_mm_xor_si128(lo, l), _mm_xor_si128(hi, u));
+}
+
+AESNI_TARGET static inline __m128i bswap128(__m128i v)
+{
+	return _mm_shuffle_epi8(v, _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+}
+
+AESNI_TARGET static void aesBlockHw(const uint8_t *rk, const uint8_t in[16], uint8_t out[16])
+{
+	__m128i s = _mm_xor_si128(_mm_loadu_si128((const __m128i *)in), _mm_loadu_si128((const __m128i *)rk));
+	for (int r = 1; r < 14; ++r)
+		s = _mm_aesenc_si128(s, _mm_loadu_si128((const __m128i *)(rk + 16 * r)));
+	s = _mm_aesenclast_si128(s, _mm_loadu_si128((const __m128i *)(rk + 16 * 14)));
+	_mm_storeu_si128((__m128i *)out, s);
+}
+
+// 4 blocks at a time, with the products of powers of H added up before reducing
+AESNI_TARGET static void ghashHw(uint8_t x[16], const uint8_t hpow[4][16], const uint8_t *data, size_t len)
+{
+	__m128i h[4];
+	for (int i = 0; i < 4; ++i)
+		h[i] = _mm_loadu_si128((const __m128i *)hpow[i]);
+	__m128i acc = bswap128(_mm_loadu_si128((const __m128i *)x));
+	for (; len >= 64; data += 64, len -= 64)
+	{
+		__m128i c[4];
+		for (int i = 0; i < 4; ++i)
+			c[i] = bswap128(_mm_loadu_si128((const __m128i *)(data + 16 * i)));
+		acc = ghash4(acc, c, h);
+	}
+	for (; len > 0; data += 16, len -= std::min(len, (size_t)16))
+	{
+		uint8_t block[16] = { 0 };
+		memcpy(block, data, std::min(len, (size_t)16));
+		acc = gfmul(_mm_xor_si128(acc, bswap128(_mm_loadu_si128((const __m128i *)block))), h[0]);
+	}
+	_mm_storeu_si128((__m128i *)x, bswap128(acc));
+}
+
+#define AESNI_ROUND4(op, k) do { s0 = op(s0, k); s1 = op(s1, k); s2 = op(s2, k); s3 = op(s3, k); } while (0)
+
+// CTR from counter 2 on. if `x` is not NULL, the output is GHASHed into it in the same pass, while
+// it is still in registers
+AESNI_TARGET static void ctrHw(const uint8_t *rk, const uint8_t hpow[4][16], const uint8_t iv[12],
+	uint8_t *data, size_t len, uint8_t *x)
+{
+	__m128i k[15], h[4];
+	for (int r = 0; r < 15; ++r)
+		k[r] = _mm_loadu_si128((const __m128i *)(rk + 16 * r));
+	for (int i = 0; i < 4; ++i)
+		h[i] = _mm_loadu_si128((const __m128i *)hpow[i]);
+	__m128i acc = x ? bswap128(_mm_loadu_si128((const __m128i *)x)) : _mm_setzero_si128();
+	uint8_t base[16] = { 0 };
+	memcpy(base, iv, 12);
+	__m128i b = _mm_loadu_si128((const __m128i *)base);
+	uint32_t ctr = 2;
+	for (; len >= 64; data += 64, len -= 64, ctr += 4)
+	{
+		__m128i s0 = _mm_insert_epi32(b, (int)bswap32(ctr), 3);
+		__m128i s1 = _mm_insert_epi32(b, (int)bswap32(ctr + 1), 3);
+		__m128i s2 = _mm_insert_epi32(b, (int)bswap32(ctr + 2), 3);
+		__m128i s3 = _mm_insert_epi32(b, (int)bswap32(ctr + 3), 3);
+		AESNI_ROUND4(_mm_xor_si128, k[0]);
+		for (int r = 1; r < 14; ++r)
+			AESNI_ROUND4(_mm_aesenc_si128, k[r]);
+		AESNI_ROUND4(_mm_aesenclast_si128, k[14]);
+		__m128i *p = (__m128i *)data;
+		__m128i c[4];
+		c[0] = _mm_xor_si128(_mm_loadu_si128(p), s0);
+		c[1] = _mm_xor_si128(_mm_loadu_si128(p + 1), s1);
+		c[2] = _mm_xor_si128(_mm_loadu_si128(p + 2), s2);
+		c[3] = _mm_xor_si128(_mm_loadu_si128(p + 3), s3);
+		for (int i = 0; i < 4; ++i)
+			_mm_storeu_si128(p + i, c[i]);
+		if (x)
+		{
+			for (int i = 0; i < 4; ++i)
+				c[i] = bswap128(c[i]);
+			acc = ghash4(acc, c, h);
+		}
+	}
+	for (; len > 0; ++ctr)
+	{
+		__m128i s = _mm_xor_si128(_mm_insert_epi32(b, (int)bswap32(ctr), 3), k[0]);
+		for (int r = 1; r < 14; ++r)
+			s = _mm_aesenc_si128(s, k[r]);
+		s = _mm_aesenclast_si128(s, k[14]);
+		uint8_t block[16] = { 0 };
+		size_t n = std::min(len, (size_t)16);
+		memcpy(block, data, n);
+		_mm_storeu_si128((__m128i *)block, _mm_xor_si128(_mm_loadu_si128((const __m128i *)block), s));
+		memcpy(data, block, n);
+		memset(block + n, 0, 16 - n);
+		if (x)
+			acc = gfmul(_mm_xor_si128(acc, bswap128(_mm_loadu_si128((const __m128i *)block))), h[0]);
+		data += n;
+		len -= n;
+	}
+	if (x)
+		_mm_storeu_si128((__m128i *)x, bswap128(acc));
+}
+
+AESNI_TARGET static void hpowHw(const uint8_t h[16], uint8_t hpow[4][16])
+{
+	__m128i h1 = bswap128(_mm_loadu_si128((const __m128i *)h));
+	__m128i hn = h1;
+	for (int i = 0; i < 4; ++i)
+	{
+		_mm_storeu_si128((__m128i *)hpow[i], hn);
+		hn = gfmul(hn, h1);
+	}
+}
+#endif
+
+bool Aes256Gcm::hardware()
+{
+#ifdef AR_AESNI
+	unsigned int regs[4] = { 0 };
+#	ifdef _MSC_VER
+	__cpuid((int *)regs, 1);
+#	else
+	__get_cpuid(1, &regs[0], &regs[1], &regs[2], &regs[3]);
+#	endif
+	// AES-NI, PCLMULQDQ, SSSE3, SSE4.1
+	const unsigned int need = (1u << 25) | (1u << 1) | (1u << 9) | (1u << 19);
+	return (regs[2] & need) == need;
+#else
+	return false;
+#endif
+}
+
+Aes256Gcm::Aes256Gcm(const uint8_t key[KEYSIZE]) : _hw(hardware())
+{
+	// key expansion of FIPS-197. AES-NI takes the same round keys
+	memcpy(_rk, key, KEYSIZE);
+	uint8_t rcon = 1;
+	for (int i = 8; i < 60; ++i)
+	{
+		uint8_t t[4];
+		memcpy(t, _rk + (i - 1) * 4, 4);
+		if (i % 8 == 0)
+		{
+			uint8_t t0 = t[0];
+			t[0] = SBOX[t[1]] ^ rcon;
+			t[1] = SBOX[t[2]];
+			t[2] = SBOX[t[3]];
+			t[3] = SBOX[t0];
+			rcon = xtime(rcon);
+		}
+		else if (i % 8 == 4)
+		{
+			for (int j = 0; j < 4; ++j)
+				t[j] = SBOX[t[j]];
+		}
+		for (int j = 0; j < 4; ++j)
+			_rk[i * 4 + j] = _rk[(i - 8) * 4 + j] ^ t[j];
+	}
+	for (int i = 0; i < 60; ++i)
+		_rkw[i] = load32be(_rk + i * 4);
+	uint8_t zero[16] = { 0 };
+	encryptBlock(zero, _h);
+	memset(_hpow, 0, sizeof(_hpow));
+	gtablePortable(_h, _hh, _hl);
+#ifdef AR_AESNI
+	if (_hw)
+		hpowHw(_h, _hpow);
+#endif
+}
+
+void Aes256Gcm::encryptBlock(const uint8_t in[16], uint8_t out[16]) const
+{
+#ifdef AR_AESNI
+	if (_hw)
+		return aesBlockHw(_rk, in, out);
+#endif
+	// state in big endian words of columns
+	const uint32_t *rk = _rkw;
+	uint32_t s0 = load32be(in) ^ rk[0], s1 = load32be(in + 4) ^ rk[1];
+	uint32_t s2 = load32be(in + 8) ^ rk[2], s3 = load32be(in + 12) ^ rk[3];
+	const uint32_t (*te)[256] = at.te;
+	for (int r = 1; r < 14; ++r)
+	{
+		rk += 4;
+		uint32_t t0 = te[0][s0 >> 24] ^ te[1][(s1 >> 16) & 0xff] ^ te[2][(s2 >> 8) & 0xff] ^ te[3][s3 & 0xff] ^ rk[0];
+		uint32_t t1 = te[0][s1 >> 24] ^ te[1][(s2 >> 16) & 0xff] ^ te[2][(s3 >> 8) & 0xff] ^ te[3][s0 & 0xff] ^ rk[1];
+		uint32_t t2 = te[0][s2 >> 24] ^ te[1][(s3 >> 16) & 0xff] ^ te[2][(s0 >> 8) & 0xff] ^ te[3][s1 & 0xff] ^ rk[2];
+		uint32_t t3 = te[0][s3 >> 24] ^ te[1][(s0 >> 16) & 0xff] ^ te[2][(s1 >> 8) & 0xff] ^ te[3][s2 & 0xff] ^ rk[3];
+		s0 = t0;
+		s1 = t1;
+		s2 = t2;
+		s3 = t3;
+	}
+	// last round without MixColumns
+	rk += 4;
+	uint32_t s[4] = { s0, s1, s2, s3 };
+	for (int c = 0; c < 4; ++c)
+	{
+		uint32_t w = (uint32_t)SBOX[s[c] >> 24] << 24 | (uint32_t)SBOX[(s[(c + 1) % 4] >> 16) & 0xff] << 16 |
+			(uint32_t)SBOX[(s[(c + 2) % 4] >> 8) & 0xff] << 8 | SBOX[s[(c + 3) % 4] & 0xff];
+		w ^= rk[c];
+		out[c * 4] = (uint8_t)(w >> 24);
+		out[c * 4 + 1] = (uint8_t)(w >> 16);
+		out[c * 4 + 2] = (uint8_t)(w >> 8);
+		out[c * 4 + 3] = (uint8_t)w;
+	}
+}
+
+void Aes256Gcm::ghash(uint8_t x[16], const uint8_t *data, size_t len) const
+{
+#ifdef AR_AESNI
+	if (_hw)
+		return ghashHw(x, _hpow, data, len);
+#endif
+	while (len > 0)
+	{
+		size_t n = std::min(len, (size_t)16);
+		for (size_t i = 0; i < n; ++i)
+			x[i] ^= data[i];
+		gmulPortable(x, _hh, _hl);
+		data += n;
+		len -= n;
+	}
+}
+
+void Aes256Gcm::ctr(const uint8_t iv[IVSIZE], uint8_t *data, size_t len, uint8_t *x /*= NULL*/) const
+{
+#ifdef AR_AESNI
+	if (_hw)
+		return ctrHw(_rk, _hpow, iv, data, len, x);
+#endif
+	uint8_t *start = data;
+	size_t total = len;
+	uint8_t block[16], ks[16];
+	memcpy(block, iv, IVSIZE);
+	for (uint32_t ctr = 2; len > 0; ++ctr)
+	{
+		block[12] = (uint8_t)(ctr >> 24);
+		block[13] = (uint8_t)(ctr >> 16);
+		block[14] = (uint8_t)(ctr >> 8);
+		block[15] = (uint8_t)ctr;
+		encryptBlock(block, ks);
+		size_t n = std::min(len, (size_t)16);
+		for (size_t i = 0; i < n; ++i)
+			data[i] ^= ks[i];
+		data += n;
+		len -= n;
+	}
+	if (x)
+		ghash(x, start, total);
+}
+
+// GHASH the lengths, and mask it with the encrypted first counter block
+void Aes256Gcm::finish(const uint8_t iv[IVSIZE], uint8_t x[16], size_t len, uint8_t tag[TAGSIZE]) const
+{
+	uint8_t block[16] = { 0 };
+	store64be(block + 8, (uint64_t)len * 8);	// no additional data
+	ghash(x, block, 16);
+	memcpy(block, iv, IVSIZE);
+	block[12] = block[13] = block[14] = 0;
+	block[15] = 1;
+	encryptBlock(block, tag);
+	for (int i = 0; i < TAGSIZE; ++i)
+		tag[i] ^= x[i];
+}
+
+void Aes256Gcm::seal(const uint8_t iv[IVSIZE], uint8_t *data, size_t len, uint8_t tag[TAGSIZE]) const
+{
+	uint8_t x[16] = { 0 };
+	ctr(iv, data, len, x);
+	finish(iv, x, len, tag);
+}
+
+bool Aes256Gcm::open(const uint8_t iv[IVSIZE], uint8_t *data, size_t len, const uint8_t tag[TAGSIZE]) const
+{
+	uint8_t x[16] = { 0 }, expect[TAGSIZE];
+	ghash(x, data, len);
+	finish(iv, x, len, expect);
+	uint8_t diff = 0;	// compare in constant time
+	for (int i = 0; i < TAGSIZE; ++i)
+		diff |= expect[i] ^ tag[i];
+	if (diff != 0)
+		return false;
+	ctr(iv, data, len);
+	return true;
+}
+
+static inline int hexValue(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+bool FileCipher::parseKey(const char *hex, uint8_t key[KEYSIZE])
+{
+	if (!hex || strlen(hex) != KEYSIZE * 2)
+		return false;
+	for (int i = 0; i < KEYSIZE; ++i)
+	{
+		int hi = hexValue(hex[i * 2]), lo = hexValue(hex[i * 2 + 1]);
+		if (hi < 0 || lo < 0)
+			return false;
+		key[i] = (uint8_t)(hi << 4 | lo);
+	}
+	return true;
+}
+
+FileCipher::FileCipher(const uint8_t master[KEYSIZE])
+{
+	memcpy(_master, master, KEYSIZE);
+}
+
+FileCipher::~FileCipher()
+{
+	memset(_master, 0, KEYSIZE);
+}
+
+void FileCipher::derive(const uint8_t *salt)
+{
+	static const char LABEL[] = "AResq file key 1";
+	uint8_t text[sizeof(LABEL) - 1 + SALTSIZE];
+	memcpy(text, LABEL, sizeof(LABEL) - 1);
+	memcpy(text + sizeof(LABEL) - 1, salt, SALTSIZE);
+	uint8_t key[USHAMaxHashSize];
+	hmac(SHA256, text, sizeof(text), _master, KEYSIZE, key);
+	_gcm.reset(new Aes256Gcm(key));
+	memset(key, 0, sizeof(key));
+}
+
+void FileCipher::create(uint8_t *header)
+{
+	std::random_device rd;
+	uint8_t salt[SALTSIZE];
+	for (int i = 0; i < SALTSIZE; i += 4)
+	{
+		uint32_t r = rd();
+		memcpy(salt + i, &r, 4);
+	}
+	_blocksize = BLOCKSIZE;
+	memcpy(header, "ARE1", 4);
+	memcpy(header + 4, &_blocksize, 4);	// little endian only
+	memcpy(header + 8, salt, SALTSIZE);
+	derive(salt);
+}
+
+bool FileCipher::open(const uint8_t *header, size_t len)
+{
+	if (len < HEADERSIZE || memcmp(header, "ARE1", 4) != 0)
+		return false;
+	memcpy(&_blocksize, header + 4, 4);
+	if (_blocksize == 0 || _blocksize > 64 * 1024 * 1024)
+		return false;
+	derive(header + 8);
+	return true;
+}
+
+static inline void blockIv(uint64_t index, bool last, uint8_t iv[Aes256Gcm::IVSIZE])
+{
+	store64be(iv, index);
+	iv[8] = iv[9] = iv[10] = 0;
+	iv[11] = last ? 1 : 0;
+}
+
+void FileCipher::seal(uint64_t index, bool last, uint8_t *data, size_t len)
+{
+	uint8_t iv[Aes256Gcm::IVSIZE];
+	blockIv(index, last, iv);
+	_gcm->seal(iv, data, len, data + len);
+}
+
+bool FileCipher::unseal(uint64_t index, bool last, uint8_t *data, size_t len)
+{
+	if (len < TAGSIZE)
+		return false;
+	uint8_t iv[Aes256Gcm::IVSIZE];
+	blockIv(index, last, iv);
+	return _gcm->open(iv, data, len - TAGSIZE, data + len - TAGSIZE);
+}
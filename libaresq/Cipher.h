@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <memory>
+
+// AES-256-GCM of whole messages, without additional data. AES-NI and PCLMULQDQ are used if the
+// cpu has them, with 4 blocks in flight; otherwise a portable version, which is a lot slower.
+class Aes256Gcm
+{
+public:
+	enum { KEYSIZE = 32, IVSIZE = 12, TAGSIZE = 16 };
+	Aes256Gcm(const uint8_t key[KEYSIZE]);
+	// encrypt `data` in place
+	void seal(const uint8_t iv[IVSIZE], uint8_t *data, size_t len, uint8_t tag[TAGSIZE]) const;
+	// verify `tag` and decrypt `data` in place. `data` is left as is if it does not match
+	bool open(const uint8_t iv[IVSIZE], uint8_t *data, size_t len, const uint8_t tag[TAGSIZE]) const;
+	static bool hardware();
+
+private:
+	uint8_t _rk[15 * 16];	// round keys
+	uint32_t _rkw[15 * 4];	// the same in big endian words, for the portable version
+	uint8_t _h[16];	// GHASH key
+	uint8_t _hpow[4][16];	// hardware version: byte reversed powers H^1..H^4
+	uint64_t _hh[16], _hl[16];	// portable version: multiples of H by 4 bit values
+	bool _hw;
+	void encryptBlock(const uint8_t in[16], uint8_t out[16]) const;
+	void ghash(uint8_t x[16], const uint8_t *data, size_t len) const;	// `len` padded with zeros
+	// from counter 2 on, GHASH the output into `x` if not NULL
+	void ctr(const uint8_t iv[IVSIZE], uint8_t *data, size_t len, uint8_t *x = NULL) const;
+	void finish(const uint8_t iv[IVSIZE], uint8_t x[16], size_t len, uint8_t tag[TAGSIZE]) const;
+};
+
+// Encrypted file format, integers in little endian:
+//     "ARE1", block size(4), salt(16)
+//     blocks of ciphertext, each followed by its GCM tag(16). all but the last one are full
+// Each file has its own key, HMAC-SHA256(master key, "AResq file key 1" + salt) with a random salt.
+// Block i is sealed with iv = i(8, big endian) + 1 for the last block or 0 (4), so that blocks
+// cannot be reordered, and the file cannot be cut at a block boundary unnoticed.
+class FileCipher
+{
+public:
+	enum
+	{
+		KEYSIZE = 32,
+		SALTSIZE = 16,
+		HEADERSIZE = 8 + SALTSIZE,
+		BLOCKSIZE = 64 * 1024,
+		TAGSIZE = Aes256Gcm::TAGSIZE,
+	};
+	// master key in config, 64 hex digits
+	static bool parseKey(const char *hex, uint8_t key[KEYSIZE]);
+
+	FileCipher(const uint8_t master[KEYSIZE]);
+	~FileCipher();
+	// start a new file with a random salt, `header` receives HEADERSIZE bytes
+	void create(uint8_t *header);
+	// start reading a file. false if `header` is not of this format
+	bool open(const uint8_t *header, size_t len);
+	uint32_t blockSize() const { return _blocksize; }
+	// encrypt block `index` of `len` bytes in place, followed by TAGSIZE bytes of tag
+	void seal(uint64_t index, bool last, uint8_t *data, size_t len);
+	// verify and decrypt block `index` of `len` bytes, tag included. false if it has been altered
+	bool unseal(uint64_t index, bool last, uint8_t *data, size_t len);
+
+private:
+	uint8_t _master[KEYSIZE];
+	uint32_t _blocksize = BLOCKSIZE;
+	std::unique_ptr<Aes256Gcm> _gcm;
+	void derive(const uint8_t *salt);
+};
@@ -0,0 +1,261 @@
+#include "stdafx.h"
+#include "Compressor.h"
+
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+// limits of the LZ4 block format
+static const size_t MINMATCH = 4;
+static const size_t LASTLITERALS = 5;	// the last bytes are always literals
+static const size_t MFLIMIT = 12;	// no match starts within this to the end
+static const size_t MAXOFFSET = 65535;
+static const int HASHLOG = 16;
+
+static inline uint32_t read32(const uint8_t *p) { uint32_t v; memcpy(&v, p, 4); return v; }
+static inline uint32_t hashSeq(uint32_t seq) { return (seq * 2654435761u) >> (32 - HASHLOG); }
+
+// length over 15 in the token goes on in bytes of 255
+static inline uint8_t *putLength(uint8_t *op, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = (uint8_t)len;
+	return op;
+}
+
+size_t Compressor::compress(const void *src, size_t len, void *dst, size_t cap)
+{
+	const uint8_t *in = (const uint8_t *)src;
+	const uint8_t *ip = in, *anchor = in, *iend = in + len;
+	uint8_t *op = (uint8_t *)dst, *oend = op + cap;
+	if (len > MFLIMIT)
+	{
+		std::vector<uint32_t> table((size_t)1 << HASHLOG, 0);
+		const uint8_t *mflimit = iend - MFLIMIT;
+		const uint8_t *matchlimit = iend - LASTLITERALS;
+		size_t misses = 0;	// step up over data not matching, which are likely incompressible
+		while (ip < mflimit)
+		{
+			uint32_t seq = read32(ip);
+			uint32_t h = hashSeq(seq);
+			const uint8_t *ref = in + table[h];
+			table[h] = (uint32_t)(ip - in);
+			if (ref >= ip || (size_t)(ip - ref) > MAXOFFSET || read32(ref) != seq)
+			{
+				ip += 1 + (misses++ >> 6);
+				continue;
+			}
+			misses = 0;
+			while (ip > anchor && ref > in && ip[-1] == ref[-1])
+				--ip, --ref;
+			size_t mlen = MINMATCH;
+			while (ip + mlen < matchlimit && ip[mlen] == ref[mlen])
+				++mlen;
+			size_t lit = ip - anchor;
+			if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1)
+				return 0;
+			uint8_t *token = op++;
+			*token = (uint8_t)(std::min(lit, (size_t)15) << 4);
+			if (lit >= 15)
+				op = putLength(op, lit - 15);
+			memcpy(op, anchor, lit);
+			op += lit;
+			size_t off = ip - ref;
+			*op++ = (uint8_t)off;
+			*op++ = (uint8_t)(off >> 8);
+			*token |= (uint8_t)std::min(mlen - MINMATCH, (size_t)15);
+			if (mlen - MINMATCH >= 15)
+				op = putLength(op, mlen - MINMATCH - 15);
+			ip += mlen;
+			anchor = ip;
+		}
+	}
+	size_t lit = iend - anchor;
+	if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit)
+		return 0;
+	*op = (uint8_t)(std::min(lit, (size_t)15) << 4);
+	op = lit >= 15 ? putLength(op + 1, lit - 15) : op + 1;
+	memcpy(op, anchor, lit);
+	op += lit;
+	return op - (uint8_t *)dst;
+}
+
+size_t Compressor::decompress(const void *src, size_t len, void *dst, size_t cap)
+{
+	const uint8_t *ip = (const uint8_t *)src, *iend = ip + len;
+	uint8_t *out = (uint8_t *)dst, *op = out, *oend = out + cap;
+	while (ip < iend)
+	{
+		uint8_t token = *ip++;
+		size_t lit = token >> 4;
+		if (lit == 15)
+		{
+			uint8_t b = 255;
+			while (b == 255 && ip < iend)
+				lit += (b = *ip++);
+			if (b == 255)
+				return (size_t)-1;
+		}
+		if ((size_t)(iend - ip) < lit || (size_t)(oend - op) < lit)
+			return (size_t)-1;
+		memcpy(op, ip, lit);
+		ip += lit;
+		op += lit;
+		if (ip == iend)	// last literals
+			break;
+		if (iend - ip < 2)
+			return (size_t)-1;
+		size_t off = ip[0] | (size_t)ip[1] << 8;
+		ip += 2;
+		if (off == 0 || off > (size_t)(op - out))
+			return (size_t)-1;
+		size_t mlen = token & 15;
+		if (mlen == 15)
+		{
+			uint8_t b = 255;
+			while (b == 255 && ip < iend)
+				mlen += (b = *ip++);
+			if (b == 255)
+				return (size_t)-1;
+		}
+		mlen += MINMATCH;
+		if ((size_t)(oend - op) < mlen)
+			return (size_t)-1;
+		// matches may overlap what they produce, copy forward byte by byte
+		for (const uint8_t *ref = op - off; mlen > 0; --mlen)
+			*op++ = *ref++;
+	}
+	return op - out;
+}
+
+bool Compressor::compressible(const void *data, size_t len)
+{
+	static const size_t SAMPLES = 16, SAMPLELEN = 256;
+	// already compressed data are close to 8 bits per byte, text and most binaries far below
+	static const double MAXENTROPY = 7.5;
+	const uint8_t *p = (const uint8_t *)data;
+	uint32_t count[256] = { 0 };
+	size_t total = 0;
+	if (len <= SAMPLES * SAMPLELEN)
+	{
+		for (size_t i = 0; i < len; ++i)
+			++count[p[i]];
+		total = len;
+	}
+	else
+	{
+		size_t step = (len - SAMPLELEN) / (SAMPLES - 1);
+		for (size_t s = 0; s < SAMPLES; ++s)
+			for (size_t i = s * step; i < s * step + SAMPLELEN; ++i)
+				++count[p[i]];
+		total = SAMPLES * SAMPLELEN;
+	}
+	if (total == 0)
+		return false;
+	double entropy = 0;
+	for (int i = 0; i < 256; ++i)
+	{
+		if (count[i] == 0)
+			continue;
+		double f = (double)count[i] / total;
+		entropy -= f * log(f);
+	}
+	return entropy / log(2.0) < MAXENTROPY;
+}
+
+CompressPipe::CompressPipe(unsigned nthread, size_t blocksize) : _blocksize(blocksize)
+{
+	nthread = std::max(nthread, 1u);
+	// enough blocks for every worker to have one, while as many are waiting to be taken
+	_nblock = nthread * 2;
+	_blocks.reset(new Block[_nblock]);
+	for (size_t i = 0; i < _nblock; ++i)
+	{
+		_blocks[i].raw.resize(blocksize);
+		_blocks[i].out.resize(Compressor::bound(blocksize));
+	}
+	for (unsigned i = 0; i < nthread; ++i)
+		_workers.push_back(std::thread(&CompressPipe::work, this));
+}
+
+CompressPipe::~CompressPipe()
+{
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+		_stop = true;
+	}
+	_hasTodo.notify_all();
+	for (size_t i = 0; i < _workers.size(); ++i)
+		_workers[i].join();
+}
+
+char *CompressPipe::next()
+{
+	if (_count == _nblock)
+		return NULL;
+	return _blocks[(_head + _count) % _nblock].raw;
+}
+
+void CompressPipe::put(size_t len)
+{
+	AuVerify(_count < _nblock && len <= _blocksize);
+	size_t idx = (_head + _count) % _nblock;
+	Block &block = _blocks[idx];
+	block.rawlen = len;
+	block.outlen = 0;
+	block.compressed = block.done = false;
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+		_todo.push_back(idx);
+		++_count;
+	}
+	_hasTodo.notify_one();
+}
+
+const CompressPipe::Block *CompressPipe::get()
+{
+	if (_count == 0)
+		return NULL;
+	Block &block = _blocks[_head];
+	std::unique_lock<std::mutex> guard(_lock);
+	while (!block.done)
+		_hasDone.wait(guard);
+	return &block;
+}
+
+void CompressPipe::pop()
+{
+	AuVerify(_count > 0 && _blocks[_head].done);
+	_head = (_head + 1) % _nblock;
+	--_count;
+}
+
+void CompressPipe::work()
+{
+	while (true)
+	{
+		size_t idx = 0;
+		{
+			std::unique_lock<std::mutex> guard(_lock);
+			while (!_stop && _todo.empty())
+				_hasTodo.wait(guard);
+			if (_stop)
+				return;
+			idx = _todo.front();
+			_todo.pop_front();
+		}
+		Block &block = _blocks[idx];
+		if (Compressor::compressible(block.raw, block.rawlen))
+		{
+			block.outlen = Compressor::compress(block.raw, block.rawlen, block.out, block.out.size());
+			// not worth a decompression if it saves too little
+			block.compressed = block.outlen > 0 && block.outlen < block.rawlen - block.rawlen / 32;
+		}
+		{
+			std::lock_guard<std::mutex> guard(_lock);
+			block.done = true;
+		}
+		_hasDone.notify_all();
+	}
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <memory>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "auto_buf.hpp"
+
+// Block compression in the LZ4 block format: greedy LZ77 over a 64KB window with a hash table
+// of 4-byte sequences. Far from the best ratio, but fast enough to keep up with the network on
+// a few threads, and text-like data still shrink to a fraction.
+class Compressor
+{
+public:
+	// room needed in `dst` to compress `len` bytes in any case
+	static size_t bound(size_t len) { return len + len / 255 + 16; }
+	// return compressed size, 0 if it does not fit in `cap`
+	static size_t compress(const void *src, size_t len, void *dst, size_t cap);
+	// return decompressed size, (size_t)-1 if `src` is corrupted or does not fit in `cap`
+	static size_t decompress(const void *src, size_t len, void *dst, size_t cap);
+	// byte entropy of a few samples of `data`. false for already compressed or encrypted data,
+	// which are stored as is without trying
+	static bool compressible(const void *data, size_t len);
+};
+
+// Compresses a stream of blocks on worker threads, while the caller is busy with other things,
+// e.g. sending the blocks done before. Blocks come out in the order they are put in.
+class CompressPipe
+{
+	CompressPipe(const CompressPipe &) = delete;
+	CompressPipe &operator =(const CompressPipe &) = delete;
+public:
+	struct Block
+	{
+		abuf<char> raw;
+		abuf<char> out;
+		size_t rawlen = 0;
+		size_t outlen = 0;
+		bool compressed = false;	// otherwise `out` is not used, store `raw` as is
+		bool done = false;
+	};
+
+	CompressPipe(unsigned nthread, size_t blocksize);
+	~CompressPipe();
+	// buffer of blocksize bytes for the next block, NULL if all blocks are in use
+	char *next();
+	// submit the block got from next() with `len` bytes filled
+	void put(size_t len);
+	// the oldest block put, waiting for it to be done. NULL if there is none
+	const Block *get();
+	// finished with the block from get()
+	void pop();
+
+private:
+	size_t _blocksize;
+	size_t _nblock;
+	std::unique_ptr<Block[]> _blocks;
+	size_t _head = 0;	// oldest block put
+	size_t _count = 0;	// blocks put and not popped yet
+	std::deque<size_t> _todo;
+	bool _stop = false;
+	std::mutex _lock;
+	std::condition_variable _hasTodo;
+	std::condition_variable _hasDone;
+	std::vector<std::thread> _workers;
+	void work();
+};
@@ -0,0 +1,123 @@
+#include "stdafx.h"
+#include "ContentHash.h"
+
+#include <string.h>
+#include "auto_buf.hpp"
+#include "fsadapter.h"
+#include "pe_log.h"
+extern "C"
+{
+#include "libsmb2/sha.h"
+}
+
+static const uint64_t PRIME1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t PRIME3 = 0x165667B19E3779F9ULL;
+static const uint64_t PRIME4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t PRIME5 = 0x27D4EB2F165667C5ULL;
+
+static inline uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+// little endian only, as the rest of the records
+static inline uint64_t read64(const uint8_t *p) { uint64_t v; memcpy(&v, p, 8); return v; }
+static inline uint64_t read32(const uint8_t *p) { uint32_t v; memcpy(&v, p, 4); return v; }
+static inline uint64_t xxround(uint64_t acc, uint64_t input) { return rotl(acc + input * PRIME2, 31) * PRIME1; }
+static inline uint64_t xxmerge(uint64_t acc, uint64_t v) { return (acc ^ xxround(0, v)) * PRIME1 + PRIME4; }
+
+void ContentHash::reset(uint64_t seed /*= 0*/)
+{
+	_v[0] = seed + PRIME1 + PRIME2;
+	_v[1] = seed + PRIME2;
+	_v[2] = seed;
+	_v[3] = seed - PRIME1;
+	_total = 0;
+	_buflen = 0;
+}
+
+void ContentHash::update(const void *data, size_t len)
+{
+	const uint8_t *p = (const uint8_t *)data;
+	const uint8_t *end = p + len;
+	_total += len;
+	if (_buflen + len < 32)
+	{
+		memcpy(_buf + _buflen, p, len);
+		_buflen += len;
+		return;
+	}
+	if (_buflen > 0)
+	{
+		size_t fill = 32 - _buflen;
+		memcpy(_buf + _buflen, p, fill);
+		p += fill;
+		for (int i = 0; i < 4; ++i)
+			_v[i] = xxround(_v[i], read64(_buf + i * 8));
+		_buflen = 0;
+	}
+	uint64_t v0 = _v[0], v1 = _v[1], v2 = _v[2], v3 = _v[3];
+	for (; p + 32 <= end; p += 32)
+	{
+		v0 = xxround(v0, read64(p));
+		v1 = xxround(v1, read64(p + 8));
+		v2 = xxround(v2, read64(p + 16));
+		v3 = xxround(v3, read64(p + 24));
+	}
+	_v[0] = v0, _v[1] = v1, _v[2] = v2, _v[3] = v3;
+	_buflen = end - p;
+	memcpy(_buf, p, _buflen);
+}
+
+uint64_t ContentHash::digest() const
+{
+	uint64_t h = 0;
+	if (_total >= 32)
+	{
+		h = rotl(_v[0], 1) + rotl(_v[1], 7) + rotl(_v[2], 12) + rotl(_v[3], 18);
+		for (int i = 0; i < 4; ++i)
+			h = xxmerge(h, _v[i]);
+	}
+	else
+		h = _v[2] + PRIME5;
+	h += _total;
+	const uint8_t *p = _buf;
+	const uint8_t *end = _buf + _buflen;
+	for (; p + 8 <= end; p += 8)
+		h = rotl(h ^ xxround(0, read64(p)), 27) * PRIME1 + PRIME4;
+	if (p + 4 <= end)
+	{
+		h = rotl(h ^ (read32(p) * PRIME1), 23) * PRIME2 + PRIME3;
+		p += 4;
+	}
+	for (; p < end; ++p)
+		h = rotl(h ^ (*p * PRIME5), 11) * PRIME1;
+	h ^= h >> 33;
+	h *= PRIME2;
+	h ^= h >> 29;
+	h *= PRIME3;
+	h ^= h >> 32;
+	return h ? h : 1;
+}
+
+int ContentHash::file(const char *filename, uint64_t &hash, uint8_t *sha256 /*= NULL*/)
+{
+	LocalFile lfp;
+	if (lfp.open(filename) != 0)
+		PELOG_ERROR_RETURN((PLV_ERROR, "Cannot read file to hash %s\n", filename), -1);
+	ContentHash ch;
+	SHA256Context sha;
+	SHA256Reset(&sha);
+	abuf<char> buf(1024 * 1024);
+	size_t len = 0;
+	while ((len = lfp.read(buf, buf.size())) > 0)
+	{
+		ch.update(buf, len);
+		if (sha256)
+			SHA256Input(&sha, (const uint8_t *)buf.buf(), (unsigned int)len);
+		lfp.release(lfp.tell());
+	}
+	if (lfp.error())
+		PELOG_ERROR_RETURN((PLV_ERROR, "Read file to hash failed %s\n", filename), -1);
+	hash = ch.digest();
+	if (sha256)
+		SHA256Result(&sha, sha256);
+	return 0;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// 64 bit hash of file contents, XXH64 with seed 0 by default. Fast enough to be bound by disk reads.
+// Not cryptographic, only to tell whether a file has changed since the last time it was seen.
+class ContentHash
+{
+public:
+	ContentHash(uint64_t seed = 0) { reset(seed); }
+	void reset(uint64_t seed = 0);
+	void update(const void *data, size_t len);
+	// never 0, which is kept for unknown hashes
+	uint64_t digest() const;
+
+	// hash of a whole local file, reading it without polluting the page cache.
+	// `sha256`: if not NULL, receives the SHA-256 of the file too, 32 bytes
+	static int file(const char *filename, uint64_t &hash, uint8_t *sha256 = NULL);
+
+private:
+	uint64_t _v[4];
+	uint64_t _total;
+	uint8_t _buf[32];
+	size_t _buflen;
+};
@@ -0,0 +1,705 @@
+#include "stdafx.h"
+#include "IgnoreMatcher.h"
+
+#include <string.h>
+#include <ctype.h>
+#include <algorithm>
+#include <map>
+
+#include "fsadapter.h"
+#include "pe_log.h"
+
+bool gitignore_glob_match(const char *text, size_t n, const std::string &glob);
+
+namespace
+{
+
+enum { MAXDFASTATES = 4096 };	// per DFA. rules are split into more DFAs if exceeded
+
+inline unsigned char foldc(unsigned char c) { return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c; }
+
+// one step of a glob
+struct Elem
+{
+	enum Type { SET, STAR, ANY, END } type;	// STAR: [^/]*, ANY: .*, END: matched
+	uint64_t set[4];	// folded chars, for SET
+	Elem(Type t = SET) : type(t) { memset(set, 0, sizeof(set)); }
+	void add(unsigned c) { set[c >> 6] |= (uint64_t)1 << (c & 63); }
+	bool has(unsigned c) const { return (set[c >> 6] >> (c & 63) & 1) != 0; }
+};
+
+// parse a glob following gitignore_glob_match(). false if it can not be modeled
+bool parseGlob(const char *p, size_t m, std::vector<Elem> &out)
+{
+	out.clear();
+	for (size_t j = 0; j < m;)
+	{
+		Elem e;
+		switch (p[j])
+		{
+		case '*':
+			if (j + 1 < m && p[j + 1] == '*')
+			{
+				j += 2;
+				e.type = Elem::ANY;	// trailing "**" matches everything
+				if (j == m)
+					break;
+				if (p[j] != '/')	// gitignore_glob_match() gives up on "**x"
+					return false;
+				// "**/" is zero or more dirs, which is in fact any string. but it only matches with
+				// some text left, so when followed by nothing but "*" or "**", it is any non-empty string
+				if (++j == m || (m - j <= 2 && p[m - 1] == '*' && p[j] == '*'))
+				{
+					Elem one;
+					for (unsigned c = 1; c < 256; ++c)
+						one.add(c);
+					out.push_back(one);
+					j = m;
+				}
+			}
+			else
+			{
+				e.type = Elem::STAR;
+				++j;
+			}
+			break;
+		case '?':
+			for (unsigned c = 1; c < 256; ++c)
+				if (c != '/')
+					e.add(c);
+			++j;
+			break;
+		case '[':
+		{
+			bool reverse = j + 1 < m && (p[j + 1] == '^' || p[j + 1] == '!');
+			if (reverse)
+				j++;
+			unsigned lastchr;
+			for (lastchr = 256; ++j < m && p[j] != ']'; lastchr = foldc(p[j]))
+			{
+				if (lastchr < 256 && p[j] == '-' && j + 1 < m && p[j + 1] != ']')
+				{
+					for (unsigned c = lastchr, hi = foldc(p[++j]); c <= hi; ++c)
+						e.add(c);
+				}
+				else
+					e.add(foldc(p[j]));
+			}
+			if (j >= m)	// not closed
+				return false;
+			++j;
+			if (reverse)
+			{
+				for (int i = 0; i < 4; ++i)
+					e.set[i] = ~e.set[i];
+			}
+			e.set['/' >> 6] &= ~((uint64_t)1 << ('/' & 63));
+			e.set[0] &= ~(uint64_t)1;	// never NUL
+			break;
+		}
+		case '\\':
+			if (j + 1 < m)
+				j++;
+			// FALLTHROUGH
+		default:
+			e.add(foldc(p[j]));
+			++j;
+			break;
+		}
+		out.push_back(e);
+	}
+	out.push_back(Elem(Elem::END));
+	return true;
+}
+
+inline bool isLiteral(const char *p, size_t m)
+{
+	for (size_t i = 0; i < m; ++i)
+		if (p[i] == '*' || p[i] == '?' || p[i] == '[' || p[i] == '\\')
+			return false;
+	return true;
+}
+
+// skip leading "./" and "/", which path patterns starting with "/" ignore, same as gitignore_glob_match().
+// `dir`: the path is a dir followed by "/name"
+inline void skipRoot(const char *&path, size_t &len, bool dir)
+{
+	while (len >= 2 && path[0] == '.' && path[1] == '/')
+	{
+		path += 2;
+		len -= 2;
+	}
+	if (dir && len == 1 && path[0] == '.')
+		len = 0;
+	else if (len > 0 && path[0] == '/')
+	{
+		++path;
+		--len;
+	}
+}
+
+}	// namespace
+
+struct IgnoreMatcher::Glob
+{
+	int32_t idx = -1;
+	bool dir = false;
+	const std::string *pat = NULL;
+	std::vector<Elem> elems;
+};
+
+const IgnoreMatcher::NameTable::Slot *IgnoreMatcher::NameTable::lookup(
+	uint32_t parent, const char *name, size_t len, uint32_t hash) const
+{
+	size_t mask = _slots.size() - 1;
+	for (size_t i = hash & mask; true; i = (i + 1) & mask)
+	{
+		const Slot &slot = _slots[i];
+		if (slot.id == NONE)
+			return &slot;
+		if (slot.hash != hash || slot.parent != parent || slot.len != len)
+			continue;
+		const char *sname = _names.data() + slot.off;
+		size_t k = 0;
+		while (k < len && (unsigned char)sname[k] == foldc(name[k]))
+			++k;
+		if (k == len)
+			return &slot;
+	}
+}
+
+void IgnoreMatcher::NameTable::grow()
+{
+	std::vector<Slot> old;
+	old.swap(_slots);
+	_slots.resize(std::max(old.size() * 2, (size_t)16));
+	size_t mask = _slots.size() - 1;
+	for (const Slot &slot : old)
+	{
+		if (slot.id == NONE)
+			continue;
+		size_t i = slot.hash & mask;
+		while (_slots[i].id != NONE)
+			i = (i + 1) & mask;
+		_slots[i] = slot;
+	}
+}
+
+uint32_t IgnoreMatcher::NameTable::insert(uint32_t parent, const char *name, size_t len)
+{
+	if ((_count + 1) * 2 > _slots.size())
+		grow();
+	uint32_t hash = pathHashDp(name, len) ^ parent * 0x9E3779B1u;
+	Slot &slot = const_cast<Slot &>(*lookup(parent, name, len, hash));
+	if (slot.id != NONE)
+		return slot.id;
+	slot.hash = hash;
+	slot.parent = parent;
+	slot.off = (uint32_t)_names.size();
+	slot.len = (uint32_t)len;
+	slot.id = _count++;
+	for (size_t i = 0; i < len; ++i)
+		_names.push_back(foldc(name[i]));
+	return slot.id;
+}
+
+uint32_t IgnoreMatcher::NameTable::find(uint32_t parent, const char *name, size_t len) const
+{
+	if (_count == 0)
+		return NONE;
+	return lookup(parent, name, len, pathHashDp(name, len) ^ parent * 0x9E3779B1u)->id;
+}
+
+uint32_t IgnoreMatcher::NameTable::find(uint32_t parent, const char *name, size_t len, uint32_t namehash) const
+{
+	if (_count == 0)
+		return NONE;
+	return lookup(parent, name, len, namehash ^ parent * 0x9E3779B1u)->id;
+}
+
+int32_t IgnoreMatcher::Dfa::step(int32_t state, const char *s, size_t n) const
+{
+	for (size_t i = 0; i < n && state != 0; ++i)
+		state = next[state * nclass + classes[(unsigned char)s[i]]];
+	return state;
+}
+
+int32_t IgnoreMatcher::Dfa::run(const char *s, size_t n, bool isdir, int32_t state /*= 1*/) const
+{
+	state = step(state, s, n);
+	return state == 0 ? -1 : accept[state].get(isdir);
+}
+
+// add literal path `p`, or everything beneath it if `subtree`
+void IgnoreMatcher::Trie::add(const char *p, size_t m, bool subtree, int32_t idx, bool dironly)
+{
+	uint32_t node = 0;
+	for (size_t cb = 0; cb < m;)
+	{
+		size_t ce = cb;
+		while (ce < m && p[ce] != '/')
+			++ce;
+		uint32_t count = names.size();
+		uint32_t child = names.insert(node, p + cb, ce - cb) + 1;
+		if (names.size() != count)
+		{
+			nodes.resize(names.size() + 1);
+			nodes[node].nchild++;
+		}
+		node = child;
+		cb = ce + 1;
+	}
+	if (subtree)
+		nodes[node].subtree.add(idx, dironly);
+	else
+		nodes[node].exact.add(idx, dironly);
+}
+
+int32_t IgnoreMatcher::Trie::match(const char *path, size_t len, bool isdir, int32_t best) const
+{
+	if (nodes.size() <= 1)
+		return best;
+	uint32_t node = 0;
+	for (size_t cb = 0; cb < len;)
+	{
+		size_t ce = cb;
+		while (ce < len && path[ce] != '/')
+			++ce;
+		uint32_t id = names.find(node, path + cb, ce - cb);
+		if (id == NameTable::NONE)
+			break;
+		node = id + 1;
+		best = std::max(best, ce < len ? nodes[node].subtree.get(isdir) : nodes[node].exact.get(isdir));
+		cb = ce + 1;
+	}
+	return best;
+}
+
+uint32_t IgnoreMatcher::Trie::prefix(const char *dir, size_t len, Best &inherit) const
+{
+	uint32_t node = nodes.size() > 1 ? 0 : (uint32_t)NameTable::NONE;
+	for (size_t cb = 0; cb < len && node != NameTable::NONE;)
+	{
+		size_t ce = cb;
+		while (ce < len && dir[ce] != '/')
+			++ce;
+		uint32_t id = names.find(node, dir + cb, ce - cb);
+		node = id == NameTable::NONE ? (uint32_t)NameTable::NONE : id + 1;
+		if (node != NameTable::NONE)
+			inherit.add(nodes[node].subtree);
+		cb = ce + 1;
+	}
+	return node != NameTable::NONE && nodes[node].nchild > 0 ? node : (uint32_t)NameTable::NONE;
+}
+
+int32_t IgnoreMatcher::Trie::matchEntry(uint32_t node, const char *name, size_t nlen, uint32_t hash, bool isdir, int32_t best) const
+{
+	uint32_t id = names.find(node, name, nlen, hash);
+	return id == NameTable::NONE ? best : std::max(best, nodes[id + 1].exact.get(isdir));
+}
+
+// gitignore style lines
+void IgnoreMatcher::parse(FILE *fp, std::vector<Pattern> &patterns)
+{
+	patterns.clear();
+	char buf[1024];
+	while (fgets(buf, 1024, fp))
+	{
+		bool neg = false, dir = false;
+		char *pb = NULL, *pe = NULL;
+		for (pb = buf; *pb > 0 && isspace(*pb); ++pb)
+			;
+		if (!*pb || *pb == '#')
+			continue;
+		if (*pb == '!')
+		{
+			neg = true;
+			++pb;
+		}
+		for (pe = pb; *pe; ++pe)
+			;
+		for (--pe; *pe > 0 && isspace(*pe); --pe)
+			;
+		++pe;
+		if (pe[-1] == '/')
+		{
+			dir = true;
+			--pe;
+		}
+		if (pe <= pb)
+			continue;
+		patterns.emplace_back();
+		patterns.back().pat.assign(pb, pe);
+		patterns.back().dir = dir;
+		patterns.back().neg = neg;
+	}
+}
+
+int IgnoreMatcher::build(const std::vector<Pattern> &patterns)
+{
+	_neg.resize(patterns.size());
+	std::vector<Glob> baseglobs, rootglobs, pathglobs;
+	std::vector<Elem> elems;
+	for (size_t k = 0; k < patterns.size(); ++k)
+	{
+		const Pattern &pattern = patterns[k];
+		int32_t idx = (int32_t)k;
+		_neg[k] = pattern.neg ? 1 : 0;
+		const char *p = pattern.pat.c_str();
+		size_t m = pattern.pat.length();
+		bool anchored = false;	// match whole path, otherwise only the basename
+		bool rooted = m > 1 && p[0] == '/';	// match the path without leading "./" and "/"
+		if (rooted)
+		{
+			anchored = true;
+			++p;
+			--m;
+		}
+		else
+			anchored = memchr(p, '/', m) != NULL;
+
+		if (!anchored && isLiteral(p, m))
+		{
+			uint32_t id = _names.insert(0, p, m);
+			_nameBest.resize(_names.size());
+			_nameBest[id].add(idx, pattern.dir);
+			continue;
+		}
+		if (!anchored && m > 2 && p[0] == '*' && p[1] == '.' && isLiteral(p + 1, m - 1))
+		{
+			uint32_t id = _exts.insert(0, p + 1, m - 1);
+			_extBest.resize(_exts.size());
+			_extBest[id].add(idx, pattern.dir);
+			continue;
+		}
+		if (anchored)
+		{
+			// literal path, or literal path followed by "/**"
+			bool subtree = m > 3 && memcmp(p + m - 3, "/**", 3) == 0;
+			size_t lm = subtree ? m - 3 : m;
+			bool trie = lm > 0 && isLiteral(p, lm) && p[0] != '/' && p[lm - 1] != '/' &&
+				std::search_n(p, p + lm, 2, '/') == p + lm;	// no empty components
+			if (trie)
+			{
+				(rooted ? _trie : _reltrie).add(p, lm, subtree, idx, pattern.dir);
+				continue;
+			}
+		}
+		if (parseGlob(p, m, elems))
+		{
+			std::vector<Glob> &globs = rooted ? rootglobs : anchored ? pathglobs : baseglobs;
+			globs.emplace_back();
+			globs.back().idx = idx;
+			globs.back().dir = pattern.dir;
+			globs.back().pat = &pattern.pat;
+			globs.back().elems.swap(elems);
+			continue;
+		}
+		PELOG_LOG((PLV_VERBOSE, "Ignore pattern not compiled: %s\n", pattern.pat.c_str()));
+		_fallback.push_back({ idx, pattern.dir, pattern.pat });
+	}
+
+	if (buildDfas(baseglobs, true, false) != 0 || buildDfas(rootglobs, false, true) != 0 ||
+			buildDfas(pathglobs, false, false) != 0)
+		return -1;
+	std::sort(_fallback.begin(), _fallback.end(),
+		[](const Fallback &l, const Fallback &r) { return l.idx < r.idx; });
+	PELOG_LOG((PLV_VERBOSE, "Ignore patterns compiled: %d names, %d exts, %d trie nodes, %d dfas, %d fallbacks\n",
+		(int)_names.size(), (int)_exts.size(), (int)(_trie.nodes.size() + _reltrie.nodes.size()), (int)_dfas.size(), (int)_fallback.size()));
+	return 0;
+}
+
+// build DFAs for `globs`, splitting them when a DFA grows too large
+int IgnoreMatcher::buildDfas(std::vector<Glob> &globs, bool basename, bool rooted)
+{
+	if (globs.empty())
+		return 0;
+	std::vector<std::vector<const Glob *>> todo(1);
+	for (const Glob &glob : globs)
+		todo.back().push_back(&glob);
+	while (!todo.empty())
+	{
+		std::vector<const Glob *> part;
+		part.swap(todo.back());
+		todo.pop_back();
+		_dfas.emplace_back();
+		int res = buildDfa(part, basename, _dfas.back());
+		_dfas.back().rooted = rooted;
+		if (res == 0)
+			continue;
+		_dfas.pop_back();
+		if (res < 0 && part.size() > 1)
+		{
+			todo.emplace_back(part.begin(), part.begin() + part.size() / 2);
+			todo.emplace_back(part.begin() + part.size() / 2, part.end());
+		}
+		else	// a single glob too complex, leave it to gitignore_glob_match()
+		{
+			const Glob &glob = *part[0];
+			PELOG_LOG((PLV_VERBOSE, "Ignore pattern not compiled: %s\n", glob.pat->c_str()));
+			_fallback.push_back({ glob.idx, glob.dir, *glob.pat });
+		}
+	}
+	return 0;
+}
+
+// subset construction over all positions of `globs`
+// return 0 on success, <0 if states exceed MAXDFASTATES
+int IgnoreMatcher::buildDfa(const std::vector<const Glob *> &globs, bool basename, Dfa &dfa)
+{
+	struct Pos
+	{
+		const Elem *elem;
+		const Glob *glob;
+	};
+	std::vector<Pos> pos;
+	std::vector<size_t> starts;
+	for (const Glob *glob : globs)
+	{
+		starts.push_back(pos.size());
+		for (const Elem &elem : glob->elems)
+			pos.push_back({ &elem, glob });
+	}
+	size_t nwords = (pos.size() + 63) / 64;
+	typedef std::vector<uint64_t> PosSet;
+	auto test = [](const PosSet &s, size_t i) { return (s[i >> 6] >> (i & 63) & 1) != 0; };
+	auto set = [](PosSet &s, size_t i) { s[i >> 6] |= (uint64_t)1 << (i & 63); };
+
+	// input classes: bytes behaving the same in all elements
+	std::map<std::string, uint32_t> sigs;
+	uint8_t rep[256];	// a folded byte of each class
+	for (unsigned b = 0; b < 256; ++b)
+	{
+		unsigned char f = foldc((unsigned char)b);
+		std::string sig(1, f == '/' ? 1 : 0);
+		for (const Pos &p : pos)
+			if (p.elem->type == Elem::SET)
+				sig.push_back(p.elem->has(f) ? 1 : 0);
+		auto ins = sigs.insert(std::make_pair(sig, (uint32_t)sigs.size()));
+		dfa.classes[b] = (uint8_t)ins.first->second;
+		rep[ins.first->second] = f;
+	}
+	dfa.nclass = (uint32_t)sigs.size();
+	dfa.basename = basename;
+
+	// closure over STAR/ANY, then drop globs that can no longer change the result: once a glob
+	// ending with ".*" (or "[^/]*" on basenames) has matched, lower patterns never win
+	auto settle = [&](PosSet &s)
+	{
+		int32_t stickany = -1, stickdir = -1;
+		for (size_t i = 0; i < pos.size(); ++i)
+		{
+			if (!test(s, i))
+				continue;
+			int type = pos[i].elem->type;
+			if (type == Elem::STAR || type == Elem::ANY)
+			{
+				set(s, i + 1);
+				if ((type == Elem::ANY || basename) && pos[i + 1].elem->type == Elem::END)
+				{
+					int32_t &stick = pos[i].glob->dir ? stickdir : stickany;
+					stick = std::max(stick, pos[i].glob->idx);
+				}
+			}
+		}
+		for (size_t g = 0; g < globs.size(); ++g)
+		{
+			const Glob *glob = globs[g];
+			if (glob->idx >= stickany && (!glob->dir || glob->idx >= stickdir))
+				continue;
+			for (size_t i = starts[g]; i < starts[g] + glob->elems.size(); ++i)
+				s[i >> 6] &= ~((uint64_t)1 << (i & 63));
+		}
+	};
+
+	std::map<PosSet, int32_t> states;
+	std::vector<PosSet> sets;
+	auto addState = [&](const PosSet &s) -> int32_t
+	{
+		auto ins = states.insert(std::make_pair(s, (int32_t)sets.size()));
+		if (ins.second)
+		{
+			sets.push_back(s);
+			Best best;
+			for (size_t i = 0; i < pos.size(); ++i)
+				if (test(s, i) && pos[i].elem->type == Elem::END)
+					best.add(pos[i].glob->idx, pos[i].glob->dir);
+			dfa.accept.push_back(best);
+		}
+		return ins.first->second;
+	};
+	addState(PosSet(nwords));	// 0: dead
+	PosSet start(nwords);
+	for (size_t s : starts)
+		set(start, s);
+	settle(start);
+	addState(start);	// 1: start
+
+	std::vector<size_t> from;
+	for (size_t si = 1; si < sets.size(); ++si)
+	{
+		if (sets.size() > MAXDFASTATES)
+			return -1;
+		dfa.next.resize(sets.size() * dfa.nclass);
+		from.clear();
+		for (size_t i = 0; i < pos.size(); ++i)
+			if (test(sets[si], i))
+				from.push_back(i);
+		for (uint32_t c = 0; c < dfa.nclass; ++c)
+		{
+			PosSet to(nwords);
+			for (size_t i : from)
+			{
+				const Elem &elem = *pos[i].elem;
+				if ((elem.type == Elem::SET && elem.has(rep[c])) ||
+					(elem.type == Elem::STAR && rep[c] != '/') ||
+					elem.type == Elem::ANY)
+					set(to, elem.type == Elem::SET ? i + 1 : i);
+			}
+			settle(to);
+			int32_t next = addState(to);
+			dfa.next[si * dfa.nclass + c] = next;
+		}
+	}
+	dfa.next.resize(sets.size() * dfa.nclass);	// row 0 stays dead
+	return 0;
+}
+
+int IgnoreMatcher::match(const char *path, size_t len, bool isdir) const
+{
+	const char *rpath = path;
+	size_t rlen = len;
+	skipRoot(rpath, rlen, false);
+	size_t bpos = len;
+	while (bpos > 0 && path[bpos - 1] != '/')
+		--bpos;
+	const char *base = path + bpos;
+	size_t blen = len - bpos;
+
+	int32_t best = matchBase(base, blen, isdir, -1);
+	best = _trie.match(rpath, rlen, isdir, best);
+	best = _reltrie.match(path, len, isdir, best);
+	for (const Dfa &dfa : _dfas)
+		best = std::max(best, dfa.basename ? dfa.run(base, blen, isdir) :
+			dfa.rooted ? dfa.run(rpath, rlen, isdir) : dfa.run(path, len, isdir));
+	best = matchFallback(path, len, isdir, best);
+	return best < 0 ? -1 : _neg[best] ? 0 : 1;
+}
+
+void IgnoreMatcher::prefix(const char *dir, size_t len, Prefix &pre) const
+{
+	while (len > 0 && dir[len - 1] == '/')
+		--len;
+	pre.dir.assign(dir, len);
+	pre.inherit = Best();
+	// "dir/name" the way match() sees it for patterns starting with "/"
+	const char *rdir = dir;
+	size_t rlen = len;
+	skipRoot(rdir, rlen, true);
+
+	// literal paths
+	pre.node = _trie.prefix(rdir, rlen, pre.inherit);
+	pre.relnode = _reltrie.prefix(dir, len, pre.inherit);
+
+	// globs. basename ones always stay
+	bool alive = pre.node != NameTable::NONE || pre.relnode != NameTable::NONE ||
+		_names.size() > 0 || _exts.size() > 0 || !_fallback.empty();
+	pre.states.resize(_dfas.size());
+	for (size_t i = 0; i < _dfas.size(); ++i)
+	{
+		const Dfa &dfa = _dfas[i];
+		int32_t state = 1;
+		if (!dfa.basename && dfa.rooted && rlen > 0)
+			state = dfa.step(dfa.step(state, rdir, rlen), "/", 1);
+		else if (!dfa.basename && !dfa.rooted && len > 0)
+			state = dfa.step(dfa.step(state, dir, len), "/", 1);
+		pre.states[i] = state;
+		alive = alive || state != 0;
+	}
+	pre.empty = !alive;
+}
+
+int IgnoreMatcher::match(const Prefix &pre, const char *name, size_t nlen, bool isdir) const
+{
+	int32_t best = matchEntry(pre, name, nlen, pathHashDp(name, nlen), isdir);
+	return best < 0 ? -1 : _neg[best] ? 0 : 1;
+}
+
+void IgnoreMatcher::match(const Prefix &pre, const FsList &items, int8_t *res) const
+{
+	for (size_t k = 0; k < items.size(); ++k)
+	{
+		if (res[k] >= 0)
+			continue;
+		const FsItem &item = items[k];
+		int32_t best = matchEntry(pre, items.name(item), item.nlen, item.hash, item.isdir());
+		if (best >= 0)
+			res[k] = _neg[best] ? 0 : 1;
+	}
+}
+
+// best pattern for `name` in the dir of `pre`. `hash` is pathHashDp() of name
+int32_t IgnoreMatcher::matchEntry(const Prefix &pre, const char *name, size_t nlen, uint32_t hash, bool isdir) const
+{
+	int32_t best = pre.inherit.get(isdir);
+	if (pre.empty)
+		return best;
+	uint32_t id = _names.find(0, name, nlen, hash);
+	if (id != NameTable::NONE)
+		best = std::max(best, _nameBest[id].get(isdir));
+	best = matchExt(name, nlen, isdir, best);
+	if (pre.node != NameTable::NONE)
+		best = _trie.matchEntry(pre.node, name, nlen, hash, isdir, best);
+	if (pre.relnode != NameTable::NONE)
+		best = _reltrie.matchEntry(pre.relnode, name, nlen, hash, isdir, best);
+	for (size_t i = 0; i < _dfas.size(); ++i)
+	{
+		if (pre.states[i] != 0)
+			best = std::max(best, _dfas[i].run(name, nlen, isdir, pre.states[i]));
+	}
+	if (!_fallback.empty() && _fallback.back().idx > best)
+	{
+		std::string path = pre.dir;
+		if (!path.empty())
+			path += '/';
+		path.append(name, nlen);
+		best = matchFallback(path.c_str(), path.length(), isdir, best);
+	}
+	return best;
+}
+
+// literal names and "*.ext"
+int32_t IgnoreMatcher::matchBase(const char *base, size_t blen, bool isdir, int32_t best) const
+{
+	uint32_t id = _names.find(0, base, blen);
+	if (id != NameTable::NONE)
+		best = std::max(best, _nameBest[id].get(isdir));
+	return matchExt(base, blen, isdir, best);
+}
+
+int32_t IgnoreMatcher::matchExt(const char *base, size_t blen, bool isdir, int32_t best) const
+{
+	if (_exts.size() == 0)
+		return best;
+	for (size_t i = 0; i < blen; ++i)
+	{
+		if (base[i] != '.')
+			continue;
+		uint32_t id = _exts.find(0, base + i, blen - i);
+		if (id != NameTable::NONE)
+			best = std::max(best, _extBest[id].get(isdir));
+	}
+	return best;
+}
+
+// patterns not compiled. only later patterns can override
+int32_t IgnoreMatcher::matchFallback(const char *path, size_t len, bool isdir, int32_t best) const
+{
+	for (size_t i = _fallback.size(); i > 0 && _fallback[i - 1].idx > best; --i)
+	{
+		const Fallback &fb = _fallback[i - 1];
+		if ((!fb.dir || isdir) && gitignore_glob_match(path, len, fb.pat))
+			return fb.idx;
+	}
+	return best;
+}
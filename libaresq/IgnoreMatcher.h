@@ -0,0 +1,161 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <stdio.h>
+#include <algorithm>
+
+class FsList;
+
+// Ignore patterns compiled for fast matching. Built once, read only afterwards.
+//
+// Patterns keep the syntax and semantics of gitignore_glob_match(), and the last matching pattern
+// decides. Each pattern goes into the cheapest bucket that can handle it:
+//  - literal basename ("Thumbs.db"): hash of names
+//  - "*.ext" basename: hash of extensions, looked up at each '.' of the basename
+//  - literal path ("/build", "doc/tmp"), optionally followed by "/**": trie of path components
+//  - other globs: DFAs combining all of them, one pass over the basename or the path
+//  - the few globs the DFA does not model: gitignore_glob_match(), only if they can override
+// so the cost of a query depends on length of the path, not the number of patterns.
+// Path patterns starting with "/" match the path without leading "./" and "/", other path patterns
+// match it as is, so each kind has a trie and DFAs of its own.
+class IgnoreMatcher
+{
+public:
+	struct Pattern
+	{
+		std::string pat;
+		bool neg = false;
+		bool dir = false;
+	};
+
+	// index of the last matching pattern, for dirs and for files
+	struct Best
+	{
+		int32_t any = -1;
+		int32_t dir = -1;	// dir only patterns
+		void add(int32_t idx, bool dironly) { int32_t &b = dironly ? dir : any; if (idx > b) b = idx; }
+		void add(const Best &o) { any = std::max(any, o.any); dir = std::max(dir, o.dir); }
+		int32_t get(bool isdir) const { return isdir && dir > any ? dir : any; }
+	};
+
+	// rules reduced to what can still match beneath a dir, so entries of the dir are tested
+	// without going through the dir path again
+	struct Prefix
+	{
+		std::string dir;	// normalized dir path, for patterns not compiled
+		std::vector<int32_t> states;	// per DFA, state after "dir/". 0 if nothing beneath can match
+		uint32_t node = 0;	// trie node of dir, NONE if no literal path goes beneath
+		uint32_t relnode = 0;	// same for literal paths not starting with "/"
+		Best inherit;	// patterns like "dir/**", matching everything beneath
+		bool empty = false;	// no pattern other than `inherit` can match beneath
+		// no pattern matches anything beneath
+		bool none() const { return empty && inherit.any < 0 && inherit.dir < 0; }
+	};
+
+	IgnoreMatcher() {}
+	~IgnoreMatcher() {}
+
+	// read patterns of an ignore file
+	static void parse(FILE *fp, std::vector<Pattern> &patterns);
+	int build(const std::vector<Pattern> &patterns);
+	// `path` relative to the dir of the ignore file, not required to be null terminated
+	// >0: ignore, 0: kept by a negative pattern, <0: no pattern matches
+	int match(const char *path, size_t len, bool isdir) const;
+	// `dir` relative to the dir of the ignore file, "" for that dir itself
+	void prefix(const char *dir, size_t len, Prefix &pre) const;
+	// same as match() on "dir/name", `name` is an entry directly in the dir of `pre`
+	int match(const Prefix &pre, const char *name, size_t nlen, bool isdir) const;
+	// match() of all entries of a dir listing in one pass, reusing name hashes of the listing.
+	// only entries with res[i] < 0 are tested, and res[i] is set to the result
+	void match(const Prefix &pre, const FsList &items, int8_t *res) const;
+	size_t size() const { return _neg.size(); }
+
+private:
+	IgnoreMatcher(const IgnoreMatcher &) = delete;
+	IgnoreMatcher &operator =(const IgnoreMatcher &) = delete;
+
+	int32_t matchEntry(const Prefix &pre, const char *name, size_t nlen, uint32_t hash, bool isdir) const;
+	int32_t matchBase(const char *base, size_t blen, bool isdir, int32_t best) const;
+	int32_t matchExt(const char *base, size_t blen, bool isdir, int32_t best) const;
+	int32_t matchFallback(const char *path, size_t len, bool isdir, int32_t best) const;
+
+	// open addressing hash of case folded strings, each under a parent id
+	class NameTable
+	{
+		struct Slot
+		{
+			uint32_t hash = 0;
+			uint32_t parent = 0;
+			uint32_t off = 0;
+			uint32_t len = 0;
+			uint32_t id = NONE;
+		};
+		std::vector<Slot> _slots;
+		std::string _names;
+		uint32_t _count = 0;
+		const Slot *lookup(uint32_t parent, const char *name, size_t len, uint32_t hash) const;
+		void grow();
+	public:
+		enum : uint32_t { NONE = 0xFFFFFFFF };
+		// return id of the name, new ids are given in sequence from 0
+		uint32_t insert(uint32_t parent, const char *name, size_t len);
+		uint32_t find(uint32_t parent, const char *name, size_t len) const;
+		// `namehash` is pathHashDp() of name, when it is known already
+		uint32_t find(uint32_t parent, const char *name, size_t len, uint32_t namehash) const;
+		uint32_t size() const { return _count; }
+	};
+
+	// combined DFA of globs, over case folded bytes. state 0 is dead
+	struct Dfa
+	{
+		bool basename = false;	// runs on basename, otherwise on whole path
+		bool rooted = false;	// globs starting with "/", runs on the path without leading "./" and "/"
+		uint8_t classes[256];	// byte to input class
+		uint32_t nclass = 0;
+		std::vector<int32_t> next;	// [state * nclass + class]
+		std::vector<Best> accept;
+		// state after `s` from `state`, 0 if dead
+		int32_t step(int32_t state, const char *s, size_t n) const;
+		int32_t run(const char *s, size_t n, bool isdir, int32_t state = 1) const;
+	};
+	struct Glob;
+	int buildDfas(std::vector<Glob> &globs, bool basename, bool rooted);
+	int buildDfa(const std::vector<const Glob *> &globs, bool basename, Dfa &dfa);
+
+	struct TrieNode
+	{
+		Best exact;	// path equals to this node
+		Best subtree;	// path beneath this node
+		uint32_t nchild = 0;
+	};
+	// literal paths. parent is node index, node index is id + 1. 0 is root
+	struct Trie
+	{
+		NameTable names;
+		std::vector<TrieNode> nodes;
+		void add(const char *p, size_t m, bool subtree, int32_t idx, bool dironly);
+		int32_t match(const char *path, size_t len, bool isdir, int32_t best) const;
+		// node of `dir`, NONE if no path goes beneath. `inherit` gets patterns matching everything beneath
+		uint32_t prefix(const char *dir, size_t len, Best &inherit) const;
+		// `name` directly under `node`. `hash` is pathHashDp() of name
+		int32_t matchEntry(uint32_t node, const char *name, size_t nlen, uint32_t hash, bool isdir, int32_t best) const;
+	};
+
+	std::vector<uint8_t> _neg;	// by pattern index
+	NameTable _names;
+	std::vector<Best> _nameBest;
+	NameTable _exts;
+	std::vector<Best> _extBest;
+	Trie _trie;	// paths starting with "/"
+	Trie _reltrie;	// other paths
+	std::vector<Dfa> _dfas;
+	struct Fallback
+	{
+		int32_t idx;
+		bool dir;
+		std::string pat;
+	};
+	std::vector<Fallback> _fallback;	// in pattern order
+};
@@ -0,0 +1,93 @@
+#include "stdafx.h"
+#include "IgnoreProfile.h"
+
+#include <string.h>
+#include <inttypes.h>
+#include <algorithm>
+#include <chrono>
+#ifdef _MSC_VER
+#	include <intrin.h>
+#	define snprintf _snprintf
+#endif
+
+bool gitignore_glob_match(const char *text, size_t n, const std::string &glob);
+
+static inline uint64_t profileTicks()
+{
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+	return __rdtsc();
+#else
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+void IgnoreProfile::reset(const std::vector<IgnoreMatcher::Pattern> &patterns)
+{
+	_stats.clear();
+	_stats.resize(patterns.size());
+	for (size_t i = 0; i < patterns.size(); ++i)
+	{
+		_stats[i].pat = patterns[i].pat;
+		_stats[i].neg = patterns[i].neg;
+		_stats[i].dir = patterns[i].dir;
+	}
+	_queries = 0;
+}
+
+int IgnoreProfile::match(const char *path, size_t len, bool isdir)
+{
+	++_queries;
+	// evaluate all patterns, not only till the last matching one, so every pattern gets counted
+	Stat *best = NULL;
+	for (Stat &stat : _stats)
+	{
+		if (stat.dir && !isdir)
+			continue;
+		uint64_t start = profileTicks();
+		bool matched = gitignore_glob_match(path, len, stat.pat);
+		stat.ticks += profileTicks() - start;
+		++stat.evals;
+		if (matched)
+		{
+			++stat.matches;
+			best = &stat;
+		}
+	}
+	if (!best)
+		return -1;
+	++best->decided;
+	return best->neg ? 0 : 1;
+}
+
+std::string IgnoreProfile::report() const
+{
+	std::vector<const Stat *> order;
+	uint64_t total = 0;
+	for (const Stat &stat : _stats)
+	{
+		order.push_back(&stat);
+		total += stat.ticks;
+	}
+	std::stable_sort(order.begin(), order.end(),
+		[](const Stat *l, const Stat *r) { return l->ticks > r->ticks; });
+
+	std::string out;
+	char buf[256];
+	snprintf(buf, sizeof(buf), "%" PRIu64 " queries, %d patterns, %" PRIu64 " ticks\n",
+		_queries, (int)_stats.size(), total);
+	out += buf;
+	out += "  idx   cost%        evals      matches      decided  ticks/eval  pattern\n";
+	for (const Stat *stat : order)
+	{
+		snprintf(buf, sizeof(buf), "%5d  %5.1f%%  %11" PRIu64 "  %11" PRIu64 "  %11" PRIu64 "  %10.1f  ",
+			(int)(stat - _stats.data()), total ? stat->ticks * 100.0 / total : 0.0,
+			stat->evals, stat->matches, stat->decided, stat->evals ? (double)stat->ticks / stat->evals : 0.0);
+		out += buf;
+		out += stat->neg ? "!" : "";
+		out += stat->pat;
+		out += stat->dir ? "/" : "";
+		out += stat->matches == 0 ? "  (never matched)\n" : "\n";
+	}
+	return out;
+}
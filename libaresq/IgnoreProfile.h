@@ -0,0 +1,44 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "IgnoreMatcher.h"
+
+// Statistics of each ignore pattern, to find the ones making scans slow or never matching.
+//
+// IgnoreMatcher merges patterns and cannot tell the cost of each one, so here every pattern is
+// evaluated on its own with gitignore_glob_match(), which is how patterns were matched before
+// they were compiled. Much slower than IgnoreMatcher, for profiling only. Not thread safe.
+class IgnoreProfile
+{
+public:
+	struct Stat
+	{
+		std::string pat;
+		bool neg = false;
+		bool dir = false;
+		uint64_t evals = 0;	// times evaluated
+		uint64_t matches = 0;	// times matched
+		uint64_t decided = 0;	// times being the last matching pattern, which decides the result
+		uint64_t ticks = 0;	// time spent, CPU cycles on x86 or nanoseconds. only relative values matter
+	};
+
+	IgnoreProfile() {}
+	~IgnoreProfile() {}
+
+	// start over with new patterns
+	void reset(const std::vector<IgnoreMatcher::Pattern> &patterns);
+	// same result as IgnoreMatcher::match()
+	int match(const char *path, size_t len, bool isdir);
+
+	uint64_t queries() const { return _queries; }
+	const std::vector<Stat> &stats() const { return _stats; }
+	// one line for each pattern, most costly first
+	std::string report() const;
+
+private:
+	std::vector<Stat> _stats;	// by pattern index
+	uint64_t _queries = 0;
+};
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <string>
+#include <vector>
+#include <stdint.h>
 #include "pe_log.h"
 #define LIBCONFIG_STATIC
 #include "libconfig/libconfig.h"
@@ -7,6 +10,8 @@
 #define AR_RUNTIMEDIR ".aresq"
 #define AR_TMPDIR AR_RUNTIMEDIR "/tmp"
 #define AR_HISTDIR AR_RUNTIMEDIR "/hist"
+#define AR_CHUNKDIR AR_RUNTIMEDIR "/chunks"
+#define AR_SIGDIR AR_RUNTIMEDIR "/sigs"
 
 class Remote
 {
@@ -15,11 +20,32 @@ public:
 	virtual ~Remote() {}
 	static Remote *fromConfig(const config_t *config);
 public:
-	virtual int addDir(const char *rbase, const char *path) = 0;
-	virtual int addFile(const char *lbase, const char *rbase, const char *path) = 0;
-	virtual int delDir(const char *rbase, const char *path) = 0;
-	virtual int delFile(const char *rbase, const char *path) = 0;
-	virtual int putHist(const char *rbase, const char *path) = 0;
+	// `path` is relative to `rbase`, and is not required to be null terminated
+	virtual int addDir(const char *rbase, const char *path, size_t plen) = 0;
+	// `hash`: if not NULL, receives ContentHash of the data uploaded
+	virtual int addFile(const char *lbase, const char *rbase, const char *path, size_t plen, uint64_t *hash = NULL) = 0;
+	virtual int delDir(const char *rbase, const char *path, size_t plen) = 0;
+	virtual int delFile(const char *rbase, const char *path, size_t plen) = 0;
+	virtual int putHist(const char *rbase, const char *path, size_t plen) = 0;
+	// rename/move file or dir `path` to `dst`, both relative to `rbase`
+	virtual int rename(const char *rbase, const char *path, size_t plen, const char *dst, size_t dlen) = 0;
+	// copy file `src` already on remote to `path`, without sending data if possible. Aresq::NOTIMPLEMENTED
+	// if the remote cannot do it by itself, upload instead then
+	virtual int copy(const char *sbase, const char *src, size_t slen, const char *rbase, const char *path, size_t plen) = 0;
+	// upload `path` like addFile(), but return once it is started, and have it sent along with other
+	// files queued. Aresq::NOTIMPLEMENTED if it is not for queueing, addFile() it instead
+	virtual int queueFile(const char *lbase, const char *rbase, const char *path, size_t plen) = 0;
+	struct FileDone
+	{
+		std::string path;
+		int res;
+		uint64_t hash;	// ContentHash of the data uploaded
+	};
+	// queued files completed since the last call, in the order they were queued. `all`: wait for all
+	// of them, otherwise only till there is room for one more
+	virtual int doneFiles(std::vector<FileDone> &done, bool all) = 0;
+	// download `path` into local file `lfile`, decoded back to the contents uploaded
+	virtual int getFile(const char *rbase, const char *path, size_t plen, const char *lfile) = 0;
 	// rename/move file or dir. force: delete destination if already exists 
 	virtual int moveFile(const char *oldpath, const char *newpath, bool force) = 0;
 
@@ -12,13 +12,22 @@
 #include <utility>
 #include <memory>
 #include <chrono>
+#include <thread>
+#include <functional>
+#include <unordered_set>
+#include <deque>
 #include <process.h>
 
 #include "Aresq.h"
 #include "auto_buf.hpp"
 #include "fsadapter.h"
+#include "ContentHash.h"
+#include "Chunker.h"
+#include "Compressor.h"
+#include "Cipher.h"
 #include "libsmb2/smb2.h"
 #include "libsmb2/libsmb2.h"
+#include "libsmb2/libsmb2-raw.h"
 #ifdef _MSC_VER
 #	include "libsmb2/msvc/poll.h"
 #	define snprintf _snprintf
@@ -95,14 +104,82 @@ public:
 			smb2_disconnect_share(smb);
 		connected = false;
 	}
+	// a broken connection, nothing is said to the server. calls in flight come back cancelled.
+	// the settings are kept, for the other connections of the pool
+	void drop()
+	{
+		connected = false;
+		if (smb)
+			smb2_destroy_context(smb);
+		smb = NULL;
+	}
 	operator smb2_context *() { return smb; }
 	bool isconnected() const { return connected; }
 	uint32_t getchunksize() const { return chunksize; }
 };
 
+// one more connection of the pool to the share, see RemoteSmb::lane()
+struct SmbLane
+{
+	SmbHandle smb;
+	unsigned fails = 0;	// failures in a row, of connecting or in use
+	time_t retry = 0;	// not connected again before this
+};
+
+// one file of queued uploads, sent by async calls on a connection of the pool along with other files.
+// each call is issued by RemoteSmb::stepUpload() and only its result is kept by the callback
+struct SmbUpload
+{
+	enum { COMPOUND, OPEN, WRITE, TRUNCATE, CLOSE, RENAME, UNLINK, DONE } stage = OPEN;
+	std::string path;	// as queued, relative to rbase
+	std::string lfile, tmpfile, rfile;
+	size_t lane = 0;	// connection of the pool it is sent on
+	smb2_context *smb = NULL;	// of the lane
+	LocalFile lfp;
+	smb2fh *fh = NULL;
+	abuf<char> buf;
+	size_t len = 0;	// padded length of the chunk in buf
+	size_t done = 0;	// written of the chunk
+	uint64_t off = 0;	// of the chunk
+	uint64_t realsize = 0;	// read from local file
+	ContentHash hash;
+	bool issued = false;	// a call of this stage has been issued
+	bool busy = false;	// and not returned yet
+	int status = 0;	// result of the call
+	bool retried = false;	// open retried
+	bool unlinked = false;	// dst deleted for rename
+	int calls = 0;	// of the compound chain
+	int replies = 0;	// to calls of the chain so far
+	int failed = -1;	// first call of the chain failing
+	int res = 0;	// Aresq::StatusCode when DONE
+};
+
 struct RemoteSmbData
 {
 	SmbHandle smb;
+	// scratch buffers for building paths, kept over calls to avoid allocations
+	abufchar lpath;
+	abufchar rpath;
+	abufchar tmppath;
+	abufchar histpath;
+	abufchar chunkpath;
+	abufchar sigpath;
+	abufchar srcpath;
+	bool nocopychunk = false;	// server-side copy not supported by the server
+	unsigned writedepth = 4;	// writes of one file in flight
+	unsigned uploads = 4;	// queued files in flight
+	bool nocompound = false;	// compound chains of small files not taken by the server
+	std::vector<std::unique_ptr<SmbLane>> lanes;	// connections besides smb, lane 1 on
+	size_t nextlane = 0;	// queued files are spread round robin
+	std::deque<std::unique_ptr<SmbUpload>> uploadq;	// queued files in the order queued, not reported yet
+	unsigned uploadseq = 0;	// tells tmp files of queued files apart
+	// chunked mode: files are stored as manifests of deduplicated chunks
+	bool chunked = false;
+	std::unordered_set<std::string> chunks;	// ids of chunks known to be on remote
+	bool compress = false;	// files are stored in compressed containers
+	// files are encrypted with keys derived from this master key
+	bool encrypt = false;
+	uint8_t masterkey[FileCipher::KEYSIZE];
 };
 
 class SmbDir
@@ -134,14 +211,52 @@ public:
 } _wsaguard;
 #endif
 
-std::string buildSmbPath(const char *root, const char *rbase, const char *path)
+// build "root/rbase/path<suffix>" into `out`, skipping empty root or rbase. memory of `out` is reused
+const char *buildSmbPath(abufchar &out, const char *root, const char *rbase, const char *path, size_t plen, const char *suffix = "")
 {
-	std::string ret = path;
-	if (rbase && *rbase)
-		ret = std::string(rbase) + '/' + ret;
-	if (root && *root)
-		ret = std::string(root) + '/' + ret;
-	return ret;
+	size_t rlen = root ? strlen(root) : 0;
+	size_t blen = rbase ? strlen(rbase) : 0;
+	size_t slen = strlen(suffix);
+	out.resize(rlen + 1 + blen + 1 + plen + slen + 1);
+	char *po = out;
+	if (rlen > 0)
+	{
+		memcpy(po, root, rlen);
+		po += rlen;
+		*po++ = '/';
+	}
+	if (blen > 0)
+	{
+		memcpy(po, rbase, blen);
+		po += blen;
+		*po++ = '/';
+	}
+	memcpy(po, path, plen);
+	po += plen;
+	memcpy(po, suffix, slen + 1);
+	return out;
+}
+
+// unique name for temp files in AR_TMPDIR
+static void tmpName(char *buf, size_t size, const char *suffix = "")
+{
+	uint64_t timestamp =
+		std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+#pragma warning(suppress : 4996)
+	int pid = getpid();
+	snprintf(buf, size, "%" PRIu64 ".%d%s", timestamp, pid, suffix);
+}
+
+// get the parent dir of `path` into `out`. return false if there is no parent
+bool parentPath(const char *path, abufchar &out)
+{
+	const char *sep = strrchr(path, '/');
+	if (!sep)
+		return false;
+	out.resize(sep - path + 1);
+	memcpy(out, path, sep - path);
+	out.buf()[sep - path] = 0;
+	return true;
 }
 
 RemoteSmb::RemoteSmb()
@@ -152,6 +267,9 @@ RemoteSmb::RemoteSmb()
 
 RemoteSmb::~RemoteSmb()
 {
+	// calls in flight come back cancelled to the queued files, which are still there
+	d->lanes.clear();
+	d->smb.clear();
 	delete d;
 	d = NULL;
 }
@@ -171,9 +289,50 @@ Remote *RemoteSmb::fromConfig(const config_setting_t *config)
 	password = passworddec.c_str();
 	if (CONFIG_TRUE != config_setting_lookup_string(config, "path", &path))
 		PELOG_ERROR_RETURN((PLV_ERROR, "RemoteSmb 'path' config not found\n"), NULL);
+	bool chunked = false;	// store files as deduplicated chunks
+	config_setting_lookup_bool(config, "chunked", &chunked);
+	bool compress = false;	// compress files not chunked
+	config_setting_lookup_bool(config, "compress", &compress);
+	// writes in flight for each file, to keep links of long round trips busy. each takes a chunk of memory
+	int writedepth = 4;
+	config_setting_lookup_int(config, "writedepth", &writedepth);
+	// files smaller than DELTAMIN uploaded at the same time, so round trips of opening and renaming
+	// one overlap with data of others. those of up to COMPOUNDMAX take a single compound chain. 1: one by one
+	int uploads = 4;
+	config_setting_lookup_int(config, "uploads", &uploads);
+	// connections to the share, large files are striped over them and queued files spread. a single
+	// TCP stream hardly fills a fast link
+	int connections = 1;
+	config_setting_lookup_int(config, "connections", &connections);
+	// 64 hex digits, may be encoded like the password
+	const char *encryptkey = NULL;
+	uint8_t masterkey[FileCipher::KEYSIZE];
+	if (CONFIG_TRUE == config_setting_lookup_string(config, "encryptkey", &encryptkey) &&
+			!FileCipher::parseKey(Aresq::decpwd(encryptkey).c_str(), masterkey))
+		PELOG_ERROR_RETURN((PLV_ERROR, "RemoteSmb 'encryptkey' should be 64 hex digits\n"), NULL);
+	if (encryptkey && chunked)
+		PELOG_ERROR_RETURN((PLV_ERROR, "RemoteSmb 'encryptkey' does not work with 'chunked'\n"), NULL);
 	std::unique_ptr<RemoteSmb> ret(new RemoteSmb);
 	if (ret->init(server, share, user, password, path) != Aresq::OK)
 		return NULL;
+	ret->d->chunked = chunked;
+	ret->d->compress = compress;
+	ret->d->writedepth = (unsigned)std::max(1, std::min(writedepth, 64));
+	ret->d->uploads = (unsigned)std::max(1, std::min(uploads, 64));
+	connections = std::max(1, std::min(connections, 16));
+	for (int i = 1; i < connections; ++i)
+	{
+		ret->d->lanes.push_back(std::unique_ptr<SmbLane>(new SmbLane));
+		ret->lane(i);	// connect now, those failing are tried again later
+	}
+	if (connections > 1)
+		PELOG_LOG((PLV_INFO, "RemoteSmb %d connections\n", connections));
+	ret->d->encrypt = encryptkey != NULL;
+	if (encryptkey)
+		memcpy(ret->d->masterkey, masterkey, sizeof(masterkey));
+	memset(masterkey, 0, sizeof(masterkey));
+	if (encryptkey)
+		PELOG_LOG((PLV_INFO, "RemoteSmb encryption on, %s\n", Aes256Gcm::hardware() ? "AES-NI" : "portable AES"));
 	return ret.release();
 }
 
@@ -189,6 +348,91 @@ int RemoteSmb::init(const char *server, const char *share, const char *user, con
 	return Aresq::OK;
 }
 
+size_t RemoteSmb::laneCount() const
+{
+	return d->lanes.size() + 1;
+}
+
+SmbHandle *RemoteSmb::lane(size_t idx)
+{
+	if (idx == 0)
+		return d->smb.isconnected() ? &d->smb : NULL;
+	SmbLane &ln = *d->lanes[idx - 1];
+	if (ln.smb.isconnected())
+		return &ln.smb;
+	if (time(NULL) < ln.retry || !d->smb.isconnected())
+		return NULL;
+	if (ln.smb.init(d->smb.server.c_str(), d->smb.share.c_str(), d->smb.user.c_str(), d->smb.password.c_str(),
+			d->smb.path.c_str()) != Aresq::OK || ln.smb.connect() != Aresq::OK)
+	{
+		laneFailed(idx);
+		return NULL;
+	}
+	if (ln.fails > 0)
+		PELOG_LOG((PLV_INFO, "RemoteSmb connection %d back after %u failures\n", (int)idx, ln.fails));
+	ln.fails = 0;
+	return &ln.smb;
+}
+
+// send `up` again the usual way on connection `lane`. the tmp file is written again unless it is
+// complete and only to be renamed
+static void restartUpload(SmbUpload &up, size_t lane, smb2_context *smb)
+{
+	up.lane = lane;
+	up.smb = smb;
+	up.busy = up.issued = false;
+	up.status = 0;
+	if (up.stage >= SmbUpload::RENAME)
+		return;
+	up.fh = NULL;
+	up.stage = SmbUpload::OPEN;
+	up.retried = up.unlinked = false;
+	up.len = up.done = 0;
+	up.off = up.realsize = 0;
+	up.hash.reset();
+	up.lfp.close();
+	if (up.lfp.open(up.lfile.c_str()) != 0)
+	{
+		up.res = Aresq::FILELOCKED;
+		up.stage = SmbUpload::DONE;
+	}
+}
+
+void RemoteSmb::laneFailed(size_t idx)
+{
+	SmbLane &ln = *d->lanes[idx - 1];
+	ln.smb.drop();
+	// calls in flight came back cancelled, queued files on it go on with the main connection
+	for (std::unique_ptr<SmbUpload> &up : d->uploadq)
+	{
+		if (up->lane != idx || up->stage == SmbUpload::DONE)
+			continue;
+		if (d->smb.isconnected())
+			restartUpload(*up, 0, d->smb);
+		else
+			up->busy = false, up->fh = NULL, up->res = Aresq::DISCONNECTED, up->stage = SmbUpload::DONE;
+	}
+	++ln.fails;
+	// wait longer each time it fails in a row, up to 10 minutes
+	int wait = std::min(600, 5 << std::min(ln.fails, 7u));
+	ln.retry = time(NULL) + wait;
+	PELOG_LOG((PLV_WARNING, "RemoteSmb connection %d down, %u failures in a row, retry in %ds\n", (int)idx, ln.fails, wait));
+}
+
+void RemoteSmb::mainFailed()
+{
+	if (!d->smb.isconnected())
+		return;
+	PELOG_LOG((PLV_ERROR, "RemoteSmb main connection down: %s\n", smb2_get_error(d->smb)));
+	// first, as calls in flight come back cancelled to the queued files
+	d->smb.drop();
+	for (std::unique_ptr<SmbUpload> &up : d->uploadq)
+	{
+		if (up->lane == 0 && up->stage != SmbUpload::DONE)
+			up->busy = false, up->fh = NULL, up->res = Aresq::DISCONNECTED, up->stage = SmbUpload::DONE;
+	}
+}
+
 class SmbFile
 {
 	smb2fh *fp;
@@ -197,24 +441,116 @@ public:
 	SmbFile(smb2_context *smb2 = NULL) : fp(NULL), smb(smb2){}
 	void setSmb(smb2_context *smb2) { smb = smb2; }
 	void close() { if (fp) smb2_close(smb, fp); fp = NULL; }
+	void release() { fp = NULL; }	// the handle is gone with its connection
 	smb2fh *operator =(smb2fh *r) { close(); fp = r; return fp; }
 	operator smb2fh *() { return fp; }
 };
 
+// open `rfile` to write into, creating it and its parent dirs as needed
+int RemoteSmb::openForWrite(const char *rfile, SmbFile &fp)
+{
+	if ((fp = smb2_open(d->smb, rfile, O_WRONLY | O_CREAT)))
+		return Aresq::OK;
+	// create file failed. try some house keeping
+	abufchar parent;
+	if (!parentPath(rfile, parent) || addDir(parent) < 0 || !(fp = smb2_open(d->smb, rfile, O_WRONLY | O_CREAT)))
+		return Aresq::EPARAM;
+	return Aresq::OK;
+}
+
+// Delta uploads of large files.
+static inline void put32(uint8_t *p, uint32_t v) { memcpy(p, &v, 4); }	// little endian only
+static inline void put64(uint8_t *p, uint64_t v) { memcpy(p, &v, 8); }
+
+// SMB has no way to checksum data on the server, and reading the old copy back costs as much as
+// sending the new one. So XXH64 of each SIGBLOCK of a file is kept in AR_SIGDIR/<rbase>/<path> when
+// it is uploaded, along with the size and modified time of the remote copy to tell it is unchanged.
+// On the next upload blocks with the same hash at the same offset are not sent again, which covers
+// in-place edits of databases and disk images. Sig files are not cleaned up with the files; stale
+// ones fail the check and are overwritten on the next upload. The blocks are patched into a copy
+// of the old version made on the server, which stays in place until the new one is complete. files
+// are sent in full if the server cannot copy
+enum { SIGBLOCK = 256 * 1024 };
+static const uint64_t DELTAMIN = 16 * 1024 * 1024;	// smaller files are just sent in full
+static const uint64_t COMPOUNDMAX = 64 * 1024;	// queued files sent in one compound chain, a write of one credit
+struct SigHeader
+{
+	char magic[4];	// "ARSG"
+	uint32_t blocksize;
+	uint64_t size;	// of the remote copy
+	uint64_t mtime;
+	uint64_t mtimensec;
+	uint64_t count;	// followed by `count` uint64_t hashes
+};
+
+// hash of each SIGBLOCK of streamed data
+struct BlockSig
+{
+	std::vector<uint64_t> *blocks = NULL;
+	ContentHash cur;
+	size_t curlen = 0;
+	void update(const char *data, size_t len)
+	{
+		while (blocks && len > 0)
+		{
+			size_t n = std::min(len, SIGBLOCK - curlen);
+			cur.update(data, n);
+			curlen += n;
+			data += n;
+			len -= n;
+			if (curlen == SIGBLOCK)
+				finish();
+		}
+	}
+	void finish()
+	{
+		if (blocks && curlen > 0)
+			blocks->push_back(cur.digest());
+		cur.reset();
+		curlen = 0;
+	}
+};
+
+struct SmbPutInfo;
+// one chunk of a file being written, out of a few in flight
+struct SmbPutSlot
+{
+	SmbPutInfo *info = NULL;
+	abuf<char> buf;
+	size_t len = 0;	// padded length to write
+	size_t done = 0;	// written so far
+	uint64_t off = 0;	// in file
+	size_t lane = 0;	// of SmbPutInfo::lanes it is sent on
+	bool busy = false;
+};
+
+// a connection of the pool writing the file, with a handle of its own
+struct SmbPutLane
+{
+	size_t idx = 0;	// for RemoteSmb::lane()
+	smb2_context *smb = NULL;
+	smb2fh *fh = NULL;
+	size_t inflight = 0;	// slots busy on it
+	bool failed = false;	// no more writes on it for this file
+};
+
 struct SmbPutInfo
 {
 	int status = 0;
-	smb2_context *smb = NULL;
 	std::string name;
-	FileHandle lfp;
-	SmbFile rfp;
+	LocalFile lfp;
+	std::vector<SmbPutLane> lanes;	// the first one is the main connection, which created the file
 	uint64_t totalsize = 0;
-	uint64_t writesize = 0;
-	uint64_t realsize = 0;
-	size_t chunksize = 0;
+	uint64_t writesize = 0;	// done by writes completed
+	uint64_t realsize = 0;	// read from local file
 	size_t max_chunksize = 0;
-	int *signal = NULL;
-	abuf<char> buf;
+	size_t depth = 1;	// slots
+	size_t lanedepth = 1;	// slots in flight on each lane
+	size_t inflight = 0;	// slots busy
+	bool eof = false;
+	std::unique_ptr<SmbPutSlot[]> slots;
+	ContentHash hash;	// of data read so far
+	BlockSig sig;
 };
 
 inline size_t roundChunk(size_t size, size_t maxsize)
@@ -228,94 +564,1127 @@ inline size_t roundChunk(size_t size, size_t maxsize)
 	return (size + (maxsize - 1)) & ~((size_t)(maxsize - 1));
 }
 
-void onSmbPutChunk(struct smb2_context *smb2, int status, void *command_data, SmbPutInfo *info)
+void onSmbPutChunk(struct smb2_context *smb2, int status, void *command_data, SmbPutSlot *slot);
+
+// write what is left of `slot`
+static int putSlot(SmbPutSlot *slot)
 {
-	if (status < 0)
+	SmbPutInfo *info = slot->info;
+	SmbPutLane &lane = info->lanes[slot->lane];
+	int res = smb2_pwrite_async(lane.smb, lane.fh, (const uint8_t *)slot->buf.buf() + slot->done,
+		(uint32_t)(slot->len - slot->done), slot->off + slot->done, (smb2_command_cb)onSmbPutChunk, slot);
+	if (res < 0 && slot->lane != 0)	// go on with the main connection
 	{
-		info->status = status;
-		PELOG_ERROR_RETURNVOID((PLV_ERROR, "Upload smb failed 4 %d\n", status));
+		lane.failed = true;
+		--lane.inflight;
+		slot->lane = 0;
+		++info->lanes[0].inflight;
+		return putSlot(slot);
 	}
-	if (status == 0 || status != info->chunksize)
-		PELOG_ERROR_RETURNVOID((PLV_ERROR, "Upload smb failed 5\n"));
-	info->writesize += status;
-	PELOG_LOG((PLV_DEBUG, "smb put %d, %"PRIu64" / %"PRIu64" (%d%%). %s\n",
-		status, info->writesize, info->totalsize,
-		(int)(std::min(info->writesize, info->totalsize) * 100 / info->totalsize),
-		info->name.c_str()));
-	info->chunksize = fread(info->buf, 1, info->buf.size(), info->lfp);
-	AuVerify(info->writesize == info->realsize || info->chunksize == 0);		// writesize != realsize only occurs when last chunk has just been put
-	if (info->chunksize == 0)	// no more data
+	if (res < 0)
+	{
+		slot->busy = false;
+		--info->inflight;
+		--lane.inflight;
+		info->status = res;
+		PELOG_ERROR_RETURN((PLV_ERROR, "Upload smb failed 6 %d\n", res), res);
+	}
+	return 0;
+}
+
+// the lane with the fewest writes in flight, among those its window and credits let send one more
+static size_t pickLane(SmbPutInfo *info)
+{
+	int perwrite = (int)((info->max_chunksize - 1) / 65536 + 1);
+	size_t best = info->lanes.size();
+	for (size_t i = 0; i < info->lanes.size(); ++i)
+	{
+		SmbPutLane &lane = info->lanes[i];
+		if (lane.failed)
+			continue;
+		size_t window = std::min(info->lanedepth, std::max((size_t)1, lane.inflight + smb2_get_credits(lane.smb) / perwrite));
+		if (lane.inflight < window && (best == info->lanes.size() || lane.inflight < info->lanes[best].inflight))
+			best = i;
+	}
+	return best;
+}
+
+// read local data into free slots and send them, as many as the windows and the credits let go.
+// data is hashed in order of reading, while writes may complete in any order
+static void fillSlots(SmbPutInfo *info)
+{
+	while (info->status == 0 && !info->eof && info->inflight < info->depth)
+	{
+		size_t lane = pickLane(info);
+		if (lane == info->lanes.size())
+			return;
+		SmbPutSlot *slot = &info->slots[0];
+		while (slot->busy)
+			++slot;
+		size_t len = info->lfp.read(slot->buf, info->max_chunksize);
+		if (info->lfp.error())
+		{
+			info->status = -1;
+			PELOG_ERROR_RETURNVOID((PLV_ERROR, "Upload smb read local failed %s\n", info->name.c_str()));
+		}
+		if (len == 0)	// no more data
+		{
+			info->eof = true;
+			return;
+		}
+		info->hash.update(slot->buf, len);
+		info->sig.update(slot->buf, len);
+		slot->off = info->realsize;
+		info->realsize += len;
+		info->lfp.release(info->realsize);	// copied into the slot, not needed in page cache
+		// Some server may fail on certain chunksizes. write extra data and truncate as workaround
+		slot->len = roundChunk(len, info->max_chunksize);
+		if (slot->len > len)
+			memset(slot->buf + len, 0, slot->len - len);
+		slot->done = 0;
+		slot->lane = lane;
+		slot->busy = true;
+		++info->inflight;
+		++info->lanes[lane].inflight;
+		if (putSlot(slot) != 0)
+			return;
+	}
+}
+
+void onSmbPutChunk(struct smb2_context *smb2, int status, void *command_data, SmbPutSlot *slot)
+{
+	SmbPutInfo *info = slot->info;
+	SmbPutLane &lane = info->lanes[slot->lane];
+	if (status < 0 && slot->lane != 0 && info->status == 0)
 	{
-		info->status = 1;
+		// failed on another connection, or cancelled as it is dropped. send it again on the main one
+		PELOG_LOG((PLV_WARNING, "Upload smb on connection %d failed %d, going on without it\n", (int)lane.idx, status));
+		lane.failed = true;
+		--lane.inflight;
+		slot->lane = 0;
+		++info->lanes[0].inflight;
+		putSlot(slot);
 		return;
 	}
-	info->realsize += info->chunksize;
-	info->chunksize = roundChunk(info->chunksize, info->max_chunksize);	// Some server may fail on certain chunksizes. write extra data and truncate as workaround
-	int res = 0;
-	if ((res = smb2_pwrite_async(info->smb, info->rfp, (const uint8_t *)info->buf.buf(), info->chunksize,
-		info->writesize, (smb2_command_cb)onSmbPutChunk, info)) < 0)
+	if (status <= 0 || (size_t)status > slot->len - slot->done)
 	{
-		info->status = res;
-		PELOG_ERROR_RETURNVOID((PLV_ERROR, "Upload smb failed 6 %d\n", res));
+		slot->busy = false;
+		--info->inflight;
+		--lane.inflight;
+		if (info->status == 0)
+			info->status = status < 0 ? status : -1;
+		PELOG_ERROR_RETURNVOID((PLV_ERROR, "Upload smb failed 4 %d\n", status));
 	}
+	slot->done += status;
+	// libsmb2 shortens writes needing more credits than it has, send the rest
+	if (slot->done < slot->len && info->status == 0)
+	{
+		putSlot(slot);
+		return;
+	}
+	slot->busy = false;
+	--info->inflight;
+	--lane.inflight;
+	info->writesize += slot->done;
+	PELOG_LOG((PLV_DEBUG, "smb put %d, %"PRIu64" / %"PRIu64" (%d%%) %d in flight. %s\n",
+		status, info->writesize, info->totalsize,
+		(int)(std::min(info->writesize, info->totalsize) * 100 / std::max(info->totalsize, (uint64_t)1)),
+		(int)info->inflight, info->name.c_str()));
+	fillSlots(info);
 }
 
 
-int RemoteSmb::smbPutFile(const char *lfile, const char *rfile)
+// up to `writedepth` chunks are in flight on each connection, so a link of long round trips is kept
+// busy rather than idle for a round trip after each chunk. files of a few chunks for each are
+// striped over the other connections of the pool too, each opening the file on its own
+int RemoteSmb::smbPutFile(const char *lfile, const char *rfile, uint64_t *hash /*= NULL*/, std::vector<uint64_t> *sig /*= NULL*/)
 {
 	SmbPutInfo info;
-	info.smb = d->smb;
+	info.sig.blocks = sig;
+	if (sig)
+		sig->clear();
 	info.max_chunksize = d->smb.getchunksize();
 	info.name = lfile;
 
 	int res = 0;
-	if (!(info.lfp = OpenFile(lfile, _NCT("rb"))))
+	if (info.lfp.open(lfile) != 0)
+		PELOG_ERROR_RETURN((PLV_ERROR, "Cannot read smb file %s\n", lfile), Aresq::FILELOCKED);
+	info.totalsize = info.lfp.size();
+	SmbFile rfp(d->smb);
+	if (openForWrite(rfile, rfp) != Aresq::OK)
+		PELOG_ERROR_RETURN((PLV_ERROR, "Cannot write smb remote file %s : %s \n", lfile, rfile), Aresq::EPARAM);
+	info.lanes.resize(1);
+	info.lanes[0].smb = d->smb;
+	info.lanes[0].fh = rfp;
+	for (size_t i = 1; i < laneCount() && info.totalsize > (uint64_t)info.max_chunksize * 2 * info.lanes.size(); ++i)
+	{
+		SmbHandle *smb = lane(i);
+		if (!smb || smb->getchunksize() < info.max_chunksize)
+			continue;
+		SmbPutLane ln;
+		ln.idx = i;
+		ln.smb = *smb;
+		if (!(ln.fh = smb2_open(ln.smb, rfile, O_WRONLY)))
+		{
+			laneFailed(i);
+			continue;
+		}
+		info.lanes.push_back(ln);
+	}
+
+	// no more slots than chunks of the file
+	info.lanedepth = d->writedepth;
+	info.depth = (size_t)std::max((uint64_t)1, std::min((uint64_t)d->writedepth * info.lanes.size(), info.totalsize / info.max_chunksize + 1));
+	info.slots.reset(new SmbPutSlot[info.depth]);
+	for (size_t i = 0; i < info.depth; ++i)
+	{
+		info.slots[i].info = &info;
+		info.slots[i].buf.resize(roundChunk(info.max_chunksize, info.max_chunksize));
+	}
+	fillSlots(&info);
+
+	// wait for all writes sent to complete, even after a failure, as they use the slots
+	std::vector<pollfd> pfds;
+	std::vector<size_t> polled;
+	while (info.inflight > 0 && res >= 0)
+	{
+		pfds.clear();
+		polled.clear();
+		for (size_t i = 0; i < info.lanes.size(); ++i)
+		{
+			if (info.lanes[i].inflight == 0)
+				continue;
+			pollfd pfd = { 0 };
+			pfd.fd = smb2_get_fd(info.lanes[i].smb);
+			pfd.events = smb2_which_events(info.lanes[i].smb);
+			pfds.push_back(pfd);
+			polled.push_back(i);
+		}
+		if ((res = poll(pfds.data(), (unsigned)pfds.size(), 1000)) < 0)
+			PELOG_LOG((PLV_ERROR, "Upload smb failed 2 %d\n", res));
+		for (size_t j = 0; res > 0 && j < pfds.size(); ++j)
+		{
+			SmbPutLane &ln = info.lanes[polled[j]];
+			if (pfds[j].revents == 0 || !ln.smb)
+				continue;
+			if (smb2_service(ln.smb, pfds[j].revents) >= 0)
+				continue;
+			PELOG_LOG((PLV_ERROR, "Upload smb failed 3 on connection %d: %s\n", (int)ln.idx, smb2_get_error(ln.smb)));
+			if (ln.idx == 0)
+			{
+				res = -1;
+				break;
+			}
+			// writes in flight come back cancelled, and go on with the main connection
+			ln.failed = true;
+			ln.smb = NULL;
+			ln.fh = NULL;
+			laneFailed(ln.idx);
+		}
+	}
+	// drop the other connections still used, whose writes would come back to the slots gone
+	if (res < 0)
+		info.status = -1;
+	for (size_t i = 1; i < info.lanes.size(); ++i)
+	{
+		SmbPutLane &ln = info.lanes[i];
+		if (ln.smb && (res < 0 || ln.failed))
+			laneFailed(ln.idx);
+		else if (ln.smb)
+			smb2_close(ln.smb, ln.fh);
+	}
+	// and the main one, whose writes still in flight come back cancelled while the slots are there
+	if (res < 0)
+	{
+		rfp.release();
+		mainFailed();
+		return Aresq::DISCONNECTED;
+	}
+
+	rfp.close();
+	if (info.lfp.error())
+		PELOG_ERROR_RETURN((PLV_ERROR, "Upload smb read failed %s\n", lfile), Aresq::FILELOCKED);
+	bool done = info.status == 0 && info.eof;
+	// always truncate, even if no extra data were written, in case of larger version of this file already exists
+	if (done && (res = smb2_truncate(d->smb, rfile, info.realsize)) < 0)
+		PELOG_ERROR_RETURN((PLV_ERROR, "Upload smb failed 7 %d: %s\n", res, smb2_get_error(d->smb)), Aresq::DISCONNECTED);
+
+	if (done && hash)
+		*hash = info.hash.digest();
+	info.sig.finish();
+	if (done)
+		PELOG_ERROR_RETURN((PLV_VERBOSE, "PUTDONE smb %"PRIu64" %s -> %s (%d connections)\n",
+			info.realsize, lfile, rfile, (int)info.lanes.size()), Aresq::OK);
+	return Aresq::DISCONNECTED;
+}
+
+// the remote file is marked sparse, and extended to the full size by truncating at the end, so
+// holes are neither read nor sent. they still count in the hashes, as zeros
+int RemoteSmb::smbPutSparse(const char *lfile, const char *rfile, uint64_t *hash /*= NULL*/, std::vector<uint64_t> *sig /*= NULL*/)
+{
+	static const uint32_t FSCTL_SET_SPARSE = 0x000900C4;
+	LocalFile lfp;
+	if (lfp.open(lfile) != 0)
 		PELOG_ERROR_RETURN((PLV_ERROR, "Cannot read smb file %s\n", lfile), Aresq::FILELOCKED);
-	fseek(info.lfp, 0, SEEK_END);
-	info.totalsize = ftell(info.lfp);
-	fseek(info.lfp, 0, SEEK_SET);
-	info.rfp.setSmb(info.smb);
-	if (!(info.rfp = smb2_open(info.smb, rfile, O_WRONLY | O_CREAT)))
-	{
-		// create file failed. try some house keeping
-		const char *dirsep = strrchr(rfile, '/');
-		if (!dirsep || addDir(std::string(rfile, dirsep)) < 0 || !(info.rfp = smb2_open(info.smb, rfile, O_WRONLY | O_CREAT)))
-			PELOG_ERROR_RETURN((PLV_ERROR, "Cannot write smb remote file %s : %s \n", lfile, rfile), Aresq::EPARAM);
-	}
-
-	info.buf.resize(info.max_chunksize);
-	info.chunksize = fread(info.buf, 1, info.buf.size(), info.lfp);
-	info.realsize = info.chunksize;
-	info.chunksize = roundChunk(info.chunksize, info.max_chunksize);	// Some server may fail on certain chunksizes. write extra data and the truncate as workaround
-	if (info.realsize < info.chunksize)
-		memset(info.buf + info.realsize, 0, info.chunksize - (size_t)info.realsize);
-	if (info.chunksize == 0)
-		info.status = 1;
-	else if ((res = smb2_pwrite_async(d->smb, info.rfp, (const uint8_t *)info.buf.buf(), info.chunksize,
-			info.writesize, (smb2_command_cb)onSmbPutChunk, &info)) < 0)
-		PELOG_ERROR_RETURN((PLV_ERROR, "Upload smb failed 1 %d\n", res), Aresq::DISCONNECTED);
+	SmbFile rfp(d->smb);
+	if (openForWrite(rfile, rfp) != Aresq::OK)
+		PELOG_ERROR_RETURN((PLV_ERROR, "Cannot write smb remote file %s : %s \n", lfile, rfile), Aresq::EPARAM);
+	// without it the server fills holes with zeros by itself, which are still not sent
+	std::vector<uint8_t> out;
+	if (smbIoctl(rfp, FSCTL_SET_SPARSE, NULL, 0, out) != Aresq::OK)
+		PELOG_LOG((PLV_DEBUG, "Set smb sparse failed %s\n", rfile));
 
+	ContentHash fhash;
+	BlockSig bsig;
+	bsig.blocks = sig;
+	if (sig)
+		sig->clear();
+	abuf<char> buf(d->smb.getchunksize());
+	uint64_t size = lfp.size(), pos = 0, start = 0, end = 0, sent = 0;
+	while (pos < size)
+	{
+		if (!lfp.nextData(pos, start, end))
+			start = end = size;
+		if (lfp.error())
+			PELOG_ERROR_RETURN((PLV_ERROR, "Upload smb read failed %s\n", lfile), Aresq::FILELOCKED);
+		for (memset(buf, 0, buf.size()); pos < start;)	// hole
+		{
+			size_t len = (size_t)std::min(start - pos, (uint64_t)buf.size());
+			fhash.update(buf, len);
+			bsig.update(buf, len);
+			pos += len;
+		}
+		while (pos < end)
+		{
+			size_t len = lfp.read(buf, (size_t)std::min(end - pos, (uint64_t)buf.size()));
+			if (lfp.error())
+				PELOG_ERROR_RETURN((PLV_ERROR, "Upload smb read failed %s\n", lfile), Aresq::FILELOCKED);
+			if (len == 0)	// truncated while reading
+			{
+				size = end = pos;
+				break;
+			}
+			fhash.update(buf, len);
+			bsig.update(buf, len);
+			int res = smbWriteAt(rfp, buf, len, pos);
+			if (res != Aresq::OK)
+				PELOG_ERROR_RETURN((PLV_ERROR, "Upload smb failed %d %s\n", res, rfile), res);
+			pos += len;
+			sent += len;
+			lfp.release(pos);
+		}
+	}
+	rfp.close();
+	int res = smb2_truncate(d->smb, rfile, size);
+	if (res < 0)
+		PELOG_ERROR_RETURN((PLV_ERROR, "Upload smb truncate failed %d: %s\n", res, smb2_get_error(d->smb)), Aresq::DISCONNECTED);
+	bsig.finish();
+	if (hash)
+		*hash = fhash.digest();
+	PELOG_ERROR_RETURN((PLV_VERBOSE, "PUTDONE smb %" PRIu64 ", %" PRIu64 " sent, sparse %s -> %s\n", size, sent, lfile, rfile), Aresq::OK);
+}
+
+// a file is told by its first bytes to be encrypted ("ARE1"), compressed ("ARZ1") or a manifest
+// of chunks. files of data starting like that are stored compressed even in plain or encrypted
+// mode, so plain copies and decrypted data never do, and nothing is taken from user data
+static const size_t MAGICLEN = 15;
+static bool packedHead(const char *head, size_t len)
+{
+	return (len >= 4 && (memcmp(head, "ARE1", 4) == 0 || memcmp(head, "ARZ1", 4) == 0)) ||
+		(len >= MAGICLEN && memcmp(head, "AResq chunks 1 ", MAGICLEN) == 0);
+}
+
+// whether local file `lfile` starts like one of the formats
+static bool packedFile(const char *lfile)
+{
+	LocalFile lfp;
+	char head[MAGICLEN];
+	return lfp.open(lfile) == 0 && packedHead(head, lfp.read(head, sizeof(head)));
+}
+
+// sequential writer of a remote file, from the start on. with a key, data are sealed in FileCipher
+// blocks on the way. the blocks are laid out in `buf` the same as on remote, and written together
+struct SmbWriter
+{
+	enum { NBLOCK = 16 };
+	std::function<int(const char *data, size_t len, uint64_t off)> write;
+	std::unique_ptr<FileCipher> cipher;
+	abuf<char> buf;
+	size_t cur = 0;	// block being filled in buf
+	size_t fill = 0;	// bytes in it
+	uint64_t index = 0;	// of that block in the file
+	uint64_t off = 0;	// bytes written to remote
+
+	int start(const uint8_t *key)
+	{
+		if (!key)
+			return Aresq::OK;
+		cipher.reset(new FileCipher(key));
+		uint8_t header[FileCipher::HEADERSIZE];
+		cipher->create(header);
+		buf.resize(NBLOCK * (cipher->blockSize() + FileCipher::TAGSIZE));
+		off = FileCipher::HEADERSIZE;
+		return write((const char *)header, FileCipher::HEADERSIZE, 0);
+	}
+	int put(const char *data, size_t len)
+	{
+		int res = Aresq::OK;
+		if (!cipher)
+		{
+			res = write(data, len, off);
+			off += len;
+			return res;
+		}
+		const size_t bs = cipher->blockSize(), slot = bs + FileCipher::TAGSIZE;
+		while (len > 0)
+		{
+			if (fill == bs)	// more data follow, so it is not the last block
+			{
+				cipher->seal(index++, false, (uint8_t *)buf.buf() + cur * slot, bs);
+				fill = 0;
+				if (++cur == NBLOCK)
+				{
+					if ((res = write(buf, NBLOCK * slot, off)) != Aresq::OK)
+						return res;
+					off += NBLOCK * slot;
+					cur = 0;
+				}
+			}
+			size_t n = std::min(len, bs - fill);
+			memcpy(buf + cur * slot + fill, data, n);
+			fill += n;
+			data += n;
+			len -= n;
+		}
+		return res;
+	}
+	// the last block. it may be empty, which still tells the file is complete
+	int finish()
+	{
+		if (!cipher)
+			return Aresq::OK;
+		const size_t slot = cipher->blockSize() + FileCipher::TAGSIZE;
+		cipher->seal(index++, true, (uint8_t *)buf.buf() + cur * slot, fill);
+		size_t len = cur * slot + fill + FileCipher::TAGSIZE;
+		int res = write(buf, len, off);
+		off += len;
+		cur = fill = 0;
+		return res;
+	}
+};
+
+// decoder of the compressed container of smbPutCompressed into a local file, data are pushed in
+// pieces of any size. files in other formats are passed through
+struct SmbUnpacker
+{
+	enum { DETECT, PLAIN, BLOCKS, DONE } state = DETECT;
+	FILE *out = NULL;
+	std::string pending;
+	size_t pos = 0;	// consumed in pending
+	abuf<char> raw;
+	ContentHash hash;
+	uint64_t total = 0;
+
+	int emit(const char *data, size_t len)
+	{
+		if (len > 0 && fwrite(data, 1, len, out) != len)
+			PELOG_ERROR_RETURN((PLV_ERROR, "Write local failed\n"), Aresq::EPARAM);
+		hash.update(data, len);
+		total += len;
+		return Aresq::OK;
+	}
+	static uint32_t get32(const char *p) { uint32_t v; memcpy(&v, p, 4); return v; }
+	static uint64_t get64(const char *p) { uint64_t v; memcpy(&v, p, 8); return v; }
+	int push(const char *data, size_t len)
+	{
+		if (state == PLAIN)
+			return emit(data, len);
+		pending.append(data, len);
+		if (state == DETECT)
+		{
+			if (pending.size() < 8)
+				return Aresq::OK;
+			state = memcmp(pending.data(), "ARZ1", 4) == 0 ? BLOCKS : PLAIN;
+			if (state == PLAIN)
+			{
+				int res = emit(pending.data(), pending.size());
+				pending.clear();
+				return res;
+			}
+			raw.resize(get32(pending.data() + 4));
+			pos = 8;
+		}
+		while (pending.size() - pos >= 8)
+		{
+			const char *p = pending.data() + pos;
+			uint32_t rawlen = get32(p), slen = get32(p + 4) & 0x7fffffff;
+			bool stored = (get32(p + 4) & 0x80000000u) != 0;
+			if (state == DONE || rawlen > raw.size() || (!stored && slen > Compressor::bound(raw.size())))
+				PELOG_ERROR_RETURN((PLV_ERROR, "Unpack smb corrupted container\n"), Aresq::EPARAM);
+			if (rawlen == 0 && slen == 0)	// trailer
+			{
+				if (pending.size() - pos < 24)
+					break;
+				if (get64(p + 8) != total || get64(p + 16) != hash.digest())
+					PELOG_ERROR_RETURN((PLV_ERROR, "Unpack smb size or hash mismatch\n"), Aresq::EPARAM);
+				pos += 24;
+				state = DONE;
+				continue;
+			}
+			if (pending.size() - pos < 8 + (size_t)slen)
+				break;
+			int res = Aresq::OK;
+			if (stored)
+				res = slen == rawlen ? emit(p + 8, slen) : Aresq::EPARAM;
+			else if (Compressor::decompress(p + 8, slen, raw, raw.size()) != rawlen)
+				res = Aresq::EPARAM;
+			else
+				res = emit(raw, rawlen);
+			if (res != Aresq::OK)
+				PELOG_ERROR_RETURN((PLV_ERROR, "Unpack smb bad block at %" PRIu64 "\n", total), res);
+			pos += 8 + slen;
+		}
+		pending.erase(0, pos);
+		pos = 0;
+		return Aresq::OK;
+	}
+	int finish()
+	{
+		if (state == DETECT)	// shorter than any header
+			return emit(pending.data(), pending.size());
+		if (state == BLOCKS || pending.size() > pos)
+			PELOG_ERROR_RETURN((PLV_ERROR, "Unpack smb truncated container\n"), Aresq::EPARAM);
+		return Aresq::OK;
+	}
+};
+
+// chunked mode: chunks listed in the manifest `rfp` of `size` bytes put together into `unpack`.
+// each chunk is checked against its id, which has its length and hash, and the whole file against
+// the size and hash in the manifest
+int RemoteSmb::smbGetChunked(struct smb2fh *rfp, uint64_t size, struct SmbUnpacker &unpack)
+{
+	std::string manifest((size_t)size, '\0');
+	int res = smbReadAt(rfp, &manifest[0], manifest.size(), 0);
+	if (res != Aresq::OK)
+		return res;
+	static const char magic[] = "AResq chunks 1 ";
+	size_t pos = manifest.find('\n');
+	if (pos == std::string::npos || manifest.compare(0, sizeof(magic) - 1, magic) != 0)
+		PELOG_ERROR_RETURN((PLV_ERROR, "GET smb bad manifest\n"), Aresq::EPARAM);
+	char *end = NULL;
+	uint64_t total = strtoull(manifest.c_str() + sizeof(magic) - 1, &end, 10);
+	uint64_t fhash = strtoull(end, &end, 16);
+	if (*end != '\n')
+		PELOG_ERROR_RETURN((PLV_ERROR, "GET smb bad manifest\n"), Aresq::EPARAM);
+	abuf<char> buf;
+	for (++pos; pos < manifest.size();)
+	{
+		size_t eol = manifest.find('\n', pos);
+		if (eol == std::string::npos || eol - pos < 2 || eol - pos > Chunker::IDSIZE)
+			PELOG_ERROR_RETURN((PLV_ERROR, "GET smb bad manifest at %d\n", (int)pos), Aresq::EPARAM);
+		std::string id = manifest.substr(pos, eol - pos);
+		pos = eol + 1;
+		char sub[Chunker::IDSIZE + 8];
+		snprintf(sub, sizeof(sub), "%.2s/%s", id.c_str(), id.c_str());
+		const char *cpath = buildSmbPath(d->chunkpath, d->smb.path.c_str(), AR_CHUNKDIR, sub, strlen(sub));
+		smb2_stat_64 st;
+		if (smb2_stat(d->smb, cpath, &st) < 0 || st.smb2_type != SMB2_TYPE_FILE || st.smb2_size > Chunker::MAXSIZE)
+			PELOG_ERROR_RETURN((PLV_ERROR, "GET smb chunk missing %s\n", cpath), Aresq::NOTFOUND);
+		SmbFile cfp(d->smb);
+		if (!(cfp = smb2_open(d->smb, cpath, O_RDONLY)))
+			PELOG_ERROR_RETURN((PLV_ERROR, "GET smb cannot open %s\n", cpath), Aresq::NOTFOUND);
+		buf.resize((size_t)st.smb2_size);
+		res = smbReadAt(cfp, buf, buf.size(), 0);
+		cfp.close();
+		if (res != Aresq::OK)
+			return res;
+		if (Chunker::id(buf, buf.size()) != id)
+			PELOG_ERROR_RETURN((PLV_ERROR, "GET smb chunk altered %s\n", cpath), Aresq::EPARAM);
+		if ((res = unpack.emit(buf, buf.size())) != Aresq::OK)
+			return res;
+	}
+	if (unpack.total != total || unpack.hash.digest() != fhash)
+		PELOG_ERROR_RETURN((PLV_ERROR, "GET smb chunks size or hash mismatch\n"), Aresq::EPARAM);
+	return Aresq::OK;
+}
+
+int RemoteSmb::smbGetFile(const char *rfile, const char *lfile)
+{
+	smb2_stat_64 st;
+	int res = smb2_stat(d->smb, rfile, &st);
+	if (res < 0 || st.smb2_type != SMB2_TYPE_FILE)
+		PELOG_ERROR_RETURN((PLV_ERROR, "GET smb not found %d %s\n", res, rfile), Aresq::NOTFOUND);
+	SmbFile rfp(d->smb);
+	if (!(rfp = smb2_open(d->smb, rfile, O_RDONLY)))
+		PELOG_ERROR_RETURN((PLV_ERROR, "GET smb cannot open %s\n", rfile), Aresq::NOTFOUND);
+	std::unique_ptr<FileCipher> cipher;
+	uint8_t header[FileCipher::HEADERSIZE];
+	size_t hlen = (size_t)std::min((uint64_t)sizeof(header), st.smb2_size);
+	if (smbReadAt(rfp, (char *)header, hlen, 0) != Aresq::OK)
+		PELOG_ERROR_RETURN((PLV_ERROR, "GET smb cannot read %s\n", rfile), Aresq::DISCONNECTED);
+	bool manifest = hlen >= MAGICLEN && memcmp(header, "AResq chunks 1 ", MAGICLEN) == 0;
+	if (hlen >= 4 && memcmp(header, "ARE1", 4) == 0)
+	{
+		if (st.smb2_size < FileCipher::HEADERSIZE + FileCipher::TAGSIZE)
+			PELOG_ERROR_RETURN((PLV_ERROR, "GET smb truncated encrypted file %s\n", rfile), Aresq::EPARAM);
+		if (!d->encrypt)
+			PELOG_ERROR_RETURN((PLV_ERROR, "GET smb encrypted file without encryptkey %s\n", rfile), Aresq::EPARAM);
+		cipher.reset(new FileCipher(d->masterkey));
+		if (!cipher->open(header, sizeof(header)))
+			PELOG_ERROR_RETURN((PLV_ERROR, "GET smb unknown header %s\n", rfile), Aresq::EPARAM);
+	}
+	FileHandle out = OpenFile(lfile, _NCT("wb"));
+	if (!out)
+		PELOG_ERROR_RETURN((PLV_ERROR, "GET smb cannot write %s\n", lfile), Aresq::EPARAM);
+	SmbUnpacker unpack;
+	unpack.out = out;
+	abuf<char> buf;
+	res = Aresq::OK;
+	if (manifest)
+		res = smbGetChunked(rfp, st.smb2_size, unpack);
+	else if (cipher)
+	{
+		// a few blocks in each read, then verified and decrypted one by one
+		const size_t slot = cipher->blockSize() + FileCipher::TAGSIZE;
+		buf.resize(SmbWriter::NBLOCK * slot);
+		uint64_t index = 0;
+		for (uint64_t off = FileCipher::HEADERSIZE; res == Aresq::OK && off < st.smb2_size;)
+		{
+			size_t len = (size_t)std::min((uint64_t)buf.size(), st.smb2_size - off);
+			if ((res = smbReadAt(rfp, buf, len, off)) != Aresq::OK)
+				break;
+			for (size_t bpos = 0; res == Aresq::OK && bpos < len; bpos += slot, ++index)
+			{
+				size_t blen = std::min(slot, len - bpos);
+				bool last = off + bpos + blen == st.smb2_size;
+				if (!cipher->unseal(index, last, (uint8_t *)buf.buf() + bpos, blen))
+					PELOG_LOG((PLV_ERROR, "GET smb block %" PRIu64 " altered or wrong key %s\n", index, rfile)), res = Aresq::EPARAM;
+				else
+					res = unpack.push(buf + bpos, blen - FileCipher::TAGSIZE);
+			}
+			off += len;
+		}
+	}
+	else
+	{
+		buf.resize(d->smb.getchunksize());
+		for (uint64_t off = 0; res == Aresq::OK && off < st.smb2_size; off += buf.size())
+		{
+			size_t len = (size_t)std::min((uint64_t)buf.size(), st.smb2_size - off);
+			if ((res = smbReadAt(rfp, buf, len, off)) == Aresq::OK)
+				res = unpack.push(buf, len);
+		}
+	}
+	if (res == Aresq::OK)
+		res = unpack.finish();
+	rfp.close();
+	out.close();
+	if (res != Aresq::OK)
+	{
+		RemoveFile(lfile);
+		PELOG_ERROR_RETURN((PLV_ERROR, "GET smb failed %d %s -> %s\n", res, rfile, lfile), res);
+	}
+	PELOG_ERROR_RETURN((PLV_VERBOSE, "GET smb %" PRIu64 " %s -> %s\n", unpack.total, rfile, lfile), Aresq::OK);
+}
+
+int RemoteSmb::getFile(const char *rbase, const char *path, size_t plen, const char *lfile)
+{
+	if (!d->smb.isconnected())
+		PELOG_ERROR_RETURN((PLV_ERROR, "GET smb remote disconnected: %s\n", lfile), Aresq::DISCONNECTED);
+	return smbGetFile(buildSmbPath(d->rpath, d->smb.path.c_str(), rbase, path, plen), lfile);
+}
+
+// encrypted mode. `rfile` is in the format of FileCipher
+int RemoteSmb::smbPutEncrypted(const char *lfile, const char *rfile, uint64_t *hash /*= NULL*/)
+{
+	LocalFile lfp;
+	if (lfp.open(lfile) != 0)
+		PELOG_ERROR_RETURN((PLV_ERROR, "Cannot read smb file %s\n", lfile), Aresq::FILELOCKED);
+	SmbFile rfp(d->smb);
+	if (openForWrite(rfile, rfp) != Aresq::OK)
+		PELOG_ERROR_RETURN((PLV_ERROR, "Cannot write smb remote file %s : %s \n", lfile, rfile), Aresq::EPARAM);
+	SmbWriter writer;
+	writer.write = [&](const char *data, size_t len, uint64_t off) { return smbWriteAt(rfp, data, len, off); };
+	int res = writer.start(d->masterkey);
+	ContentHash fhash;
+	abuf<char> buf(d->smb.getchunksize());
+	uint64_t total = 0;
+	for (size_t len = 0; res == Aresq::OK && (len = lfp.read(buf, buf.size())) > 0;)
+	{
+		fhash.update(buf, len);
+		total += len;
+		lfp.release(total);
+		res = writer.put(buf, len);
+	}
+	if (lfp.error())
+		PELOG_ERROR_RETURN((PLV_ERROR, "Upload smb read failed %s\n", lfile), Aresq::FILELOCKED);
+	if (res != Aresq::OK || (res = writer.finish()) != Aresq::OK)
+		PELOG_ERROR_RETURN((PLV_ERROR, "Upload smb failed %d %s\n", res, rfile), res);
+	rfp.close();
+	if ((res = smb2_truncate(d->smb, rfile, writer.off)) < 0)
+		PELOG_ERROR_RETURN((PLV_ERROR, "Upload smb truncate failed %d: %s\n", res, smb2_get_error(d->smb)), Aresq::DISCONNECTED);
+	if (hash)
+		*hash = fhash.digest();
+	PELOG_ERROR_RETURN((PLV_VERBOSE, "PUTDONE smb %" PRIu64 " encrypted %s -> %s\n", total, lfile, rfile), Aresq::OK);
+}
+
+// compressed mode. `rfile` is written as a container, integers in little endian:
+//     "ARZ1", block size(4)
+//     for each block: data length(4), stored length(4), stored data
+//     0(4), 0(4), file size(8), ContentHash of file(8)
+// the top bit of stored length is set if the block is stored as is, otherwise it is in LZ4 block
+// format. blocks are compressed on worker threads while the ones before are being sent.
+// in encrypted mode the container is encrypted as a whole
+int RemoteSmb::smbPutCompressed(const char *lfile, const char *rfile, uint64_t *hash /*= NULL*/)
+{
+	enum { ZBLOCK = 1024 * 1024, ZHEADER = 8, ZBLOCKHEADER = 8 };
+	LocalFile lfp;
+	if (lfp.open(lfile) != 0)
+		PELOG_ERROR_RETURN((PLV_ERROR, "Cannot read smb file %s\n", lfile), Aresq::FILELOCKED);
+	SmbFile rfp(d->smb);
+	if (openForWrite(rfile, rfp) != Aresq::OK)
+		PELOG_ERROR_RETURN((PLV_ERROR, "Cannot write smb remote file %s : %s \n", lfile, rfile), Aresq::EPARAM);
+	SmbWriter writer;
+	writer.write = [&](const char *data, size_t len, uint64_t off) { return smbWriteAt(rfp, data, len, off); };
+	uint8_t header[ZBLOCKHEADER + 16];
+	memcpy(header, "ARZ1", 4);
+	put32(header + 4, ZBLOCK);
+	int res = writer.start(d->encrypt ? d->masterkey : NULL);
+	if (res != Aresq::OK || (res = writer.put((const char *)header, ZHEADER)) != Aresq::OK)
+		PELOG_ERROR_RETURN((PLV_ERROR, "Upload smb failed %d %s\n", res, rfile), res);
+
+	CompressPipe pipe(std::min(std::max(std::thread::hardware_concurrency(), 1u), 4u), ZBLOCK);
+	ContentHash fhash;
+	abuf<char> wbuf(ZBLOCKHEADER + Compressor::bound(ZBLOCK));
+	uint64_t total = 0;
+	bool eof = false;
+	while (true)
+	{
+		// keep the workers busy before waiting for the oldest block
+		char *buf = NULL;
+		while (!eof && (buf = pipe.next()) != NULL)
+		{
+			size_t len = lfp.read(buf, ZBLOCK);
+			if (lfp.error())
+				PELOG_ERROR_RETURN((PLV_ERROR, "Upload smb read failed %s\n", lfile), Aresq::FILELOCKED);
+			if (len == 0)
+			{
+				eof = true;
+				break;
+			}
+			fhash.update(buf, len);
+			total += len;
+			lfp.release(total);
+			pipe.put(len);
+		}
+		const CompressPipe::Block *block = pipe.get();
+		if (!block)
+			break;
+		size_t slen = block->compressed ? block->outlen : block->rawlen;
+		put32((uint8_t *)wbuf.buf(), (uint32_t)block->rawlen);
+		put32((uint8_t *)wbuf.buf() + 4, (uint32_t)slen | (block->compressed ? 0 : 0x80000000u));
+		memcpy(wbuf + ZBLOCKHEADER, block->compressed ? block->out : block->raw, slen);
+		if ((res = writer.put(wbuf, ZBLOCKHEADER + slen)) != Aresq::OK)
+			PELOG_ERROR_RETURN((PLV_ERROR, "Upload smb failed %d %s\n", res, rfile), res);
+		pipe.pop();
+	}
+	memset(header, 0, ZBLOCKHEADER);
+	put64(header + ZBLOCKHEADER, total);
+	put64(header + ZBLOCKHEADER + 8, fhash.digest());
+	if ((res = writer.put((const char *)header, sizeof(header))) != Aresq::OK || (res = writer.finish()) != Aresq::OK)
+		PELOG_ERROR_RETURN((PLV_ERROR, "Upload smb failed %d %s\n", res, rfile), res);
+	rfp.close();
+	if ((res = smb2_truncate(d->smb, rfile, writer.off)) < 0)
+		PELOG_ERROR_RETURN((PLV_ERROR, "Upload smb truncate failed %d: %s\n", res, smb2_get_error(d->smb)), Aresq::DISCONNECTED);
+	if (hash)
+		*hash = fhash.digest();
+	PELOG_ERROR_RETURN((PLV_VERBOSE, "PUTDONE smb %" PRIu64 ", %" PRIu64 " compressed %s -> %s\n", total, writer.off, lfile, rfile), Aresq::OK);
+}
+
+// chunked mode. `lfile` is split by Chunker, each chunk not yet on remote is stored as
+// AR_CHUNKDIR/<first 2 chars of id>/<id>, and `rfile` is written as a text manifest:
+//     AResq chunks 1 <file size> <ContentHash of file, hex>
+//     <chunk id>
+//     ...
+// chunks are never removed, since history versions may refer to them
+int RemoteSmb::smbPutChunked(const char *lfile, const char *rfile, uint64_t *hash /*= NULL*/)
+{
+	LocalFile lfp;
+	if (lfp.open(lfile) != 0)
+		PELOG_ERROR_RETURN((PLV_ERROR, "Cannot read smb file %s\n", lfile), Aresq::FILELOCKED);
+	ContentHash fhash;
+	std::string ids;
+	uint64_t total = 0;
+	int nchunk = 0, nsent = 0;
+	abuf<char> buf(Chunker::MAXSIZE * 2);
+	size_t have = 0;	// bytes in buf not cut yet
+	bool eof = false;
+	while (true)
+	{
+		// keep at least MAXSIZE for cutting, unless at end of file
+		while (!eof && have < Chunker::MAXSIZE)
+		{
+			size_t len = lfp.read(buf + have, buf.size() - have);
+			if (len == 0)
+				eof = true;
+			fhash.update(buf + have, len);
+			have += len;
+		}
+		if (lfp.error())
+			PELOG_ERROR_RETURN((PLV_ERROR, "Upload smb read failed %s\n", lfile), Aresq::FILELOCKED);
+		if (have == 0)
+			break;
+		size_t len = Chunker::cut(buf, have);
+		std::string id = Chunker::id(buf, len);
+		bool sent = false;
+		int res = putChunk(id, buf, len, sent);
+		if (res != Aresq::OK)
+			PELOG_ERROR_RETURN((PLV_ERROR, "Upload smb chunk failed %d %s\n", res, lfile), res);
+		ids += id;
+		ids += '\n';
+		total += len;
+		++nchunk;
+		nsent += sent;
+		lfp.release(total);
+		memmove(buf, buf + len, have - len);
+		have -= len;
+	}
+
+	char header[96];
+	snprintf(header, sizeof(header), "AResq chunks 1 %" PRIu64 " %016" PRIx64 "\n", total, fhash.digest());
+	std::string manifest = header + ids;
+	int res = smbPutBuf(rfile, manifest.data(), manifest.length());
+	if (res != Aresq::OK)
+		PELOG_ERROR_RETURN((PLV_ERROR, "Upload smb manifest failed %d %s\n", res, rfile), res);
+	if (hash)
+		*hash = fhash.digest();
+	PELOG_ERROR_RETURN((PLV_VERBOSE, "PUTDONE smb %" PRIu64 " in %d chunks, %d sent %s -> %s\n",
+		total, nchunk, nsent, lfile, rfile), Aresq::OK);
+}
+
+// store a chunk if it is not on remote yet. `sent`: whether data are actually sent
+int RemoteSmb::putChunk(const std::string &id, const char *data, size_t len, bool &sent)
+{
+	sent = false;
+	if (d->chunks.count(id))
+		return Aresq::OK;
+	char sub[Chunker::IDSIZE + 8];
+	snprintf(sub, sizeof(sub), "%.2s/%s", id.c_str(), id.c_str());
+	const char *cpath = buildSmbPath(d->chunkpath, d->smb.path.c_str(), AR_CHUNKDIR, sub, strlen(sub));
+	int type = getType(cpath);
+	if (type < 0)
+		PELOG_ERROR_RETURN((PLV_ERROR, "CHUNK smb stat failed %d %s\n", type, cpath), Aresq::DISCONNECTED);
+	if (type != FT_FILE)
+	{
+		// write to tmp first, so that a partial chunk never appears with the id
+		char tmpbuf[32];
+		tmpName(tmpbuf, sizeof(tmpbuf), ".c");
+		abufchar tmppath;
+		buildSmbPath(tmppath, d->smb.path.c_str(), AR_TMPDIR, tmpbuf, strlen(tmpbuf));
+		int res = smbPutBuf(tmppath, data, len);
+		if (res != Aresq::OK)
+			return res;
+		if ((res = moveFile(tmppath, cpath, true)) != Aresq::OK)
+			PELOG_ERROR_RETURN((PLV_ERROR, "CHUNK smb move failed %d %s\n", res, cpath), Aresq::EPARAM);
+		sent = true;
+		PELOG_LOG((PLV_DEBUG, "CHUNK smb put %s\n", id.c_str()));
+	}
+	d->chunks.insert(id);
+	return Aresq::OK;
+}
+
+// write `len` bytes of `data` into remote file `rfile`
+int RemoteSmb::smbPutBuf(const char *rfile, const char *data, size_t len)
+{
+	SmbFile rfp(d->smb);
+	if (openForWrite(rfile, rfp) != Aresq::OK)
+		PELOG_ERROR_RETURN((PLV_ERROR, "Cannot write smb remote file %s\n", rfile), Aresq::EPARAM);
+	int res = smbWriteAt(rfp, data, len, 0);
+	rfp.close();
+	if (res != Aresq::OK)
+		PELOG_ERROR_RETURN((PLV_ERROR, "Write smb failed %d: %s\n", res, rfile), res);
+	if ((res = smb2_truncate(d->smb, rfile, len)) < 0)
+		PELOG_ERROR_RETURN((PLV_ERROR, "Write smb truncate failed %d: %s\n", res, rfile), Aresq::DISCONNECTED);
+	return Aresq::OK;
+}
+
+// write `len` bytes at `off` of an opened file, in pieces the server accepts. data may be padded
+// at the end like smbPutFile does, which has to be truncated afterwards
+int RemoteSmb::smbWriteAt(struct smb2fh *fh, const char *data, size_t len, uint64_t off)
+{
+	size_t maxchunk = d->smb.getchunksize();
+	abuf<char> pad;
+	for (size_t pos = 0; pos < len;)
+	{
+		size_t wlen = std::min(len - pos, maxchunk);
+		size_t padlen = roundChunk(wlen, maxchunk);
+		const char *wbuf = data + pos;
+		if (padlen != wlen)
+		{
+			pad.resize(padlen);
+			memcpy(pad, wbuf, wlen);
+			memset(pad + wlen, 0, padlen - wlen);
+			wbuf = pad;
+		}
+		int res = smb2_pwrite(d->smb, fh, (const uint8_t *)wbuf, (uint32_t)padlen, off + pos);
+		if (res != (int)padlen)
+			PELOG_ERROR_RETURN((PLV_ERROR, "Write smb failed %d: %s\n", res, smb2_get_error(d->smb)), Aresq::DISCONNECTED);
+		pos += wlen;
+	}
+	return Aresq::OK;
+}
+
+// read exactly `len` bytes at `off`
+int RemoteSmb::smbReadAt(struct smb2fh *fh, char *data, size_t len, uint64_t off)
+{
+	size_t maxread = std::min((size_t)d->smb.getchunksize(), (size_t)smb2_get_max_read_size(d->smb));
+	for (size_t pos = 0; pos < len;)
+	{
+		int res = smb2_pread(d->smb, fh, (uint8_t *)data + pos, (uint32_t)std::min(len - pos, maxread), off + pos);
+		if (res <= 0)
+			PELOG_ERROR_RETURN((PLV_ERROR, "Read smb failed %d: %s\n", res, smb2_get_error(d->smb)), Aresq::DISCONNECTED);
+		pos += res;
+	}
+	return Aresq::OK;
+}
+
+int RemoteSmb::smbPatchFile(const char *lfile, const char *rfile, std::vector<uint64_t> &sig, uint64_t *hash /*= NULL*/)
+{
+	LocalFile lfp;
+	if (lfp.open(lfile) != 0)
+		PELOG_ERROR_RETURN((PLV_ERROR, "Cannot read smb file %s\n", lfile), Aresq::FILELOCKED);
+	SmbFile rfp(d->smb);
+	if (!(rfp = smb2_open(d->smb, rfile, O_WRONLY)))
+		PELOG_ERROR_RETURN((PLV_ERROR, "Cannot write smb remote file %s : %s \n", lfile, rfile), Aresq::EPARAM);
+	ContentHash fhash;
+	std::vector<uint64_t> newsig;
+	abuf<char> buf(SIGBLOCK);
+	uint64_t off = 0, sent = 0;
+	while (true)
+	{
+		// whole blocks, so that hashes line up with the old ones
+		size_t len = 0, rlen = 0;
+		while (len < SIGBLOCK && (rlen = lfp.read(buf + len, SIGBLOCK - len)) > 0)
+			len += rlen;
+		if (len == 0)
+			break;
+		fhash.update(buf, len);
+		ContentHash bhash;
+		bhash.update(buf, len);
+		newsig.push_back(bhash.digest());
+		size_t i = newsig.size() - 1;
+		if (i >= sig.size() || sig[i] != newsig[i])
+		{
+			int res = smbWriteAt(rfp, buf, len, off);
+			if (res != Aresq::OK)
+			{
+				rfp.close();
+				PELOG_ERROR_RETURN((PLV_ERROR, "Patch smb failed %d %s\n", res, rfile), res);
+			}
+			sent += len;
+		}
+		off += len;
+		lfp.release(off);
+	}
+	rfp.close();
+	if (lfp.error())
+		PELOG_ERROR_RETURN((PLV_ERROR, "Upload smb read failed %s\n", lfile), Aresq::FILELOCKED);
+	int res = smb2_truncate(d->smb, rfile, off);
+	if (res < 0)
+		PELOG_ERROR_RETURN((PLV_ERROR, "Patch smb truncate failed %d: %s\n", res, smb2_get_error(d->smb)), Aresq::DISCONNECTED);
+	sig.swap(newsig);
+	if (hash)
+		*hash = fhash.digest();
+	PELOG_ERROR_RETURN((PLV_VERBOSE, "PATCHDONE smb %" PRIu64 ", %" PRIu64 " sent %s -> %s\n", off, sent, lfile, rfile), Aresq::OK);
+}
+
+// AR_SIGDIR/<rfile relative to remote root>
+const char *RemoteSmb::sigPath(const char *rfile)
+{
+	size_t rootlen = d->smb.path.empty() ? 0 : d->smb.path.length() + 1;
+	return buildSmbPath(d->sigpath, d->smb.path.c_str(), AR_SIGDIR, rfile + rootlen, strlen(rfile + rootlen));
+}
+
+// block hashes of remote file `rfile` as uploaded last time, if it has not been changed since then
+int RemoteSmb::loadSig(const char *rfile, std::vector<uint64_t> &sig)
+{
+	sig.clear();
+	smb2_stat_64 st;
+	if (smb2_stat(d->smb, rfile, &st) < 0 || st.smb2_type != SMB2_TYPE_FILE)
+		return Aresq::NOTFOUND;
+	SmbFile fp(d->smb);
+	if (!(fp = smb2_open(d->smb, sigPath(rfile), O_RDONLY)))
+		return Aresq::NOTFOUND;
+	SigHeader header;
+	int res = smb2_pread(d->smb, fp, (uint8_t *)&header, sizeof(header), 0);
+	if (res != sizeof(header) || memcmp(header.magic, "ARSG", 4) != 0 || header.blocksize != SIGBLOCK ||
+		header.size != st.smb2_size || header.mtime != st.smb2_mtime || header.mtimensec != st.smb2_mtime_nsec ||
+		header.count != (header.size + SIGBLOCK - 1) / SIGBLOCK)
+	{
+		fp.close();
+		PELOG_ERROR_RETURN((PLV_DEBUG, "SIG smb outdated %s\n", rfile), Aresq::NOTFOUND);
+	}
+	sig.resize((size_t)header.count);
+	size_t total = sig.size() * sizeof(sig[0]);
+	size_t maxread = std::min((size_t)d->smb.getchunksize(), (size_t)smb2_get_max_read_size(d->smb));
+	for (size_t pos = 0; pos < total; pos += res)
+	{
+		res = smb2_pread(d->smb, fp, (uint8_t *)sig.data() + pos, (uint32_t)std::min(total - pos, maxread), sizeof(header) + pos);
+		if (res <= 0)
+		{
+			fp.close();
+			sig.clear();
+			PELOG_ERROR_RETURN((PLV_WARNING, "SIG smb read failed %d %s\n", res, rfile), Aresq::NOTFOUND);
+		}
+	}
+	fp.close();
+	return Aresq::OK;
+}
+
+int RemoteSmb::saveSig(const char *rfile, const std::vector<uint64_t> &sig)
+{
+	smb2_stat_64 st;
+	int res = smb2_stat(d->smb, rfile, &st);
+	if (res < 0)
+		PELOG_ERROR_RETURN((PLV_WARNING, "SIG smb stat failed %d %s\n", res, rfile), Aresq::NOTFOUND);
+	SigHeader header;
+	memcpy(header.magic, "ARSG", 4);
+	header.blocksize = SIGBLOCK;
+	header.size = st.smb2_size;
+	header.mtime = st.smb2_mtime;
+	header.mtimensec = st.smb2_mtime_nsec;
+	header.count = sig.size();
+	if (header.count != (header.size + SIGBLOCK - 1) / SIGBLOCK)	// changed while being uploaded
+		PELOG_ERROR_RETURN((PLV_WARNING, "SIG smb size mismatch %s\n", rfile), Aresq::CONFLICT);
+	abuf<char> buf(sizeof(header) + sig.size() * sizeof(sig[0]));
+	memcpy(buf, &header, sizeof(header));
+	memcpy(buf + sizeof(header), sig.data(), sig.size() * sizeof(sig[0]));
+	return smbPutBuf(sigPath(rfile), buf, buf.size());
+}
+
+struct SmbIoctlInfo
+{
+	int status = 0;	// 1: done
+	uint32_t ntstatus = 0;
+	std::vector<uint8_t> out;
+};
+
+void onSmbIoctl(struct smb2_context *smb2, int status, void *command_data, SmbIoctlInfo *info)
+{
+	info->status = 1;
+	info->ntstatus = status;
+	struct smb2_ioctl_reply *rep = (struct smb2_ioctl_reply *)command_data;
+	if (status == SMB2_STATUS_SUCCESS && rep && rep->output)
+	{
+		info->out.assign((uint8_t *)rep->output, (uint8_t *)rep->output + rep->output_count);
+		smb2_free_data(smb2, rep->output);
+	}
+}
+
+// FSCTL on an opened file. server errors are returned as Aresq::NOTIMPLEMENTED if the fsctl is not
+// supported, otherwise Aresq::EPARAM
+int RemoteSmb::smbIoctl(struct smb2fh *fh, uint32_t code, const void *in, uint32_t inlen, std::vector<uint8_t> &out)
+{
+	struct smb2_ioctl_request req;
+	memset(&req, 0, sizeof(req));
+	req.ctl_code = code;
+	memcpy(req.file_id, *smb2_get_file_id(fh), SMB2_FD_SIZE);
+	req.input_count = inlen;
+	req.input = (void *)in;
+	req.flags = SMB2_0_IOCTL_IS_FSCTL;
+	SmbIoctlInfo info;
+	struct smb2_pdu *pdu = smb2_cmd_ioctl_async(d->smb, &req, (smb2_command_cb)onSmbIoctl, &info);
+	if (!pdu)
+		PELOG_ERROR_RETURN((PLV_ERROR, "IOCTL smb failed: %s\n", smb2_get_error(d->smb)), Aresq::EINTERNAL);
+	smb2_queue_pdu(d->smb, pdu);
+	int res = 0;
 	while (info.status == 0)
 	{
 		pollfd pfd = { 0 };
-		pfd.fd = smb2_get_fd(info.smb);
-		pfd.events = smb2_which_events(info.smb);
+		pfd.fd = smb2_get_fd(d->smb);
+		pfd.events = smb2_which_events(d->smb);
 		if ((res = poll(&pfd, 1, 1000)) < 0)
-			PELOG_ERROR_RETURN((PLV_ERROR, "Upload smb failed 2 %d\n", res), Aresq::DISCONNECTED);
+			PELOG_ERROR_RETURN((PLV_ERROR, "IOCTL smb failed 2 %d\n", res), Aresq::DISCONNECTED);
 		if (pfd.revents == 0)
 			continue;
-		if ((res = smb2_service(info.smb, pfd.revents)) < 0)
-			PELOG_ERROR_RETURN((PLV_ERROR, "Upload smb failed 3 %d: %s\n", res, smb2_get_error(info.smb)), Aresq::DISCONNECTED);
+		if ((res = smb2_service(d->smb, pfd.revents)) < 0)
+			PELOG_ERROR_RETURN((PLV_ERROR, "IOCTL smb failed 3 %d: %s\n", res, smb2_get_error(d->smb)), Aresq::DISCONNECTED);
 	}
+	if (info.ntstatus == SMB2_STATUS_NOT_SUPPORTED || info.ntstatus == SMB2_STATUS_INVALID_DEVICE_REQUEST)
+		PELOG_ERROR_RETURN((PLV_DEBUG, "IOCTL smb %x not supported\n", code), Aresq::NOTIMPLEMENTED);
+	if (info.ntstatus != SMB2_STATUS_SUCCESS)
+		PELOG_ERROR_RETURN((PLV_ERROR, "IOCTL smb %x failed %s\n", code, nterror_to_str(info.ntstatus)), Aresq::EPARAM);
+	out.swap(info.out);
+	return Aresq::OK;
+}
 
-	info.rfp.close();
-	// always truncate, even if no extra data were written, in case of larger version of this file already exists
-	if (info.status > 0 && (res = smb2_truncate(info.smb, rfile, info.realsize)) < 0)
-		PELOG_ERROR_RETURN((PLV_ERROR, "Upload smb failed 7 %d: %s\n", res, smb2_get_error(info.smb)), Aresq::DISCONNECTED);
-
-	if (info.status > 0)
-		PELOG_ERROR_RETURN((PLV_VERBOSE, "PUTDONE smb %"PRIu64" %s -> %s\n", info.realsize, lfile, rfile), Aresq::OK);
-	return Aresq::DISCONNECTED;
+// copy a file on the server. data are asked from the source with a resume key, and written into
+// dst in ranges within the default limits of Windows and Samba: 1MB each, 16MB per request
+int RemoteSmb::copyFile(const char *src, const char *dst)
+{
+	enum { RESUMEKEYSIZE = 24, COPYCHUNKSIZE = 1024 * 1024, CHUNKSPERREQ = 16, CHUNKENTRYSIZE = 24 };
+	if (d->nocopychunk)
+		return Aresq::NOTIMPLEMENTED;
+	smb2_stat_64 st;
+	int res = smb2_stat(d->smb, src, &st);
+	if (res < 0 || st.smb2_type != SMB2_TYPE_FILE)
+		PELOG_ERROR_RETURN((PLV_ERROR, "COPY smb src not found %d %s\n", res, src), Aresq::NOTFOUND);
+	SmbFile sfp(d->smb), dfp(d->smb);
+	if (!(sfp = smb2_open(d->smb, src, O_RDONLY)))
+		PELOG_ERROR_RETURN((PLV_ERROR, "COPY smb cannot open %s\n", src), Aresq::NOTFOUND);
+	std::vector<uint8_t> key;
+	res = smbIoctl(sfp, SMB2_FSCTL_SRV_REQUEST_RESUME_KEY, NULL, 0, key);
+	if (res != Aresq::OK || key.size() < RESUMEKEYSIZE)
+	{
+		sfp.close();
+		if (res == Aresq::NOTIMPLEMENTED)
+			d->nocopychunk = true;
+		PELOG_ERROR_RETURN((PLV_WARNING, "COPY smb resume key failed %d, server-side copy disabled\n", res),
+			res == Aresq::OK ? Aresq::NOTIMPLEMENTED : res);
+	}
+	if (openForWrite(dst, dfp) != Aresq::OK)
+	{
+		sfp.close();
+		PELOG_ERROR_RETURN((PLV_ERROR, "COPY smb cannot write %s\n", dst), Aresq::EPARAM);
+	}
+	// SRV_COPYCHUNK_COPY: SourceKey[24], ChunkCount, Reserved, then SRV_COPYCHUNK: SourceOffset, TargetOffset, Length, Reserved
+	uint8_t req[RESUMEKEYSIZE + 8 + CHUNKENTRYSIZE * CHUNKSPERREQ];
+	memcpy(req, key.data(), RESUMEKEYSIZE);
+	std::vector<uint8_t> out;
+	for (uint64_t off = 0; off < st.smb2_size && res == Aresq::OK;)
+	{
+		uint32_t count = 0;
+		for (uint64_t coff = off; count < CHUNKSPERREQ && coff < st.smb2_size; ++count, coff += COPYCHUNKSIZE)
+		{
+			uint8_t *entry = req + RESUMEKEYSIZE + 8 + CHUNKENTRYSIZE * count;
+			put64(entry, coff);
+			put64(entry + 8, coff);
+			put32(entry + 16, (uint32_t)std::min(st.smb2_size - coff, (uint64_t)COPYCHUNKSIZE));
+			put32(entry + 20, 0);
+		}
+		put32(req + RESUMEKEYSIZE, count);
+		put32(req + RESUMEKEYSIZE + 4, 0);
+		res = smbIoctl(dfp, SMB2_FSCTL_SRV_COPYCHUNK_WRITE, req, RESUMEKEYSIZE + 8 + CHUNKENTRYSIZE * count, out);
+		// SRV_COPYCHUNK_RESPONSE: ChunksWritten, ChunkBytesWritten, TotalBytesWritten
+		uint32_t written = 0;
+		if (res == Aresq::OK && out.size() >= 12)
+			memcpy(&written, &out[8], 4);
+		if (res == Aresq::OK && written == 0)
+			res = Aresq::EPARAM;
+		off += written;
+	}
+	sfp.close();
+	dfp.close();
+	if (res == Aresq::NOTIMPLEMENTED)
+		d->nocopychunk = true;
+	if (res == Aresq::OK && (res = smb2_truncate(d->smb, dst, st.smb2_size)) < 0)
+		res = Aresq::DISCONNECTED;
+	if (res != Aresq::OK)
+	{
+		smb2_unlink(d->smb, dst);
+		PELOG_ERROR_RETURN((PLV_WARNING, "COPY smb failed %d %s -> %s\n", res, src, dst), res);
+	}
+	PELOG_ERROR_RETURN((PLV_VERBOSE, "COPY smb %" PRIu64 " bytes on server %s -> %s\n", st.smb2_size, src, dst), Aresq::OK);
 }
 
 int RemoteSmb::getType(const char *fullpath)
@@ -338,92 +1707,495 @@ int RemoteSmb::getType(const char *fullpath)
 	return FT_UNK;
 }
 
-int RemoteSmb::addDir(const char *rbase, const char *path)
+int RemoteSmb::addDir(const char *rbase, const char *path, size_t plen)
 {
-	std::string tpath = buildSmbPath(d->smb.path.c_str(), rbase, path);
-	return addDir(tpath.c_str());
+	return addDir(buildSmbPath(d->rpath, d->smb.path.c_str(), rbase, path, plen));
 }
 
-int RemoteSmb::addDir(const std::string &fullpath)
+int RemoteSmb::addDir(const char *fullpath)
 {
 	if (!d->smb.isconnected())
-		PELOG_ERROR_RETURN((PLV_ERROR, "ADDDIR smb remote disconnected: %s/%s\n", fullpath.c_str()), Aresq::DISCONNECTED);
-	PELOG_LOG((PLV_DEBUG, "to ADDDIR smb %s\n", fullpath.c_str()));
-	int res = smb2_mkdir(d->smb, fullpath.c_str());
+		PELOG_ERROR_RETURN((PLV_ERROR, "ADDDIR smb remote disconnected: %s\n", fullpath), Aresq::DISCONNECTED);
+	PELOG_LOG((PLV_DEBUG, "to ADDDIR smb %s\n", fullpath));
+	int res = smb2_mkdir(d->smb, fullpath);
 	if (res == -EEXIST)
 	{
-		res = getType(fullpath.c_str());
+		res = getType(fullpath);
 		if (res < 0)
-			PELOG_ERROR_RETURN((PLV_ERROR, "ADDDIR smb failed %d: %s\n", res, fullpath.c_str()), Aresq::EPARAM);
+			PELOG_ERROR_RETURN((PLV_ERROR, "ADDDIR smb failed %d: %s\n", res, fullpath), Aresq::EPARAM);
 		if (res == FT_DIR)
-			PELOG_ERROR_RETURN((PLV_VERBOSE, "Already exists smb: %s\n", fullpath.c_str()), Aresq::OK);
-		PELOG_LOG((PLV_WARNING, "smb DIR name conflict. deleting the existing file. %s\n", fullpath.c_str()));
-		if ((res = smb2_unlink(d->smb, fullpath.c_str())) == 0)
-			res = smb2_mkdir(d->smb, fullpath.c_str());
+			PELOG_ERROR_RETURN((PLV_VERBOSE, "Already exists smb: %s\n", fullpath), Aresq::OK);
+		PELOG_LOG((PLV_WARNING, "smb DIR name conflict. deleting the existing file. %s\n", fullpath));
+		if ((res = smb2_unlink(d->smb, fullpath)) == 0)
+			res = smb2_mkdir(d->smb, fullpath);
 	}
 	else if (res == -ENOENT)
 	{
-		PELOG_LOG((PLV_VERBOSE, "Creating smb parent dir: %s\n", fullpath.c_str()));
-		size_t sep = fullpath.rfind('/');
-		if (sep == fullpath.npos)
-			PELOG_ERROR_RETURN((PLV_ERROR, "ADDDIR smb create parent failed: %s\n", fullpath.c_str()), Aresq::EPARAM);
-		size_t bsep = d->smb.path.empty() ? 0 : d->smb.path.length() + 1;
-		if ((res = addDir(fullpath.substr(0, sep))) != Aresq::OK)
-			PELOG_ERROR_RETURN((PLV_ERROR, "ADDDIR smb create parent failed: %s\n", fullpath.c_str()), Aresq::EPARAM);
-		res = smb2_mkdir(d->smb, fullpath.c_str());
+		PELOG_LOG((PLV_VERBOSE, "Creating smb parent dir: %s\n", fullpath));
+		abufchar parent;
+		if (!parentPath(fullpath, parent))
+			PELOG_ERROR_RETURN((PLV_ERROR, "ADDDIR smb create parent failed: %s\n", fullpath), Aresq::EPARAM);
+		if ((res = addDir(parent)) != Aresq::OK)
+			PELOG_ERROR_RETURN((PLV_ERROR, "ADDDIR smb create parent failed: %s\n", fullpath), Aresq::EPARAM);
+		res = smb2_mkdir(d->smb, fullpath);
 	}
 	if (res != 0)
-		PELOG_ERROR_RETURN((PLV_ERROR, "ADDDIR smb failed (%d: %s): %s\n", res, nterror_to_str(res), fullpath.c_str()), Aresq::EPARAM);
-	PELOG_LOG((PLV_VERBOSE, "DIR smb added: %s\n", fullpath.c_str()));
+		PELOG_ERROR_RETURN((PLV_ERROR, "ADDDIR smb failed (%d: %s): %s\n", res, nterror_to_str(res), fullpath), Aresq::EPARAM);
+	PELOG_LOG((PLV_VERBOSE, "DIR smb added: %s\n", fullpath));
 	return Aresq::OK;
 }
 
-int RemoteSmb::addFile(const char *lbase, const char *rbase, const char *path)
+int RemoteSmb::addFile(const char *lbase, const char *rbase, const char *path, size_t plen, uint64_t *hash /*= NULL*/)
 {
-	std::string lpath = std::string(lbase) + '/' + path;
-	std::string rpath = buildSmbPath(d->smb.path.c_str(), rbase, path);
-	return addFile(lpath, rpath);
+	buildSmbPath(d->lpath, lbase, NULL, path, plen);
+	buildSmbPath(d->rpath, d->smb.path.c_str(), rbase, path, plen);
+	return addFile(d->lpath, d->rpath, hash);
 }
 
-int RemoteSmb::addFile(const std::string &lfullpath, const std::string &rfullpath)
+int RemoteSmb::addFile(const char *lfullpath, const char *rfullpath, uint64_t *hash /*= NULL*/)
 {
 	if (!d->smb.isconnected())
-		PELOG_ERROR_RETURN((PLV_ERROR, "ADDFILE smb remote disconnected: %s\n", lfullpath.c_str()), Aresq::DISCONNECTED);
+		PELOG_ERROR_RETURN((PLV_ERROR, "ADDFILE smb remote disconnected: %s\n", lfullpath), Aresq::DISCONNECTED);
 	int res = Aresq::OK;
 
 	// put file to tmp dir
 	char tmpbuf[32];
+	tmpName(tmpbuf, sizeof(tmpbuf));
+	const char *tmpfn = buildSmbPath(d->tmppath, d->smb.path.c_str(), AR_TMPDIR, tmpbuf, strlen(tmpbuf));
+	// large files are patched into the old copy if possible. chunked mode dedupes by itself
+	bool usesig = false, sparse = false;
+	// data looking like one of the formats are stored in a container, see packedHead()
+	bool packed = !d->chunked && !d->compress && packedFile(lfullpath);
+	if (!d->chunked && !d->compress && !d->encrypt && !packed)
 	{
-		uint64_t timestamp =
-			std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
-#pragma warning(suppress : 4996)
-		int pid = getpid();
-		snprintf(tmpbuf, 32, "%" PRIu64 ".%d", timestamp, pid);
+		LocalFile lfp;
+		usesig = lfp.open(lfullpath) == 0 && lfp.size() >= DELTAMIN;
+		sparse = lfp.sparse();
 	}
-	std::string tmpfn = buildSmbPath(d->smb.path.c_str(), AR_TMPDIR, tmpbuf);
-	res = smbPutFile(lfullpath.c_str(), tmpfn.c_str());
+	std::vector<uint64_t> sig;
+	// a copy made on the server is patched, the old version stays in place until the new one is complete
+	bool patched = usesig && loadSig(rfullpath, sig) == Aresq::OK && copyFile(rfullpath, tmpfn) == Aresq::OK;
+	if (patched)
+		res = smbPatchFile(lfullpath, tmpfn, sig, hash);
+	else if (d->chunked)
+		res = smbPutChunked(lfullpath, tmpfn, hash);
+	else if (d->compress || packed)
+		res = smbPutCompressed(lfullpath, tmpfn, hash);
+	else if (d->encrypt)
+		res = smbPutEncrypted(lfullpath, tmpfn, hash);
+	else if (sparse)
+		res = smbPutSparse(lfullpath, tmpfn, hash, usesig ? &sig : NULL);
+	else
+		res = smbPutFile(lfullpath, tmpfn, hash, usesig ? &sig : NULL);
+	if (res != Aresq::OK && patched && res != Aresq::DISCONNECTED)
+		smb2_unlink(d->smb, tmpfn);
 	if (res != Aresq::OK)
-		PELOG_ERROR_RETURN((PLV_ERROR, "ADDFILE smb failed 1:%d %s\n", res, lfullpath.c_str()), res);
+		PELOG_ERROR_RETURN((PLV_ERROR, "ADDFILE smb failed 1:%d %s\n", res, lfullpath), res);
 
 	// move tmp file into dst file
-	res = moveFile(tmpfn.c_str(), rfullpath.c_str(), true);
+	res = moveFile(tmpfn, rfullpath, true);
 	if (res != 0)
-		PELOG_ERROR_RETURN((PLV_ERROR, "ADDFILE smb failed 2:%d %s\n", res, lfullpath.c_str()), Aresq::EPARAM);
-	PELOG_ERROR_RETURN((PLV_VERBOSE, "ADDFILE smb done 2 %s\n", rfullpath.c_str()), Aresq::OK);
+		PELOG_ERROR_RETURN((PLV_ERROR, "ADDFILE smb failed 2:%d %s\n", res, lfullpath), Aresq::EPARAM);
+	if (usesig)
+		saveSig(rfullpath, sig);	// only for the next upload, failures do not matter
+	PELOG_ERROR_RETURN((PLV_VERBOSE, "ADDFILE smb done 2 %s\n", rfullpath), Aresq::OK);
+}
+
+void onSmbUpload(struct smb2_context *smb2, int status, void *command_data, SmbUpload *up)
+{
+	up->busy = false;
+	up->status = status;
+	if (up->stage == SmbUpload::OPEN && status == 0)
+		up->fh = (smb2fh *)command_data;
+}
+
+int RemoteSmb::queueFile(const char *lbase, const char *rbase, const char *path, size_t plen)
+{
+	if (d->uploads <= 1 || d->chunked || d->compress || d->encrypt || !d->smb.isconnected())
+		return Aresq::NOTIMPLEMENTED;
+	std::unique_ptr<SmbUpload> up(new SmbUpload);
+	up->lfile = buildSmbPath(d->lpath, lbase, NULL, path, plen);
+	// large files may be patched, sparse ones need care, and data looking like a container are stored
+	// in one. all go the usual way
+	if (up->lfp.open(up->lfile.c_str()) != 0 || up->lfp.size() >= DELTAMIN || up->lfp.sparse() ||
+			packedFile(up->lfile.c_str()))
+		return Aresq::NOTIMPLEMENTED;
+	up->path.assign(path, plen);
+	up->rfile = buildSmbPath(d->rpath, d->smb.path.c_str(), rbase, path, plen);
+	char tmpbuf[48], suffix[16];
+	snprintf(suffix, sizeof(suffix), ".q%u", ++d->uploadseq);
+	tmpName(tmpbuf, sizeof(tmpbuf), suffix);
+	up->tmpfile = buildSmbPath(d->tmppath, d->smb.path.c_str(), AR_TMPDIR, tmpbuf, strlen(tmpbuf));
+	size_t chunksize = d->smb.getchunksize();
+	// spread over the connections of the pool
+	up->smb = d->smb;
+	for (size_t i = 0; i < laneCount(); ++i)
+	{
+		size_t idx = d->nextlane++ % laneCount();
+		SmbHandle *smb = lane(idx);
+		if (smb && smb->getchunksize() >= chunksize)
+		{
+			up->lane = idx;
+			up->smb = *smb;
+			break;
+		}
+	}
+	up->buf.resize(roundChunk((size_t)std::min((uint64_t)chunksize, std::max(up->lfp.size(), (uint64_t)1)), chunksize));
+	if (!d->nocompound && up->lfp.size() <= std::min(COMPOUNDMAX, (uint64_t)chunksize))
+		up->stage = SmbUpload::COMPOUND;
+	stepUpload(*up);
+	d->uploadq.push_back(std::move(up));
+	return Aresq::OK;
+}
+
+void onSmbCompound(struct smb2_context *smb2, int status, void *command_data, SmbUpload *up)
+{
+	if (status != SMB2_STATUS_SUCCESS && up->failed < 0)
+	{
+		up->failed = up->replies;
+		up->status = -nterror_to_errno(status);
+	}
+	// the rest of a chain not sent yet is dropped along with the first call, cancelled
+	if (++up->replies == up->calls || (uint32_t)status == SMB2_STATUS_CANCELLED)
+		up->busy = false;
+}
+
+// create + write + set end of file + rename + close of a small file in one compound chain, a single
+// round trip rather than several for each call of the usual way. rename replaces the old copy
+static int issueCompound(SmbUpload &up)
+{
+	smb2_command_cb cb = (smb2_command_cb)onSmbCompound;
+	up.replies = up.calls = 0;
+	up.failed = -1;
+	up.status = 0;
+	auto chain = [&up](struct smb2_pdu *pdu, struct smb2_pdu *next)
+	{
+		if (!next)
+			return false;
+		smb2_add_compound_pdu(up.smb, pdu, next);
+		++up.calls;
+		return true;
+	};
+
+	struct smb2_create_request cr_req;
+	memset(&cr_req, 0, sizeof(cr_req));
+	cr_req.requested_oplock_level = SMB2_OPLOCK_LEVEL_NONE;
+	cr_req.impersonation_level = SMB2_IMPERSONATION_IMPERSONATION;
+	cr_req.desired_access = SMB2_GENERIC_WRITE | SMB2_DELETE;
+	cr_req.share_access = SMB2_FILE_SHARE_READ | SMB2_FILE_SHARE_WRITE | SMB2_FILE_SHARE_DELETE;
+	cr_req.create_disposition = SMB2_FILE_OVERWRITE_IF;
+	cr_req.create_options = SMB2_FILE_NON_DIRECTORY_FILE;
+	cr_req.name = up.tmpfile.c_str();
+	struct smb2_pdu *pdu = smb2_cmd_create_async(up.smb, &cr_req, cb, &up);
+	if (!pdu)
+	{
+		up.failed = 0;
+		PELOG_ERROR_RETURN((PLV_ERROR, "Upload smb compound failed: %s\n", smb2_get_error(up.smb)), -ENOMEM);
+	}
+	up.calls = 1;
+
+	bool ok = true;
+	if (up.len > 0)	// none for empty files
+	{
+		struct smb2_write_request wr_req;
+		memset(&wr_req, 0, sizeof(wr_req));
+		wr_req.length = (uint32_t)up.len;
+		wr_req.offset = 0;
+		wr_req.buf = (const uint8_t *)up.buf.buf();
+		memcpy(wr_req.file_id, compound_file_id, SMB2_FD_SIZE);
+		ok = chain(pdu, smb2_cmd_write_async(up.smb, &wr_req, cb, &up));
+	}
+
+	struct smb2_set_info_request si_req;
+	memset(&si_req, 0, sizeof(si_req));
+	si_req.info_type = SMB2_0_INFO_FILE;
+	memcpy(si_req.file_id, compound_file_id, SMB2_FD_SIZE);
+	struct smb2_file_end_of_file_info eofi;
+	eofi.end_of_file = up.realsize;	// data were padded like smbPutFile
+	si_req.file_info_class = SMB2_FILE_END_OF_FILE_INFORMATION;
+	si_req.input_data = &eofi;
+	ok = ok && chain(pdu, smb2_cmd_set_info_async(up.smb, &si_req, cb, &up));
+
+	struct smb2_file_rename_info rn_info;
+	rn_info.replace_if_exist = 1;
+	rn_info.file_name = (const uint8_t *)up.rfile.c_str();
+	si_req.file_info_class = SMB2_FILE_RENAME_INFORMATION;
+	si_req.input_data = &rn_info;
+	ok = ok && chain(pdu, smb2_cmd_set_info_async(up.smb, &si_req, cb, &up));
+
+	struct smb2_close_request cl_req;
+	memset(&cl_req, 0, sizeof(cl_req));
+	memcpy(cl_req.file_id, compound_file_id, SMB2_FD_SIZE);
+	ok = ok && chain(pdu, smb2_cmd_close_async(up.smb, &cl_req, cb, &up));
+	if (!ok)
+	{
+		smb2_free_pdu(up.smb, pdu);
+		up.failed = 0;
+		PELOG_ERROR_RETURN((PLV_ERROR, "Upload smb compound failed: %s\n", smb2_get_error(up.smb)), -ENOMEM);
+	}
+	smb2_queue_pdu(up.smb, pdu);
+	return 0;
+}
+
+// take the result of the last call of `up`, and issue the next one
+void RemoteSmb::stepUpload(SmbUpload &up)
+{
+	int res = 0;
+	if (up.stage == SmbUpload::COMPOUND && up.issued)
+	{
+		enum { CREATE, WRITE, SETEOF, RENAME, CLOSE };
+		int failed = up.len == 0 && up.failed >= WRITE ? up.failed + 1 : up.failed;	// no write for empty files
+		if (failed < 0 || failed == CLOSE)	// renamed in place even if only close failed
+		{
+			up.lfp.close();
+			up.res = Aresq::OK;
+			up.stage = SmbUpload::DONE;
+			PELOG_LOG((PLV_VERBOSE, "PUTDONE smb compound %" PRIu64 " %s -> %s\n", up.realsize, up.lfile.c_str(), up.rfile.c_str()));
+			return;
+		}
+		if ((failed == WRITE || failed == SETEOF) && !d->nocompound)
+		{
+			d->nocompound = true;
+			PELOG_LOG((PLV_WARNING, "Upload smb compound not taken by the server %d, small files go the usual way\n", up.status));
+		}
+		// the usual way creates the tmp dir if missing, and gets a dst in the way out of it
+		restartUpload(up, up.lane, up.smb);
+		if (up.stage == SmbUpload::DONE)
+			return;
+	}
+	else if (up.issued && up.status < 0)
+	{
+		if (up.stage == SmbUpload::OPEN && !up.retried)
+		{
+			// tmp dir may be missing, create it and try once more
+			abufchar parent;
+			up.retried = true;
+			if (parentPath(up.tmpfile.c_str(), parent))
+				addDir(parent);
+			up.issued = false;
+		}
+		else if (up.stage == SmbUpload::RENAME && !up.unlinked)	// dst may exist, rename does not replace it
+		{
+			up.unlinked = true;
+			up.stage = SmbUpload::UNLINK;
+			up.issued = false;
+		}
+		else if (up.stage == SmbUpload::RENAME || up.stage == SmbUpload::UNLINK)	// try the way of moveFile()
+		{
+			up.status = moveFile(up.tmpfile.c_str(), up.rfile.c_str(), true);
+			up.res = up.status == Aresq::OK ? Aresq::OK : Aresq::EPARAM;
+			up.stage = SmbUpload::DONE;
+			return;
+		}
+		else
+		{
+			PELOG_LOG((PLV_ERROR, "Upload smb queued failed %d at %d: %s\n", up.status, (int)up.stage, up.lfile.c_str()));
+			up.res = up.stage == SmbUpload::OPEN || up.stage >= SmbUpload::RENAME ? Aresq::EPARAM : Aresq::DISCONNECTED;
+			if (up.fh && up.stage != SmbUpload::CLOSE)
+				smb2_close(up.smb, up.fh);
+			up.fh = NULL;
+			up.stage = SmbUpload::DONE;
+			return;
+		}
+	}
+	else if (up.issued)	// the call of this stage succeeded
+	{
+		switch (up.stage)
+		{
+		case SmbUpload::OPEN:
+			up.stage = SmbUpload::WRITE;
+			up.len = up.done = 0;
+			break;
+		case SmbUpload::WRITE:
+			up.done += up.status;
+			if (up.done < up.len)	// shortened for credits, send the rest
+				break;
+			up.off += up.len;
+			up.len = up.done = 0;
+			break;
+		case SmbUpload::TRUNCATE:
+			up.stage = SmbUpload::CLOSE;
+			break;
+		case SmbUpload::CLOSE:
+			up.fh = NULL;
+			up.stage = SmbUpload::RENAME;
+			break;
+		case SmbUpload::UNLINK:
+			up.stage = SmbUpload::RENAME;
+			break;
+		default:	// RENAME
+			up.lfp.close();
+			up.res = Aresq::OK;
+			up.stage = SmbUpload::DONE;
+			PELOG_LOG((PLV_VERBOSE, "PUTDONE smb queued %" PRIu64 " %s -> %s\n", up.realsize, up.lfile.c_str(), up.rfile.c_str()));
+			return;
+		}
+	}
+	if (up.stage == SmbUpload::WRITE && up.len == 0)
+	{
+		size_t len = up.lfp.read(up.buf, std::min(up.buf.size(), (size_t)d->smb.getchunksize()));
+		if (up.lfp.error())
+		{
+			PELOG_LOG((PLV_ERROR, "Upload smb read local failed %s\n", up.lfile.c_str()));
+			smb2_close(up.smb, up.fh);
+			up.fh = NULL;
+			up.res = Aresq::FILELOCKED;
+			up.stage = SmbUpload::DONE;
+			return;
+		}
+		if (len == 0)
+			up.stage = SmbUpload::TRUNCATE;
+		else
+		{
+			up.hash.update(up.buf, len);
+			up.off = up.realsize;
+			up.realsize += len;
+			up.lfp.release(up.realsize);
+			up.len = roundChunk(len, d->smb.getchunksize());	// padded like smbPutFile, truncated at the end
+			if (up.len > len)
+				memset(up.buf + len, 0, up.len - len);
+		}
+	}
+	if (up.stage == SmbUpload::COMPOUND)
+	{
+		size_t len = up.lfp.read(up.buf, up.buf.size());
+		char more = 0;
+		if (up.lfp.error() || up.lfp.read(&more, 1) > 0)	// grown to more than the buffer
+		{
+			restartUpload(up, up.lane, up.smb);
+			if (up.stage == SmbUpload::DONE)
+				return;
+		}
+		else
+		{
+			up.hash.update(up.buf, len);
+			up.realsize = len;
+			up.len = len > 0 ? roundChunk(len, d->smb.getchunksize()) : 0;
+			if (up.len > len)
+				memset(up.buf + len, 0, up.len - len);
+		}
+	}
+	up.issued = up.busy = true;
+	smb2_command_cb cb = (smb2_command_cb)onSmbUpload;
+	switch (up.stage)
+	{
+	case SmbUpload::COMPOUND:
+		res = issueCompound(up);
+		break;
+	case SmbUpload::OPEN:
+		res = smb2_open_async(up.smb, up.tmpfile.c_str(), O_WRONLY | O_CREAT, cb, &up);
+		break;
+	case SmbUpload::WRITE:
+		res = smb2_pwrite_async(up.smb, up.fh, (const uint8_t *)up.buf.buf() + up.done, (uint32_t)(up.len - up.done),
+			up.off + up.done, cb, &up);
+		break;
+	case SmbUpload::TRUNCATE:
+		res = smb2_ftruncate_async(up.smb, up.fh, up.realsize, cb, &up);
+		break;
+	case SmbUpload::CLOSE:
+		res = smb2_close_async(up.smb, up.fh, cb, &up);
+		break;
+	case SmbUpload::RENAME:
+		res = smb2_rename_async(up.smb, up.tmpfile.c_str(), up.rfile.c_str(), cb, &up);
+		break;
+	case SmbUpload::UNLINK:
+		res = smb2_unlink_async(up.smb, up.rfile.c_str(), cb, &up);
+		break;
+	default:
+		break;
+	}
+	if (res < 0)	// not issued, the callback will not come
+	{
+		up.busy = false;
+		up.status = res;
+		up.retried = up.unlinked = true;
+		stepUpload(up);
+	}
 }
 
-int RemoteSmb::delDir(const char *rbase, const char *path)
+int RemoteSmb::doneFiles(std::vector<FileDone> &done, bool all)
 {
-	if (!path || !*path)
+	// finished ones wait behind a slow one to be reported in order, but not too many of them
+	static const size_t MAXQUEUED = 1024;
+	done.clear();
+	int ret = Aresq::OK;
+	std::vector<size_t> busy(laneCount());
+	std::vector<pollfd> pfds;
+	std::vector<size_t> polled;
+	while (true)
+	{
+		size_t active = 0;
+		std::fill(busy.begin(), busy.end(), 0);
+		for (std::unique_ptr<SmbUpload> &up : d->uploadq)
+		{
+			if (up->stage != SmbUpload::DONE && !up->busy)
+				stepUpload(*up);
+			active += up->stage != SmbUpload::DONE;
+			busy[up->lane] += up->busy;
+		}
+		while (!d->uploadq.empty() && d->uploadq.front()->stage == SmbUpload::DONE)
+		{
+			SmbUpload &up = *d->uploadq.front();
+			FileDone fd;
+			fd.path = up.path;
+			fd.res = up.res;
+			fd.hash = up.res == Aresq::OK ? up.hash.digest() : 0;
+			done.push_back(fd);
+			d->uploadq.pop_front();
+		}
+		if (all ? active == 0 : active < d->uploads && d->uploadq.size() < MAXQUEUED)
+			break;
+		pfds.clear();
+		polled.clear();
+		for (size_t i = 0; i < busy.size(); ++i)
+		{
+			if (i > 0 && busy[i] == 0)
+				continue;
+			SmbHandle *smb = lane(i);
+			if (!smb)
+				continue;
+			pollfd pfd = { 0 };
+			pfd.fd = smb2_get_fd(*smb);
+			pfd.events = smb2_which_events(*smb);
+			pfds.push_back(pfd);
+			polled.push_back(i);
+		}
+		int res = poll(pfds.data(), (unsigned)pfds.size(), 1000);
+		for (size_t j = 0; res > 0 && j < pfds.size(); ++j)
+		{
+			SmbHandle *smb = lane(polled[j]);
+			if (!smb || pfds[j].revents == 0 || smb2_service(*smb, pfds[j].revents) >= 0)
+				continue;
+			PELOG_LOG((PLV_ERROR, "Upload smb queued failed on connection %d: %s\n", (int)polled[j], smb2_get_error(*smb)));
+			if (polled[j] == 0)
+			{
+				res = -1;
+				break;
+			}
+			laneFailed(polled[j]);
+		}
+		if (res < 0)
+		{
+			// the main connection is lost, and so are all the calls in flight on it
+			PELOG_LOG((PLV_ERROR, "Upload smb queued failed %d\n", res));
+			mainFailed();
+			ret = Aresq::DISCONNECTED;
+		}
+	}
+	return ret;
+}
+
+int RemoteSmb::delDir(const char *rbase, const char *path, size_t plen)
+{
+	if (!path || plen == 0)
 		PELOG_ERROR_RETURN((PLV_ERROR, "DELDIR invalid dir name\n"), Aresq::EPARAM);
-	std::string tpath = buildSmbPath(d->smb.path.c_str(), rbase, path);
-	return delDir(tpath);
+	return delDir(buildSmbPath(d->rpath, d->smb.path.c_str(), rbase, path, plen));
 }
 
-int RemoteSmb::delDir(const std::string &fullpath)
+int RemoteSmb::delDir(const char *fullpath)
 {
 	if (!d->smb.isconnected())
-		PELOG_ERROR_RETURN((PLV_ERROR, "DELDIR remote disconnected: %s\n", fullpath.c_str()), Aresq::DISCONNECTED);
+		PELOG_ERROR_RETURN((PLV_ERROR, "DELDIR remote disconnected: %s\n", fullpath), Aresq::DISCONNECTED);
 
 	// del contents
 	int res = Aresq::OK;
@@ -431,7 +2203,7 @@ int RemoteSmb::delDir(const std::string &fullpath)
 	SmbDir dir(d->smb);
 	for (int retry = 0; retry < 3; ++retry)
 	{
-		dir = smb2_opendir(d->smb, fullpath.c_str());
+		dir = smb2_opendir(d->smb, fullpath);
 		if (!dir)
 			PELOG_ERROR_RETURN((PLV_WARNING, "smb remote dir not found\n"), Aresq::OK);
 		struct smb2dirent *ent = NULL;
@@ -448,61 +2220,104 @@ int RemoteSmb::delDir(const std::string &fullpath)
 			empty = true;
 			break;
 		}
+		abufchar subpath;
 		for (const std::pair<std::string, bool> &item : dcont)
 		{
-			res = item.second ? delDir(fullpath + item.first) : delFile(fullpath + item.first);
+			buildSmbPath(subpath, fullpath, NULL, item.first.c_str(), item.first.length());
+			res = item.second ? delDir(subpath) : delFile(subpath);
 			if (res != Aresq::OK)
 				return res;
 		}
 	}
 
 	if (!empty)
-		PELOG_ERROR_RETURN((PLV_ERROR, "DELDIR: del contents failed %s\n", fullpath.c_str()), Aresq::EINTERNAL);
+		PELOG_ERROR_RETURN((PLV_ERROR, "DELDIR: del contents failed %s\n", fullpath), Aresq::EINTERNAL);
 
-	PELOG_LOG((PLV_DEBUG, "to DELDIR smb %s\n", fullpath.c_str()));
-	res = smb2_rmdir(d->smb, fullpath.c_str());
+	PELOG_LOG((PLV_DEBUG, "to DELDIR smb %s\n", fullpath));
+	res = smb2_rmdir(d->smb, fullpath);
 	if (res < 0 && res != -ENOENT)
-		PELOG_ERROR_RETURN((PLV_ERROR, "DELDIR smb failed %d: %s\n", res, fullpath.c_str()), Aresq::EPARAM);
+		PELOG_ERROR_RETURN((PLV_ERROR, "DELDIR smb failed %d: %s\n", res, fullpath), Aresq::EPARAM);
 
 	// verify
-	res = isDir(fullpath.c_str());
+	res = isDir(fullpath);
 	if (res != 0)
-		PELOG_ERROR_RETURN((PLV_ERROR, "DELDIR smb failed %d %s\n", res, fullpath.c_str()), Aresq::EPARAM);
+		PELOG_ERROR_RETURN((PLV_ERROR, "DELDIR smb failed %d %s\n", res, fullpath), Aresq::EPARAM);
 
 	PELOG_ERROR_RETURN((PLV_VERBOSE, "DELDIR smb done\n"), Aresq::OK);
 }
 
-int RemoteSmb::delFile(const char *rbase, const char *path)
+int RemoteSmb::delFile(const char *rbase, const char *path, size_t plen)
 {
-	std::string tpath = buildSmbPath(d->smb.path.c_str(), rbase, path);
-	return delFile(tpath);
+	return delFile(buildSmbPath(d->rpath, d->smb.path.c_str(), rbase, path, plen));
 }
 
-int RemoteSmb::delFile(const std::string &fullpath)
+int RemoteSmb::delFile(const char *fullpath)
 {
 	if (!d->smb.isconnected())
 		PELOG_ERROR_RETURN((PLV_ERROR, "DELFILE smb remote disconnected: %s\n", fullpath), Aresq::DISCONNECTED);
-	int res = smb2_unlink(d->smb, fullpath.c_str());
+	int res = smb2_unlink(d->smb, fullpath);
 	if (res < 0 && res != -ENOENT)
-		PELOG_ERROR_RETURN((PLV_ERROR, "DELFILE smb failed %d: %s\n", res, fullpath.c_str()), Aresq::EPARAM);
+		PELOG_ERROR_RETURN((PLV_ERROR, "DELFILE smb failed %d: %s\n", res, fullpath), Aresq::EPARAM);
 	PELOG_ERROR_RETURN((PLV_VERBOSE, "DELFILE smb done\n"), Aresq::OK);
 }
 
-int RemoteSmb::putHist(const char *rbase, const char *path)
+int RemoteSmb::putHist(const char *rbase, const char *path, size_t plen)
 {
-	std::string rpath = buildSmbPath(d->smb.path.c_str(), rbase, path);
-	std::string histpath = buildSmbPath(d->smb.path.c_str(), AR_HISTDIR, rbase) + '/' + path;
+	if (!d->smb.isconnected())
+		PELOG_ERROR_RETURN((PLV_ERROR, "HIST smb remote disconnected: %.*s\n", (int)plen, path), Aresq::DISCONNECTED);
+	const char *rpath = buildSmbPath(d->rpath, d->smb.path.c_str(), rbase, path, plen);
 	uint64_t timestamp =
 		std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
 	char tmpbuf[32];
 	snprintf(tmpbuf, 32, ".%" PRIu64, timestamp);
-	histpath += tmpbuf;
-	int res = moveFile(rpath.c_str(), histpath.c_str(), true);
+	// <root>/AR_HISTDIR/<rbase>/<path>.<timestamp>
+	size_t rootlen = d->smb.path.empty() ? 0 : d->smb.path.length() + 1;
+	const char *histpath = buildSmbPath(d->histpath, d->smb.path.c_str(), AR_HISTDIR, rpath + rootlen, strlen(rpath + rootlen), tmpbuf);
+	// keep the file in place for the delta upload following, if it can be copied on the server
+	std::vector<uint64_t> sig;
+	if (!d->nocopychunk && !d->chunked && !d->compress && !d->encrypt && loadSig(rpath, sig) == Aresq::OK && copyFile(rpath, histpath) == Aresq::OK)
+		PELOG_ERROR_RETURN((PLV_VERBOSE, "HIST smb copied %s\n", histpath), Aresq::OK);
+	int res = moveFile(rpath, histpath, true);
+	if (res == Aresq::NOTFOUND)
+		PELOG_ERROR_RETURN((PLV_WARNING, "HIST smb src not exist %s\n", rpath), Aresq::OK);
+	else if (res != Aresq::OK)
+		PELOG_ERROR_RETURN((PLV_ERROR, "HIST smb failed %d %s\n", res, rpath), Aresq::EPARAM);
+	PELOG_ERROR_RETURN((PLV_VERBOSE, "HIST smb done %s\n", histpath), Aresq::OK);
+}
+
+int RemoteSmb::rename(const char *rbase, const char *path, size_t plen, const char *dst, size_t dlen)
+{
+	if (!d->smb.isconnected())
+		PELOG_ERROR_RETURN((PLV_ERROR, "RENAME smb remote disconnected: %.*s\n", (int)plen, path), Aresq::DISCONNECTED);
+	const char *rpath = buildSmbPath(d->rpath, d->smb.path.c_str(), rbase, path, plen);
+	const char *dstpath = buildSmbPath(d->tmppath, d->smb.path.c_str(), rbase, dst, dlen);
+	// records say dst does not exist, anything there is a leftover
+	int res = moveFile(rpath, dstpath, true);
 	if (res == Aresq::NOTFOUND)
-		PELOG_ERROR_RETURN((PLV_WARNING, "HIST smb src not exist %s\n", rpath.c_str()), Aresq::OK);
+		PELOG_ERROR_RETURN((PLV_ERROR, "RENAME smb src not exist %s\n", rpath), Aresq::NOTFOUND);
 	else if (res != Aresq::OK)
-		PELOG_ERROR_RETURN((PLV_ERROR, "HIST smb failed %d %s\n", res, rpath.c_str()), Aresq::EPARAM);
-	PELOG_ERROR_RETURN((PLV_VERBOSE, "HIST smb done %s\n", histpath.c_str()), Aresq::OK);
+		PELOG_ERROR_RETURN((PLV_ERROR, "RENAME smb failed %d %s\n", res, rpath), Aresq::EPARAM);
+	PELOG_ERROR_RETURN((PLV_VERBOSE, "RENAME smb done %s\n", dstpath), Aresq::OK);
+}
+
+int RemoteSmb::copy(const char *sbase, const char *src, size_t slen, const char *rbase, const char *path, size_t plen)
+{
+	if (!d->smb.isconnected())
+		PELOG_ERROR_RETURN((PLV_ERROR, "COPY smb remote disconnected: %.*s\n", (int)plen, path), Aresq::DISCONNECTED);
+	if (d->nocopychunk)
+		return Aresq::NOTIMPLEMENTED;
+	const char *spath = buildSmbPath(d->srcpath, d->smb.path.c_str(), sbase, src, slen);
+	const char *rpath = buildSmbPath(d->rpath, d->smb.path.c_str(), rbase, path, plen);
+	// into tmp first, the same as uploads
+	char tmpbuf[32];
+	tmpName(tmpbuf, sizeof(tmpbuf));
+	const char *tmpfn = buildSmbPath(d->tmppath, d->smb.path.c_str(), AR_TMPDIR, tmpbuf, strlen(tmpbuf));
+	int res = copyFile(spath, tmpfn);
+	if (res != Aresq::OK)
+		return res;
+	if ((res = moveFile(tmpfn, rpath, true)) != Aresq::OK)
+		PELOG_ERROR_RETURN((PLV_ERROR, "COPY smb move failed %d %s\n", res, rpath), Aresq::EPARAM);
+	PELOG_ERROR_RETURN((PLV_VERBOSE, "COPY smb done %s -> %s\n", spath, rpath), Aresq::OK);
 }
 
 int RemoteSmb::moveFile(const char *oldpath, const char *newpath, bool force)
@@ -526,10 +2341,9 @@ int RemoteSmb::moveFile(const char *oldpath, const char *newpath, bool force)
 			delFile(newpath);
 	}
 	// create parent dir
-	const char *pathsep = strrchr(newpath, '/');
-	if (pathsep)
+	abufchar parentpath;
+	if (parentPath(newpath, parentpath))
 	{
-		std::string parentpath(newpath, pathsep);
 		res = addDir(parentpath);
 		if (res != Aresq::OK)
 			PELOG_ERROR_RETURN((PLV_ERROR, "MOVEFILE smb parent failed %d %s\n", res, newpath), res);
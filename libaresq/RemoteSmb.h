@@ -2,6 +2,7 @@
 #include "Remote.h"
 #include "libconfig/libconfig.h"
 #include "string"
+#include "vector"
 
 struct RemoteSmbData;
 
@@ -11,23 +12,65 @@ public:
 	RemoteSmb();
 	virtual ~RemoteSmb();
 	int init(const char *server, const char *share, const char *user, const char *password, const char *path);
-	virtual int addDir(const char *rbase, const char *path);
-	virtual int addFile(const char *lbase, const char *rbase, const char *path);
-	virtual int delDir(const char *rbase, const char *path);
-	virtual int delFile(const char *rbase, const char *path);
-	virtual int putHist(const char *rbase, const char *path);
+	virtual int addDir(const char *rbase, const char *path, size_t plen);
+	virtual int addFile(const char *lbase, const char *rbase, const char *path, size_t plen, uint64_t *hash = NULL);
+	virtual int delDir(const char *rbase, const char *path, size_t plen);
+	virtual int delFile(const char *rbase, const char *path, size_t plen);
+	virtual int putHist(const char *rbase, const char *path, size_t plen);
+	virtual int rename(const char *rbase, const char *path, size_t plen, const char *dst, size_t dlen);
+	virtual int copy(const char *sbase, const char *src, size_t slen, const char *rbase, const char *path, size_t plen);
+	virtual int getFile(const char *rbase, const char *path, size_t plen, const char *lfile);
+	virtual int queueFile(const char *lbase, const char *rbase, const char *path, size_t plen);
+	virtual int doneFiles(std::vector<FileDone> &done, bool all);
 	virtual int getType(const char *fullpath);
 	virtual int moveFile(const char *oldpath, const char *newpath, bool force);
 
 protected:
-	int addDir(const std::string &fullpath);
-	int addFile(const std::string &lfullpath, const std::string &rfullpath);
-	int delDir(const std::string &fullpath);
-	int delFile(const std::string &fullpath);
+	int addDir(const char *fullpath);
+	int addFile(const char *lfullpath, const char *rfullpath, uint64_t *hash = NULL);
+	void stepUpload(struct SmbUpload &up);
+	int delDir(const char *fullpath);
+	int delFile(const char *fullpath);
 
+	// connection `idx` of the pool, 0 being the main one. others are connected again once their
+	// retry time is up, NULL if still down or the main one is
+	class SmbHandle *lane(size_t idx);
+	// drop the connection `idx` > 0 as broken, and keep it down for a while. queued files on it
+	// are sent again on the main one
+	void laneFailed(size_t idx);
+	// drop the main connection as broken, failing the queued files on it
+	void mainFailed();
+	size_t laneCount() const;
+
+	// open `rfile` to write, creating it and its parent dirs if missing
+	int openForWrite(const char *rfile, class SmbFile &fp);
 	int isDir(const char *fullpath) { int type = getType(fullpath); return type == FT_DIR ? 1 : type >= 0 ? 0 : type; }
 
-	int smbPutFile(const char *lfile, const char *rfile);
+	int smbPutFile(const char *lfile, const char *rfile, uint64_t *hash = NULL, std::vector<uint64_t> *sig = NULL);
+	// sparse `lfile`: write data ranges only, holes are left to the remote file system
+	int smbPutSparse(const char *lfile, const char *rfile, uint64_t *hash = NULL, std::vector<uint64_t> *sig = NULL);
+	// delta upload: write only blocks of `lfile` that differ from `sig` into the old copy `rfile`
+	int smbPatchFile(const char *lfile, const char *rfile, std::vector<uint64_t> &sig, uint64_t *hash = NULL);
+	int loadSig(const char *rfile, std::vector<uint64_t> &sig);
+	int saveSig(const char *rfile, const std::vector<uint64_t> &sig);
+	const char *sigPath(const char *rfile);
+	// chunked mode: put chunks of `lfile` into AR_CHUNKDIR, and a manifest of them as `rfile`
+	int smbPutChunked(const char *lfile, const char *rfile, uint64_t *hash = NULL);
+	// compressed mode: `lfile` compressed into a container as `rfile`
+	int smbPutCompressed(const char *lfile, const char *rfile, uint64_t *hash = NULL);
+	// encrypted mode: `lfile` sealed block by block with a per-file key, see FileCipher
+	int smbPutEncrypted(const char *lfile, const char *rfile, uint64_t *hash = NULL);
+	// download `rfile` into `lfile`, decrypting, decompressing or putting chunks together by its format
+	int smbGetFile(const char *rfile, const char *lfile);
+	// put the chunks of a manifest back together
+	int smbGetChunked(struct smb2fh *rfp, uint64_t size, struct SmbUnpacker &unpack);
+	int putChunk(const std::string &id, const char *data, size_t len, bool &sent);
+	int smbPutBuf(const char *rfile, const char *data, size_t len);
+	int smbWriteAt(struct smb2fh *fh, const char *data, size_t len, uint64_t off);
+	int smbReadAt(struct smb2fh *fh, char *data, size_t len, uint64_t off);
+	// server-side copy with FSCTL_SRV_COPYCHUNK_WRITE
+	int copyFile(const char *src, const char *dst);
+	int smbIoctl(struct smb2fh *fh, uint32_t code, const void *in, uint32_t inlen, std::vector<uint8_t> &out);
 
 private:
 	RemoteSmbData *d;
@@ -3,15 +3,21 @@
 #include <stack>
 #include <algorithm>
 #include <map>
+#include <time.h>
 #include "Aresq.h"
 #include "fsadapter.h"
 #include "utfconv.h"
 #include "resguard.h"
+#include "ContentHash.h"
 #include "pe_log.h"
 
 //#define DRY_RUN	// DO NOT write back changes
 //#define FRESH_DEBUG	// DO NOT load previously saved data
 
+// new files from this size are looked up by contents among uploaded ones. smaller ones are
+// uploaded in about the same time as hashing them
+static const uint64_t COPYMIN = 1024 * 1024;
+
 Root::Root()
 {
 }
@@ -27,6 +33,8 @@ static inline uint64_t getFileSize(FILE *fp)
 
 Root::~Root()
 {
+	if (hashfp)
+		fclose(hashfp);
 #if defined(_DEBUG) && !defined(DRY_RUN)
 	// verify saved data on exit
 	abuf<char> buf;
@@ -50,13 +58,14 @@ Root::~Root()
 #endif
 }
 
-int Root::load(int id, const char *name, const char *root, const char *rec_path, bool keephist, AresqIgnore *aresqignore)
+int Root::load(int id, const char *name, const char *root, const char *rec_path, bool keephist, size_t listmem, AresqIgnore *aresqignore)
 {
 	rootid = id;
 	_name = name;
 	_localroot = root;
 	recpath = rec_path;
 	this->keephist = keephist;
+	this->listmem = listmem;
 	ignore = aresqignore;
 
 	if (CreateDir(recpath.c_str()) != 0)
@@ -96,6 +105,55 @@ int Root::load(int id, const char *name, const char *root, const char *rec_path,
 		goto ERROR_CLEAR;
 	}
 
+	// load content hashes. a missing or short file only leaves some hashes unknown
+	_hashes.assign(_records.size(), 0);
+	if (!(fp = OpenFile(recpath.c_str(), "hash", _NCT("rb"))))
+	{
+		if (!(fp = OpenFile(recpath.c_str(), "hash", _NCT("wb"))))
+			PELOG_LOG((PLV_ERROR, "Create hash file failed, all files will be uploaded on change\n"));
+	}
+	else
+	{
+		fsize = std::min((size_t)getFileSize(fp) / sizeof(_hashes.front()), _hashes.size());
+		if (fread(_hashes.data(), sizeof(_hashes.front()), fsize, fp) != fsize)
+		{
+			PELOG_LOG((PLV_WARNING, "Read hash failed, all files will be uploaded on change\n"));
+			_hashes.assign(_records.size(), 0);
+		}
+	}
+
+	// hard links, same as hashes
+	_links.assign(_records.size(), 0);
+	if (!(fp = OpenFile(recpath.c_str(), "link", _NCT("rb"))))
+	{
+		if (!(fp = OpenFile(recpath.c_str(), "link", _NCT("wb"))))
+			PELOG_LOG((PLV_ERROR, "Create link file failed, hard links will be uploaded on their own\n"));
+	}
+	else
+	{
+		fsize = std::min((size_t)getFileSize(fp) / sizeof(_links.front()), _links.size());
+		if (fread(_links.data(), sizeof(_links.front()), fsize, fp) != fsize)
+		{
+			PELOG_LOG((PLV_WARNING, "Read link failed, hard links will be uploaded on their own\n"));
+			_links.assign(_records.size(), 0);
+		}
+	}
+
+	// SHA-256 of copy sources, those missing are read again from the local files
+	shas.clear();
+	if (!(fp = OpenFile(recpath.c_str(), "sha", _NCT("rb"))))
+	{
+		if (!(fp = OpenFile(recpath.c_str(), "sha", _NCT("wb"))))
+			PELOG_LOG((PLV_ERROR, "Create sha file failed, copy sources will be read each time\n"));
+	}
+	else
+	{
+		Sha256 sha;
+		for (uint32_t rid = 0; rid < _records.size() && fread(sha.data(), sha.size(), 1, fp) == 1; ++rid)
+			if (sha != Sha256())
+				shas[rid] = sha;
+	}
+
 #else
 	init();
 	//_records.clear();
@@ -104,6 +162,18 @@ int Root::load(int id, const char *name, const char *root, const char *rec_path,
 	//_rname.resize(1);
 #endif
 
+	hashidx.clear();
+	for (uint32_t rid = 2; rid < _hashes.size(); ++rid)
+		if (_hashes[rid] != 0 && _records[rid].isactive() && !_records[rid].isdir())
+		{
+			hashidx.insert(std::make_pair(_hashes[rid], rid));
+			copysizes.insert(_records[rid].size24());
+		}
+	linkidx.clear();
+	for (uint32_t rid = 2; rid < _links.size(); ++rid)
+		if (_links[rid] != 0 && _records[rid].isactive() && !_records[rid].isdir())
+			linkidx.insert(std::make_pair(_links[rid], rid));
+
 	// verify data
 	{
 		RootStat stat;
@@ -148,7 +218,19 @@ int Root::init()
 	if (fwrite(_records.data(), sizeof(_records.front()), _records.size(), fp) != _records.size())
 		PELOG_ERROR_RETURN((PLV_ERROR, "Write records failed\n"), -1);
 	fp.release();
+	if (!(fp = OpenFile(recpath.c_str(), "hash", _NCT("wb"))))
+		PELOG_ERROR_RETURN((PLV_ERROR, "Failed to open hash file to write\n"), -1);
+	fp.release();
+	if (!(fp = OpenFile(recpath.c_str(), "link", _NCT("wb"))))
+		PELOG_ERROR_RETURN((PLV_ERROR, "Failed to open link file to write\n"), -1);
+	fp.release();
+	if (!(fp = OpenFile(recpath.c_str(), "sha", _NCT("wb"))))
+		PELOG_ERROR_RETURN((PLV_ERROR, "Failed to open sha file to write\n"), -1);
+	fp.release();
 #endif
+	_hashes.assign(_records.size(), 0);
+	_links.assign(_records.size(), 0);
+	shas.clear();
 
 	return 0;
 }
@@ -233,6 +315,16 @@ int Root::startRefresh()
 	restate.resize(1);
 	restate.back().rid = 1;
 	failstate.clear();
+	// candidates for items moved during the refresh. empty dirs are not worth it, files without a known hash can't be told
+	pendel.clear();
+	moveidx.clear();
+	for (uint32_t rid = 2; rid < _records.size(); ++rid)
+	{
+		const RecordItem &rec = _records[rid];
+		if (rec.isactive() && !rec.isignore() && !rec.ispending() && (rec.isdir() ? rec.sub() != 0 : getHash(rid) != 0))
+			moveidx.push_back(std::make_pair(moveKey(rec.isdir(), rec.time(), rec.size24()), rid));
+	}
+	std::sort(moveidx.begin(), moveidx.end());
 	return 0;
 }
 
@@ -244,20 +336,23 @@ int Root::refreshStep(int state, Action &action)
 	{
 		if (state == Aresq::NOTFOUND && (action.type == Action::ADDFILE || action.type == Action::MODFILE))
 		{
-			PELOG_LOG((PLV_ERROR, "File missing, fallback to parent. %s\n", action.name.buf()));
-			AuVerify(recordFail(action.name.buf()));
+			PELOG_LOG((PLV_ERROR, "File missing, fallback to parent. %s\n", action.name));
+			AuVerify(recordFail(action.name));
 			AuAssert(restate.size() >= 2);
 			restate.pop_back();
 			restate.back().stage = RefreshIter::INIT;
-			restate.back().files.clear();
+			restate.back().files.close();
 		}
 		else
 			return state;
 	}
 
 	action.type = Action::NONE;
+	action.name = action.dst = NULL;
+	action.namelen = action.dstlen = 0;
 	action.isignore = false;
 	action.keephist = false;
+	actpath.reset();
 	// check restate first
 	if (restate.size() == 0)
 		return 0;
@@ -313,16 +408,37 @@ int Root::refreshStep(int state, Action &action)
 			reiter.name.scopyFrom(rec.name(_rname));
 			AuVerify(rec.isdir() && rec.isactive() && (reiter.rid == 1 || *rec.name(_rname)));
 			// build path
-			std::vector<const char *> pathparts;
-			pathparts.push_back(_localroot.c_str());
-			for (size_t i = 1; i < restate.size(); ++i)
-				pathparts.push_back(restate[i].name);
-			buildPath(pathparts.data(), pathparts.size(), reiter.path);
+			if (restate.size() <= 1)
+				reiter.path.scopyFrom(_localroot.c_str());
+			else
+				buildPath(restate[restate.size() - 2].path, reiter.name, reiter.path);
 			// relative path to local root
-			abufchar relpath;
-			buildPath(pathparts.data() + 1, pathparts.size() - 1, relpath);
-			// get dir contents
-			if (ListDir(reiter.path, reiter.files) != 0)
+			const char *relpath = pathAbs2Rel(reiter.path.buf(), _localroot.c_str());
+			size_t rellen = strlen(relpath);
+			// per dir ignore rules of this dir and all its parents
+			reiter.ignrules = ignore->dirRules(rootid, reiter.rid, reiter.path);
+			reiter.ignoff = rellen ? rellen + 1 : 0;
+			ignscopes.clear();
+			for (size_t i = restate.size(); i-- > 0;)
+			{
+				if (restate[i].ignrules)
+				{
+					AresqIgnore::Scope scope = { restate[i].ignrules.get(), restate[i].ignoff };
+					ignscopes.push_back(scope);
+				}
+			}
+			// get dir contents. AresqIgnore is performed on each batch before it is sorted, with rules
+			// reduced to this dir once. skipped if no rule can match anything in this dir
+			reiter.files.setup((recpath + "/listing" + std::to_string(restate.size())).c_str(), listmem);
+			int listres = 0;
+			{
+				AresqIgnore::DirFilter filter(*ignore, relpath, rellen, ignscopes.data(), ignscopes.size());
+				if (!filter.none())
+					reiter.files.onbatch = [&filter](FsList &items) { filter.isignore(items); };
+				listres = ListDir(reiter.path, reiter.files);
+				reiter.files.onbatch = nullptr;
+			}
+			if (listres != 0)
 			{
 				// list dir failed. maybe it has just been deleted
 				if (restate.size() <= 1)
@@ -335,17 +451,6 @@ int Root::refreshStep(int state, Action &action)
 				}
 				break;
 			}
-			// perform AresqIgnore
-			for (std::vector<FsItem>::iterator i = reiter.files.begin(); i != reiter.files.end(); ++i)
-			{
-				abufchar filerelpath;
-				buildPath(relpath, i->name, filerelpath);
-				if (ignore->isignore(filerelpath, i->isdir()))
-				{
-					//PELOG_LOG((PLV_DEBUG, "File ignored: %s : %s\n", _localroot.c_str(), filerelpath.buf()));
-					i->isignore(true);
-				}
-			}
 			reiter.stage = RefreshIter::REMOVE;
 			reiter.prog = 0;
 			break;
@@ -353,9 +458,13 @@ int Root::refreshStep(int state, Action &action)
 
 		case RefreshIter::REMOVE:
 		{
-			// look for next rec file
+			// look for next rec file. physical files are walked along with it, and the position is kept
+			// over steps, since rec files are visited in the same order
 			if (reiter.prog == 0)
+			{
 				reiter.prog = rec.sub();
+				reiter.files.rewind();
+			}
 			else	// already has prog, search for it under rec to ensure it is valid
 			{
 				uint32_t tgtid = rec.sub();
@@ -369,23 +478,32 @@ int Root::refreshStep(int state, Action &action)
 					break;
 				}
 			}
-			size_t fidx = 0;	// current idx in physical files
+			FsStream &files = reiter.files;
 			// for each rec file
 			for (; reiter.prog != 0; reiter.prog = _records[reiter.prog].islast() ? 0 : _records[reiter.prog].next())
 			{
 				RecordItem &fitem = _records[reiter.prog];
 				// look for the matched item in physical files for the rec file
-				while (fidx < reiter.files.size() && pathCmpMt(reiter.files[fidx].name, fitem.name(_rname)) < 0)
-					++fidx;
+				while (!files.end() && pathCmpMt(files.name(), fitem.name(_rname)) < 0)
+					files.next();
+				if (files.fail())	// listing is incomplete, do not take missing files as deleted
+					break;
 				// if not found
-				bool isdel = fidx >= reiter.files.size() || pathCmpMt(reiter.files[fidx].name, fitem.name(_rname)) != 0 ||
-					reiter.files[fidx].isdir() != fitem.isdir();
-				bool ignore = !isdel && reiter.files[fidx].isignore() != fitem.isignore();
+				bool ismiss = files.end() || pathCmpMt(files.name(), fitem.name(_rname)) != 0;
+				bool isdel = ismiss || files.item().isdir() != fitem.isdir();
+				bool ignore = !isdel && files.item().isignore() != fitem.isignore();
+				if (ismiss && !fitem.isignore())
+				{
+					// held back till the end of refresh, in case it is renamed or moved. see findMoved()
+					if (pendel.insert(std::make_pair(reiter.prog, fitem.name())).second)
+						PELOG_LOG((PLV_DEBUG, "DEL item detected %s: %s\n", reiter.path.buf(), fitem.name(_rname)));
+					continue;
+				}
 				if (isdel || ignore)
 				{
 					if (isdel && !fitem.isignore())
 						PELOG_LOG((PLV_DEBUG, "DEL item detected %s: %s\n", reiter.path.buf(), fitem.name(_rname)));
-					else if (!isdel && reiter.files[fidx].isignore())
+					else if (!isdel && files.item().isignore())
 						PELOG_LOG((PLV_DEBUG, "IGNORE del item detected %s: %s\n", reiter.path.buf(), fitem.name(_rname)));
 					// move forward before return, since prog is likely to be deleted
 					if (!fitem.islast())
@@ -399,12 +517,19 @@ int Root::refreshStep(int state, Action &action)
 						reiter.prog = 0;
 					}
 					action.type = fitem.isdir() ? Action::DELDIR : Action::DELFILE;
-					buildPath(pathAbs2Rel(reiter.path.buf(), _localroot.c_str()), fitem.name(_rname), action.name);
-					action.isignore = !isdel && reiter.files[fidx].isignore();
+					setActionName(action, reiter, fitem.name(_rname));
+					action.isignore = !isdel && files.item().isignore();
 					action.keephist = keephist && !action.isignore && !fitem.isignore();
 					return 1;
 				}
 			}
+			if (files.fail())
+			{
+				PELOG_LOG((PLV_WARNING, "Dir listing broken, REDO. %s\n", reiter.path.buf()));
+				AuVerify(recordFail(reiter.path.buf()));
+				reiter.stage = RefreshIter::INIT;
+				break;
+			}
 			// no more DELFILE if reach here, move on to next stage
 			reiter.stage = RefreshIter::NEW;
 			reiter.prog = 0;
@@ -413,37 +538,73 @@ int Root::refreshStep(int state, Action &action)
 
 		case RefreshIter::NEW:
 		{
+			FsStream &files = reiter.files;
+			if (reiter.prog == 0)
+				files.rewind();
 			uint32_t fid = rec.sub();
-			for (; reiter.prog < reiter.files.size(); ++reiter.prog)	// for each physical file
+			for (; !files.end(); files.next(), ++reiter.prog)	// for each physical file
 			{
-				for (; fid != 0 && pathCmpMt(_records[fid].name(_rname), reiter.files[reiter.prog].name) < 0;
+				const FsItem &file = files.item();
+				for (; fid != 0 && pathCmpMt(_records[fid].name(_rname), files.name()) < 0;
 					fid = _records[fid].islast() ? 0 : _records[fid].next())
 					;
-				bool found = fid != 0 && pathCmpMt(_records[fid].name(_rname), reiter.files[reiter.prog].name) == 0;
+				bool found = fid != 0 && pathCmpMt(_records[fid].name(_rname), files.name()) == 0;
 				if (found)
-					AuVerify(_records[fid].isdir() == reiter.files[reiter.prog].isdir());
+					AuVerify(_records[fid].isdir() == file.isdir());
 				if (found && !_records[fid].isdir() && !_records[fid].isignore() && (
-					_records[fid].sizeChanged(reiter.files[reiter.prog].size) ||
-					abs((int64_t)_records[fid].time() - (int64_t)reiter.files[reiter.prog].time) > 10))
+					_records[fid].sizeChanged(file.size) ||
+					abs((int64_t)_records[fid].time() - (int64_t)file.time) > 10))
 				{
-					PELOG_LOG((PLV_DEBUG, "MOD item detected %s: %s\n", reiter.path.buf(), reiter.files[reiter.prog].name));
+					PELOG_LOG((PLV_DEBUG, "MOD item detected %s: %s\n", reiter.path.buf(), files.name()));
 					action.type = Action::MODFILE;
-					buildPath(pathAbs2Rel(reiter.path.buf(), _localroot.c_str()), reiter.files[reiter.prog].name, action.name);
+					setActionName(action, reiter, files.name());
 					action.keephist = keephist;
-					reiter.prog++;	// move forward before return
+					if (deferSettle(action, file.time))
+						continue;
+					files.next();	// move forward before return
+					reiter.prog++;
 					return 1;
 				}
 				else if (!found)
 				{
+					uint32_t mid = findMoved(reiter, file, files.name());
+					if (mid != 0)
+					{
+						abufchar src;
+						recPath(mid, src);
+						PELOG_LOG((PLV_DEBUG, "RENAME item detected %s -> %s: %s\n", src.buf(), reiter.path.buf(), files.name()));
+						size_t srcoff = actpath.put("", 0, src, strlen(src));
+						setActionName(action, reiter, files.name());
+						action.type = Action::RENAME;
+						action.dst = action.name;
+						action.dstlen = action.namelen;
+						action.name = actpath.get(srcoff);
+						action.namelen = strlen(src);
+						pendel.erase(mid);
+						files.next();	// move forward before return
+						reiter.prog++;
+						return 1;
+					}
 					PELOG_LOG((PLV_DEBUG, "%s item detected %s: %s\n",
-						reiter.files[reiter.prog].isignore() ? "IGNORE" : "ADD", reiter.path.buf(), reiter.files[reiter.prog].name));
-					action.type = reiter.files[reiter.prog].isdir() ? Action::ADDDIR : Action::ADDFILE;
-					buildPath(pathAbs2Rel(reiter.path.buf(), _localroot.c_str()), reiter.files[reiter.prog].name, action.name);
-					action.isignore = reiter.files[reiter.prog].isignore();
-					reiter.prog++;	// move forward before return
+						file.isignore() ? "IGNORE" : "ADD", reiter.path.buf(), files.name()));
+					action.type = file.isdir() ? Action::ADDDIR : Action::ADDFILE;
+					setActionName(action, reiter, files.name());
+					action.isignore = file.isignore();
+					if (!file.isdir() && !file.isignore() && deferSettle(action, file.time))
+						continue;
+					files.next();	// move forward before return
+					reiter.prog++;
 					return 1;
 				}
 			}
+			if (files.fail())
+			{
+				PELOG_LOG((PLV_WARNING, "Dir listing broken, REDO. %s\n", reiter.path.buf()));
+				AuVerify(recordFail(reiter.path.buf()));
+				reiter.stage = RefreshIter::INIT;
+				break;
+			}
+			files.close();	// not needed any more, release before going into sub dirs
 			reiter.stage = RefreshIter::RECUR;
 			reiter.prog = 0;
 			break;
@@ -452,9 +613,11 @@ int Root::refreshStep(int state, Action &action)
 		case RefreshIter::RECUR:
 			if (reiter.prog == 0)
 				reiter.prog = rec.sub();
-			while (reiter.prog != 0 && (!_records[reiter.prog].isdir() || _records[reiter.prog].isignore()))
+			// skip dirs held back as deleted
+			while (reiter.prog != 0 && (!_records[reiter.prog].isdir() || _records[reiter.prog].isignore() ||
+					pendel.count(reiter.prog)))
 				reiter.prog = _records[reiter.prog].islast() ? 0 : _records[reiter.prog].next();
-			if (reiter.prog != 0 && _records[reiter.prog].isdir() && !_records[reiter.prog].isignore())
+			if (reiter.prog != 0)
 			{
 				uint32_t recurid = reiter.prog;
 				AuVerify(*getName(recurid));
@@ -475,13 +638,29 @@ int Root::refreshStep(int state, Action &action)
 			{
 				restate.pop_back();
 				restate.back().stage = RefreshIter::INIT;
-				restate.back().files.clear();
+				restate.back().files.close();
 			}
 			break;
 
 		case RefreshIter::RETURN:	// finished current dir, go back to parent
 			if (restate.size() <= 1)
 			{
+				// deletions held back are real ones if not picked up by renames
+				while (!pendel.empty())
+				{
+					uint32_t rid = pendel.begin()->first;
+					uint32_t nameoff = pendel.begin()->second;
+					pendel.erase(pendel.begin());
+					if (!_records[rid].isactive() || _records[rid].name() != nameoff)	// gone with its parent
+						continue;
+					abufchar path;
+					recPath(rid, path);
+					action.type = _records[rid].isdir() ? Action::DELDIR : Action::DELFILE;
+					action.name = actpath.get(actpath.put("", 0, path, strlen(path)));
+					action.namelen = strlen(path);
+					action.keephist = keephist;
+					return 1;
+				}
 				restate.clear();
 				return 0;
 			}
@@ -497,6 +676,137 @@ int Root::refreshStep(int state, Action &action)
 	return 0;
 }
 
+// action.name = <relative path of reiter>/name
+void Root::setActionName(Action &action, const RefreshIter &reiter, const char *name)
+{
+	const char *reldir = pathAbs2Rel(reiter.path.buf(), _localroot.c_str());
+	size_t dlen = strlen(reldir);
+	size_t nlen = strlen(name);
+	action.name = actpath.get(actpath.put(reldir, dlen, name, nlen));
+	action.namelen = (dlen != 0 ? dlen + 1 : 0) + nlen;
+}
+
+// a file modified within the settle window is likely still being written, and would be uploaded
+// again and again, maybe half-written. queue it for settleStep() instead of returning the action
+bool Root::deferSettle(Action &action, uint32_t ftime)
+{
+	std::string path(action.name, action.namelen);
+	int64_t age = (int64_t)time(NULL) - ftime;
+	if (settle == 0 || age < 0 || age >= settle)	// modified in future: clock skew, waiting would not help
+	{
+		settleq.erase(path);
+		return false;
+	}
+	settleq[path] = action.keephist;
+	PELOG_LOG((PLV_VERBOSE, "FILE settling, %d seconds old: %s\n", (int)age, path.c_str()));
+	action.type = Action::NONE;
+	action.name = NULL;
+	action.namelen = 0;
+	action.keephist = false;
+	return true;
+}
+
+int Root::settleStep(Action &action, uint32_t &wait)
+{
+	action.type = Action::NONE;
+	action.name = action.dst = NULL;
+	action.namelen = action.dstlen = 0;
+	action.isignore = false;
+	action.keephist = false;
+	actpath.reset();
+	wait = 0;
+	int64_t now = time(NULL);
+	for (auto it = settleq.begin(); it != settleq.end();)
+	{
+		uint64_t ftime = 0, fsize = 0;
+		if (getFileAttr(_localroot.c_str(), it->first.c_str(), it->first.length(), ftime, fsize) != 0)
+		{
+			// gone, the next refresh takes care of it
+			PELOG_LOG((PLV_VERBOSE, "FILE settling dropped, not found: %s\n", it->first.c_str()));
+			it = settleq.erase(it);
+			continue;
+		}
+		int64_t age = now - (int64_t)(uint32_t)ftime;
+		if (age < 0 || age >= settle)
+		{
+			FindResult found = FR_NONE;
+			uint32_t pid = 0;
+			findRecordRoot(it->first.c_str(), it->first.length(), found, pid);
+			action.type = found == FR_MATCH ? Action::MODFILE : Action::ADDFILE;
+			action.name = actpath.get(actpath.put("", 0, it->first.c_str(), it->first.length()));
+			action.namelen = it->first.length();
+			action.keephist = it->second;
+			settleq.erase(it);
+			return 1;
+		}
+		if (wait == 0 || settle - age < wait)
+			wait = (uint32_t)(settle - age);
+		++it;
+	}
+	return 0;
+}
+
+// look for the record of a new item `name` under reiter, if it is renamed or moved from somewhere else.
+// a file matches by size, modified time and contents, so one with no hash known is never taken as moved.
+// a dir by creation time, which is kept on rename, and names of all its entries. return 0 if not found
+uint32_t Root::findMoved(const RefreshIter &reiter, const FsItem &file, const char *name)
+{
+	if (file.isignore() || (!file.isdir() && file.size == 0))	// nothing to save for empty files
+		return 0;
+	abufchar lpath;
+	buildPath(reiter.path, name, lpath);
+	uint64_t key = moveKey(file.isdir(), file.time, (uint32_t)(file.size & 0xffffff));
+	uint64_t hash = 0;
+	abufchar rpath;
+	auto it = std::lower_bound(moveidx.begin(), moveidx.end(), std::make_pair(key, (uint32_t)0));
+	for (; it != moveidx.end() && it->first == key; ++it)
+	{
+		uint32_t rid = it->second;
+		const RecordItem &rec = _records[rid];
+		// records may have changed since the index was built
+		if (!rec.isactive() || rec.isdir() != file.isdir() || rec.isignore() || rec.ispending() || !*getName(rid) ||
+				moveKey(rec.isdir(), rec.time(), rec.size24()) != key)
+			continue;
+		// not detected as deleted yet. it is moved only if missing from where it was
+		if (pendel.find(rid) == pendel.end())
+		{
+			uint64_t ftime = 0, fsize = 0;
+			if (recPath(rid, rpath) != 0 || getFileAttr(_localroot.c_str(), rpath, strlen(rpath), ftime, fsize) == 0)
+				continue;
+		}
+		if (file.isdir() && !sameChildren(rid, lpath))
+			continue;
+		// same size and time is not enough to tell a file unchanged, deleted and added instead
+		if (!file.isdir())
+		{
+			if (getHash(rid) == 0)
+				continue;
+			if (hash == 0 && ContentHash::file(lpath, hash) != 0)
+				return 0;
+			if (hash != getHash(rid))
+				continue;
+		}
+		return rid;
+	}
+	return 0;
+}
+
+// whether local `dir` has the same entries as dir record `did`, only names and types are compared
+bool Root::sameChildren(uint32_t did, const abufchar &dir)
+{
+	FsStream files;
+	files.setup((recpath + "/listingmv").c_str(), listmem);
+	if (ListDir(dir, files) != 0)
+		return false;
+	uint32_t cid = _records[did].sub();
+	for (; !files.end() && cid != 0; files.next(), cid = _records[cid].islast() ? 0 : _records[cid].next())
+	{
+		if (pathCmpMt(files.name(), getName(cid)) != 0 || files.item().isdir() != _records[cid].isdir())
+			return false;
+	}
+	return files.end() && !files.fail() && cid == 0;
+}
+
 // did: output the target directory record id
 int Root::addDir(const char *dir, size_t dlen, bool isignore, uint32_t &did, Remote *remote)
 {
@@ -522,7 +832,7 @@ int Root::addDir(const char *dir, size_t dlen, bool isignore, uint32_t &did, Rem
 	AuVerify((dtype == FR_PRE || dtype == FR_PARENT) && did != 0);
 	uint32_t preid = did;
 	// local not found. add remote first
-	if (!isignore && (res = remote->addDir(_name.c_str(), std::string(dir, dlen).c_str())) != Aresq::OK)
+	if (!isignore && (res = remote->addDir(_name.c_str(), dir, dlen)) != Aresq::OK)
 	{
 		if (res != Aresq::DISCONNECTED)
 			PELOG_ERROR_RETURN((PLV_ERROR, "Create dir failed. remote error %d. %.*s\n", res, dlen, dir), Aresq::REMOTEERR);
@@ -590,14 +900,115 @@ int Root::addFile(const char *file, size_t flen, bool isignore, bool keephist, u
 		return Aresq::OK;
 	bool isnew = !(dtype == FR_MATCH && fid != 0 && !_records[fid].isdir());
 	AuVerify(fid != 0);
+	// same contents as last uploaded, e.g. only touched. update the attributes without uploading.
+	// different size tells the contents have changed without reading it
+	uint64_t lhash = 0;	// contents of the local file, 0 if not read
+	if (!isignore && !isnew && getHash(fid) != 0 && !_records[fid].sizeChanged(fsize))
+	{
+		abufchar lpath;
+		buildPath(_localroot.c_str(), _localroot.length(), file, flen, lpath);
+		if (ContentHash::file(lpath, lhash) == 0 && lhash == getHash(fid))
+		{
+			std::vector<uint32_t> cids(1, fid);
+			_records[fid].ispending(false);
+			_records[fid].time((uint32_t)ftime);
+			_records[fid].size24(fsize);
+			writeRec(cids);
+			PELOG_LOG((PLV_INFO, "FILE TOUCHed(%u) %s : %.*s\n", fid, _localroot.c_str(), flen, file));
+			return Aresq::OK;
+		}
+	}
 	AuVerify(dtype == FR_MATCH || dtype == FR_PRE || dtype == FR_PARENT);
-	uint32_t preid = dtype != FR_MATCH ? fid : 0;
 	fid = dtype == FR_MATCH ? fid : 0;
 	// hist
 	if (keephist)
-		remote->putHist(_name.c_str(), std::string(file, flen).c_str());
+		remote->putHist(_name.c_str(), file, flen);
+	// another hard link of a file already uploaded. have the remote copy it without even reading it
+	uint64_t hash = 0;
+	bool copied = false;
+	Sha256 lsha = Sha256();	// of a file copied by contents
+	uint64_t fileid = 0;
+	uint32_t nlink = 0;
+	if (!isignore && getFileId(_localroot.c_str(), file, flen, fileid, nlink) == 0 && nlink > 1)
+	{
+		// another link may be in flight
+		bool inflight = false;
+		for (size_t i = 0; !inflight && i < uploads.size(); ++i)
+			inflight = uploads[i].fileid == fileid;
+		if (inflight && (res = collectFiles(remote, true)) != Aresq::OK)
+			return res;
+		abufchar spath;
+		uint32_t sid = findLink(fileid, ftime, fsize, fid);
+		if (sid != 0 && recPath(sid, spath) == 0)
+		{
+			res = remote->copy(_name.c_str(), spath, strlen(spath), _name.c_str(), file, flen);
+			if (res == Aresq::DISCONNECTED)
+				PELOG_ERROR_RETURN((PLV_TRACE, "Remote disconnected.\n"), Aresq::DISCONNECTED);
+			copied = res == Aresq::OK;
+			if (copied)
+			{
+				hash = getHash(sid);
+				PELOG_LOG((PLV_VERBOSE, "FILE link of %s. %.*s\n", spath.buf(), flen, file));
+			}
+		}
+	}
+	// same contents already on remote, e.g. a copy of another file in this or another backup.
+	// have the remote copy it by itself. the file is read only if one of the same size was hashed,
+	// or already read above
+	if (!isignore && !copied && fsize >= COPYMIN && (lhash != 0 || copySize(fsize)))
+	{
+		abufchar lpath, spath;
+		buildPath(_localroot.c_str(), _localroot.length(), file, flen, lpath);
+		if (lhash == 0 && ContentHash::file(lpath, lhash) != 0)
+			lhash = 0;
+		// a file still in flight keeps the hash of its old contents until it is done.
+		// other backups have none in flight, their uploads are collected at the end of their refresh
+		if (lhash != 0 && hashidx.count(lhash) > 0 && (res = collectFiles(remote, true)) != Aresq::OK)
+			return res;
+		Root *src = this;
+		uint32_t sid = lhash == 0 ? 0 : findCopy(lhash, fsize, fid);
+		for (size_t i = 0; lhash != 0 && sid == 0 && i < peers.size(); ++i)
+			if ((sid = peers[i]->findCopy(lhash, fsize, 0)) != 0)
+				src = peers[i];
+		// the hash is not collision resistant, the copy is made only if SHA-256 agrees too
+		Sha256 ssha;
+		uint64_t shash = 0;
+		if (sid != 0 && (src->copySha(sid, ssha) != 0 ||
+				ContentHash::file(lpath, shash, lsha.data()) != 0 || shash != lhash || lsha != ssha))
+		{
+			PELOG_LOG((PLV_VERBOSE, "FILE hash of %s(%u) matched, contents not the same. %.*s\n", src->_name.c_str(), sid, flen, file));
+			sid = 0;
+		}
+		if (sid != 0 && src->recPath(sid, spath) == 0)
+		{
+			res = remote->copy(src->_name.c_str(), spath, strlen(spath), _name.c_str(), file, flen);
+			if (res == Aresq::DISCONNECTED)
+				PELOG_ERROR_RETURN((PLV_TRACE, "Remote disconnected.\n"), Aresq::DISCONNECTED);
+			copied = res == Aresq::OK;
+			if (copied)
+			{
+				hash = lhash;
+				PELOG_LOG((PLV_VERBOSE, "FILE copy of %s/%s. %.*s\n", src->_name.c_str(), spath.buf(), flen, file));
+			}
+		}
+	}
+	// or have the remote send it along with other files, and record it when done
+	if (!isignore && !copied && (res = remote->queueFile(_localroot.c_str(), _name.c_str(), file, flen)) != Aresq::NOTIMPLEMENTED)
+	{
+		if (res != Aresq::OK)
+			PELOG_ERROR_RETURN((PLV_ERROR, "addFile failed. queue error %d. %.*s\n", res, flen, file), Aresq::REMOTEERR);
+		FileUpload up;
+		up.path.assign(file, flen);
+		up.ftime = ftime;
+		up.fsize = fsize;
+		up.fileid = fileid;
+		up.nlink = nlink;
+		uploads.push_back(up);
+		fid = 0;
+		return collectFiles(remote, false);
+	}
 	// add remote first
-	if (!isignore && (res = remote->addFile(_localroot.c_str(), _name.c_str(), std::string(file, flen).c_str())) != Aresq::OK)
+	if (!isignore && !copied && (res = remote->addFile(_localroot.c_str(), _name.c_str(), file, flen, &hash)) != Aresq::OK)
 	{
 		if (res == Aresq::NOTFOUND)
 			PELOG_ERROR_RETURN((PLV_ERROR, "addFile failed. file missing %d. %.*s\n", res, flen, file), Aresq::NOTFOUND);
@@ -613,6 +1024,33 @@ int Root::addFile(const char *file, size_t flen, bool isignore, bool keephist, u
 			PELOG_ERROR_RETURN((PLV_TRACE, "Remote disconnected.\n"), Aresq::DISCONNECTED);
 	}
 	// add local
+	FileUpload up;
+	up.ftime = ftime;
+	up.fsize = fsize;
+	up.hash = hash;
+	up.fileid = fileid;
+	up.nlink = nlink;
+	up.isignore = isignore;
+	up.pendingfail = pendingfail;
+	up.copied = copied;
+	up.sha = lsha;
+	return recordFile(pid, file, flen, up, fid);
+}
+
+// record file `file` under `pid` as uploaded
+int Root::recordFile(uint32_t pid, const char *file, size_t flen, const FileUpload &up, uint32_t &fid)
+{
+	size_t baselen = splitPath(file, flen);
+	const char *filename = baselen == 0 ? file : file + baselen + 1;
+	size_t nlen = flen - (filename - file);
+	FindResult dtype = FR_MATCH;
+	fid = findRecord(pid, filename, nlen, dtype);
+	AuVerify(fid != 0 && (dtype == FR_MATCH || dtype == FR_PRE || dtype == FR_PARENT));
+	if (dtype == FR_MATCH && _records[fid].isdir())
+		PELOG_ERROR_RETURN((PLV_ERROR, "addFile failed. dir exists. %.*s\n", flen, file), Aresq::CONFLICT);
+	bool isnew = dtype != FR_MATCH;
+	uint32_t preid = isnew ? fid : 0;
+	fid = isnew ? 0 : fid;
 	std::vector<uint32_t> cids;	// changed ids
 	if (fid == 0)
 	{
@@ -632,25 +1070,73 @@ int Root::addFile(const char *file, size_t flen, bool isignore, bool keephist, u
 			_records[preid].next(fid);
 		}
 		_records[fid].name(allocRName(filename, nlen));
-		_records[fid].isignore(isignore);
+		_records[fid].isignore(up.isignore);
 		cids.push_back(preid);
 	}
 	cids.push_back(fid);
 	RecordItem &fitem = _records[fid];
 	fitem.isdir(false);
-	fitem.ispending(pendingfail);
-	if (!pendingfail)	// update time and size only if not pending_fail
+	fitem.ispending(up.pendingfail);
+	if (!up.pendingfail)	// update time and size only if not pending_fail
 	{
-		fitem.time((uint32_t)ftime);
-		fitem.size24(fsize);
+		fitem.time((uint32_t)up.ftime);
+		fitem.size24(up.fsize);
 	}
 	AuAssert(verifydir(pid));
 	writeRec(cids);
+	setHash(fid, up.pendingfail ? 0 : up.hash);
+	setLink(fid, up.pendingfail || up.nlink < 2 ? 0 : up.fileid);
+	if (!up.pendingfail && up.sha != Sha256())
+		setSha(fid, up.sha);
 	PELOG_LOG((PLV_INFO, "FILE %s(%u) %s : %.*s\n",
-		isignore ? "IGNOREd" : (isnew ? "ADDed" : "MODed"), fid, _localroot.c_str(), flen, file));
+		up.isignore ? "IGNOREd" : up.copied ? "COPIed" : (isnew ? "ADDed" : "MODed"), fid, _localroot.c_str(), flen, file));
 	return Aresq::OK;
 }
 
+// record files queued on remote and completed, in the order queued. `all`: wait for all of them
+int Root::collectFiles(Remote *remote, bool all)
+{
+	if (uploads.empty())
+		return Aresq::OK;
+	std::vector<Remote::FileDone> done;
+	int ret = remote->doneFiles(done, all);
+	for (const Remote::FileDone &fd : done)
+	{
+		AuVerify(!uploads.empty() && uploads.front().path == fd.path);
+		FileUpload up = uploads.front();
+		uploads.pop_front();
+		const char *file = up.path.c_str();
+		size_t flen = up.path.length();
+		if (fd.res == Aresq::FILELOCKED)
+		{
+			up.pendingfail = true;
+			PELOG_LOG((PLV_ERROR, "addFile failed. file locked %d. %s\n", fd.res, file));
+		}
+		else if (fd.res != Aresq::OK)
+		{
+			// not recorded, the next refresh tries again
+			PELOG_LOG((PLV_ERROR, "addFile failed. queued %d. %s\n", fd.res, file));
+			if (ret == Aresq::OK && fd.res != Aresq::NOTFOUND)
+				ret = fd.res == Aresq::DISCONNECTED ? Aresq::DISCONNECTED : Aresq::REMOTEERR;
+			continue;
+		}
+		up.hash = fd.hash;
+		// parents were added when it was queued, and are not removed while it is in flight
+		uint32_t pid = 1, ppid = 0, fid = 0;
+		size_t baselen = splitPath(file, flen);
+		FindResult ptype = FR_MATCH;
+		if (baselen > 0 && ((pid = findRecordRoot(file, baselen, ptype, ppid)) == 0 || ptype != FR_MATCH || !_records[pid].isdir()))
+		{
+			PELOG_LOG((PLV_ERROR, "addFile failed. parent gone. %s\n", file));
+			continue;
+		}
+		int res = recordFile(pid, file, flen, up, fid);
+		if (res != Aresq::OK && ret == Aresq::OK)
+			ret = res;
+	}
+	return ret;
+}
+
 int Root::delDir(const char *dir, size_t dlen, bool isignore, bool keephist, bool noremote, Remote *remote)
 {
 	// find parent id
@@ -670,7 +1156,7 @@ int Root::delDir(uint32_t rid, uint32_t pid, const char *dir, size_t dlen, bool
 	int res = Aresq::OK;
 
 	// hist
-	if (keephist && (res = remote->putHist(_name.c_str(), std::string(dir, dlen).c_str())) != Aresq::OK)
+	if (keephist && (res = remote->putHist(_name.c_str(), dir, dlen)) != Aresq::OK)
 	{
 		if (res != Aresq::DISCONNECTED)
 			PELOG_ERROR_RETURN((PLV_ERROR, "Del hist file failed. remote error %d. %.*s\n", res, dlen, dir), Aresq::REMOTEERR);
@@ -680,11 +1166,11 @@ int Root::delDir(uint32_t rid, uint32_t pid, const char *dir, size_t dlen, bool
 	noremote = noremote || keephist;
 
 	// delete sub records
+	abuf<char> subname;
 	while (_records[rid].sub())
 	{
 		uint32_t sid = _records[rid].sub();
 		RecordItem &sub = _records[sid];
-		abuf<char> subname;
 		if (*getName(sid))
 			buildPath(dir, dlen, getName(sid), strlen(getName(sid)), subname);
 		if (!sub.isdir())	// a regular file
@@ -703,7 +1189,7 @@ int Root::delDir(uint32_t rid, uint32_t pid, const char *dir, size_t dlen, bool
 
 	// must be an empty dir if reaches here
 	// delete remote
-	if (!noremote && !_records[rid].isignore() && (res = remote->delDir(_name.c_str(), std::string(dir, dlen).c_str())) != Aresq::OK)
+	if (!noremote && !_records[rid].isignore() && (res = remote->delDir(_name.c_str(), dir, dlen)) != Aresq::OK)
 	{
 		if (res != Aresq::DISCONNECTED)
 			PELOG_ERROR_RETURN((PLV_ERROR, "Del file failed. remote error %d. %.*s\n", res, dlen, dir), Aresq::REMOTEERR);
@@ -754,8 +1240,8 @@ int Root::delFile(uint32_t rid, uint32_t pid, const char *filename, size_t flen,
 	std::vector<uint32_t> cids;	// changed ids
 	int res = 0;
 	// del remote
-	if (keephist && (res = remote->putHist(_name.c_str(), std::string(filename, flen).c_str())) != Aresq::OK ||
-		!noremote && !_records[rid].isignore() && (res = remote->delFile(_name.c_str(), std::string(filename, flen).c_str())) != Aresq::OK)
+	if (keephist && (res = remote->putHist(_name.c_str(), filename, flen)) != Aresq::OK ||
+		!noremote && !_records[rid].isignore() && (res = remote->delFile(_name.c_str(), filename, flen)) != Aresq::OK)
 	{
 		if (res != Aresq::DISCONNECTED)
 			PELOG_ERROR_RETURN((PLV_ERROR, "Del file failed. remote error %d. %.*s\n", res, flen, filename), Aresq::REMOTEERR);
@@ -788,6 +1274,98 @@ int Root::delFile(uint32_t rid, uint32_t pid, const char *filename, size_t flen,
 	return Aresq::OK;
 }
 
+// move record `src` with all its contents to `dst`. the dir records of the contents stay as they are
+int Root::renameRec(const char *src, size_t slen, const char *dst, size_t dlen, Remote *remote)
+{
+	int res = Aresq::OK;
+	// find src
+	FindResult foundtype = FR_MATCH;
+	uint32_t pid = 0;
+	uint32_t rid = findRecordRoot(src, slen, foundtype, pid);
+	if (rid == 0 || pid == 0 || foundtype != FR_MATCH || _records[rid].isignore())
+		PELOG_ERROR_RETURN((PLV_ERROR, "rename src not found %s : %.*s\n", _localroot.c_str(), slen, src), Aresq::NOTFOUND);
+	// process dst parents
+	size_t baselen = splitPath(dst, dlen);
+	uint32_t npid = 1;
+	if (baselen > 0 && (res = addDir(dst, baselen, false, npid, remote)) != Aresq::OK)
+		return res;
+	const char *dstname = baselen == 0 ? dst : dst + baselen + 1;
+	size_t nlen = dlen - (dstname - dst);
+	FindResult dtype = FR_MATCH;
+	findRecord(npid, dstname, nlen, dtype);
+	if (dtype == FR_MATCH)
+		PELOG_ERROR_RETURN((PLV_ERROR, "rename dst exists %s : %.*s\n", _localroot.c_str(), dlen, dst), Aresq::CONFLICT);
+	for (uint32_t id = npid; id > 1; id = parentRec(id))
+	{
+		if (id == rid)
+			PELOG_ERROR_RETURN((PLV_ERROR, "rename into itself %s : %.*s\n", _localroot.c_str(), dlen, dst), Aresq::CONFLICT);
+	}
+	// remote first
+	if ((res = remote->rename(_name.c_str(), src, slen, dst, dlen)) != Aresq::OK)
+	{
+		if (res == Aresq::NOTFOUND)
+			PELOG_ERROR_RETURN((PLV_ERROR, "rename failed. remote src missing. %.*s\n", slen, src), Aresq::NOTFOUND);
+		else if (res != Aresq::DISCONNECTED)
+			PELOG_ERROR_RETURN((PLV_ERROR, "rename failed. remote error %d. %.*s\n", res, slen, src), Aresq::REMOTEERR);
+		else
+			PELOG_ERROR_RETURN((PLV_TRACE, "Remote disconnected.\n"), Aresq::DISCONNECTED);
+	}
+	// refresh may be waiting to recurse into it from the old parent
+	for (RefreshIter &reiter : restate)
+	{
+		if (reiter.stage == RefreshIter::RECUR && reiter.prog == rid)
+		{
+			reiter.prog = _records[rid].islast() ? 0 : _records[rid].next();
+			if (reiter.prog == 0)
+				reiter.stage = RefreshIter::RETURN;
+		}
+	}
+	// detach from old parent
+	std::vector<uint32_t> cids;	// changed ids
+	RecPtr preptr(this);
+	for (preptr.set(pid, RPSUB); preptr() != rid && preptr() != pid && preptr() != 0; preptr.set(preptr(), RPNEXT))
+		;	// look for pre
+	AuVerify(preptr() == rid);
+	cids.push_back(rid);
+	cids.push_back(preptr._id);
+	if (preptr._type == RPSUB)
+	{
+		preptr(_records[rid].islast() ? 0 : _records[rid].next());
+	}
+	else
+	{
+		preptr(_records[rid].next());
+		_records[preptr._id].islast(_records[rid].islast());
+	}
+	AuAssert(verifydir(pid));
+	// new name
+	AuVerify(eraseName(rid) == 0);
+	_records[rid].name(allocRName(dstname, nlen));
+	// insert into new parent
+	uint32_t preid = findRecord(npid, dstname, nlen, dtype);
+	AuVerify((dtype == FR_PRE || dtype == FR_PARENT) && preid != 0);
+	cids.push_back(preid);
+	RecordItem &item = _records[rid];
+	if (preid == npid)
+	{
+		item.next(_records[npid].sub() == 0 ? npid : _records[npid].sub());
+		item.islast(_records[npid].sub() == 0);
+		_records[npid].sub(rid);
+	}
+	else
+	{
+		item.next(_records[preid].next());
+		item.islast(_records[preid].islast());
+		_records[preid].islast(false);
+		_records[preid].next(rid);
+	}
+	AuAssert(verifydir(npid));
+	writeRec(cids);
+	PELOG_LOG((PLV_INFO, "%s RENAMEd(%u) %s : %.*s -> %.*s\n", item.isdir() ? "DIR" : "FILE",
+		rid, _localroot.c_str(), slen, src, dlen, dst));
+	return Aresq::OK;
+}
+
 // look for the specific name under pid, return rid if found, otherwise pre or parent id
 uint32_t Root::findRecord(uint32_t pid, const char *name, size_t namelen, FindResult &restype)
 {
@@ -828,6 +1406,23 @@ uint32_t Root::findRecordRoot(const char *name, size_t namelen, FindResult &rest
 	return findRecord(pid, name + baselen + 1, namelen - baselen - 1, restype);
 }
 
+uint32_t Root::parentRec(uint32_t rid) const
+{
+	while (!_records[rid].islast())
+		rid = _records[rid].next();
+	return _records[rid].next();
+}
+
+// path of a record relative to local root
+int Root::recPath(uint32_t rid, abufchar &path) const
+{
+	std::vector<const char *> parts;
+	for (; rid > 1; rid = parentRec(rid))
+		parts.push_back(getName(rid));
+	std::reverse(parts.begin(), parts.end());
+	return buildPath(parts.data(), parts.size(), path);
+}
+
 // alloc string in _rname, and write to disk
 uint32_t Root::allocRName(const char *name, uint32_t len)
 {
@@ -899,6 +1494,8 @@ int Root::recycleRec(uint32_t rid, std::vector<uint32_t> &cids)
 	uint32_t preid = 0;
 	for (preid = 0; _records[preid].next() != 0 && _records[preid].next() < rid; preid = _records[preid].next())
 		;
+	setHash(rid, 0);
+	setLink(rid, 0);
 	// insert
 	_records[rid].name((uint32_t)0);
 	_records[rid].isdir(true);
@@ -909,6 +1506,153 @@ int Root::recycleRec(uint32_t rid, std::vector<uint32_t> &cids)
 	return 0;
 }
 
+// content hash of a record, write to disk if changed
+int Root::setHash(uint32_t rid, uint64_t hash)
+{
+	if (getHash(rid) == hash)
+		return 0;
+	if (_hashes.size() <= rid)
+		_hashes.resize(_records.size(), 0);
+	if (_hashes[rid] != 0)
+	{
+		auto range = hashidx.equal_range(_hashes[rid]);
+		for (auto it = range.first; it != range.second; ++it)
+			if (it->second == rid)
+			{
+				hashidx.erase(it);
+				break;
+			}
+	}
+	_hashes[rid] = hash;
+	if (shas.count(rid) > 0)	// of the old contents
+		setSha(rid, Sha256());
+	if (hash != 0)
+	{
+		hashidx.insert(std::make_pair(hash, rid));
+		copysizes.insert(_records[rid].size24());
+	}
+#ifndef DRY_RUN
+	if (!hashfp && !(hashfp = OpenFile(recpath.c_str(), "hash", _NCT("rb+"))))
+		PELOG_ERROR_RETURN((PLV_ERROR, "Failed to open hash file to write\n"), -1);
+	// writing beyond the end fills the gap with 0, unknown hashes.
+	// flushed each time, so a hash is never older than the record written just before it
+	if (fseek(hashfp, sizeof(_hashes[0]) * rid, SEEK_SET) != 0 || fwrite(&_hashes[rid], sizeof(_hashes[rid]), 1, hashfp) != 1 ||
+			fflush(hashfp) != 0)
+		PELOG_ERROR_RETURN((PLV_ERROR, "Write hash failed %u\n", rid), -1);
+#endif
+	return 0;
+}
+
+// hard link id of a record, write to disk if changed
+int Root::setLink(uint32_t rid, uint64_t fileid)
+{
+	if (getLink(rid) == fileid)
+		return 0;
+	if (_links.size() <= rid)
+		_links.resize(_records.size(), 0);
+	if (_links[rid] != 0)
+	{
+		auto range = linkidx.equal_range(_links[rid]);
+		for (auto it = range.first; it != range.second; ++it)
+			if (it->second == rid)
+			{
+				linkidx.erase(it);
+				break;
+			}
+	}
+	_links[rid] = fileid;
+	if (fileid != 0)
+		linkidx.insert(std::make_pair(fileid, rid));
+#ifndef DRY_RUN
+	FILEGuard fp = OpenFile(recpath.c_str(), "link", _NCT("rb+"));
+	if (!fp)
+		PELOG_ERROR_RETURN((PLV_ERROR, "Failed to open link file to write\n"), -1);
+	if (fseek(fp, sizeof(_links[0]) * rid, SEEK_SET) != 0 || fwrite(&_links[rid], sizeof(_links[rid]), 1, fp) != 1)
+		PELOG_ERROR_RETURN((PLV_ERROR, "Write link failed %u\n", rid), -1);
+#endif
+	return 0;
+}
+
+// an uploaded link of file `fileid`. links share the data and attributes, so one with the same
+// time and size has the same contents as the new link. 0 if none
+uint32_t Root::findLink(uint64_t fileid, uint64_t ftime, uint64_t fsize, uint32_t exclude) const
+{
+	auto range = linkidx.equal_range(fileid);
+	for (auto it = range.first; it != range.second; ++it)
+	{
+		const RecordItem &rec = _records[it->second];
+		if (it->second != exclude && rec.isactive() && !rec.isdir() && !rec.isignore() && !rec.ispending() &&
+				rec.time() == (uint32_t)ftime && rec.size24() == (fsize & 0xffffff) && getHash(it->second) != 0 &&
+				pendel.find(it->second) == pendel.end())
+			return it->second;
+	}
+	return 0;
+}
+
+// SHA-256 of `rid` as uploaded. read from the local file if not known yet, which must still have the
+// uploaded contents by its hash
+int Root::copySha(uint32_t rid, Sha256 &sha)
+{
+	auto it = shas.find(rid);
+	if (it != shas.end())
+	{
+		sha = it->second;
+		return 0;
+	}
+	abufchar spath, lpath;
+	uint64_t hash = 0;
+	if (recPath(rid, spath) != 0)
+		return -1;
+	buildPath(_localroot.c_str(), _localroot.length(), spath, strlen(spath), lpath);
+	if (ContentHash::file(lpath, hash, sha.data()) != 0 || hash != getHash(rid))
+		PELOG_ERROR_RETURN((PLV_VERBOSE, "Copy source changed %s\n", lpath.buf()), -1);
+	setSha(rid, sha);
+	return 0;
+}
+
+// SHA-256 of a record, write to disk. all 0 if unknown
+int Root::setSha(uint32_t rid, const Sha256 &sha)
+{
+	if (sha == Sha256())
+		shas.erase(rid);
+	else
+		shas[rid] = sha;
+#ifndef DRY_RUN
+	FILEGuard fp = OpenFile(recpath.c_str(), "sha", _NCT("rb+"));
+	if (!fp)
+		PELOG_ERROR_RETURN((PLV_ERROR, "Failed to open sha file to write\n"), -1);
+	// writing beyond the end fills the gap with 0, unknown
+	if (fseek(fp, sizeof(sha) * rid, SEEK_SET) != 0 || fwrite(sha.data(), sha.size(), 1, fp) != 1)
+		PELOG_ERROR_RETURN((PLV_ERROR, "Write sha failed %u\n", rid), -1);
+#endif
+	return 0;
+}
+
+// whether a file of `fsize` was hashed in this or another backup, i.e. a copy of it may be on remote
+bool Root::copySize(uint64_t fsize) const
+{
+	if (copysizes.count((uint32_t)(fsize & 0xffffff)) > 0)
+		return true;
+	for (const Root *peer : peers)
+		if (peer->copysizes.count((uint32_t)(fsize & 0xffffff)) > 0)
+			return true;
+	return false;
+}
+
+// an uploaded file with contents `hash`, 0 if none
+uint32_t Root::findCopy(uint64_t hash, uint64_t fsize, uint32_t exclude) const
+{
+	auto range = hashidx.equal_range(hash);
+	for (auto it = range.first; it != range.second; ++it)
+	{
+		const RecordItem &rec = _records[it->second];
+		if (it->second != exclude && rec.isactive() && !rec.isdir() && !rec.isignore() && !rec.ispending() &&
+				rec.size24() == (fsize & 0xffffff) && pendel.find(it->second) == pendel.end())
+			return it->second;
+	}
+	return 0;
+}
+
 // write back records to file
 int Root::writeRec(std::vector<uint32_t> &cids)
 {
@@ -935,17 +1679,26 @@ int Root::writeRec(std::vector<uint32_t> &cids)
 int Root::perform(Action &action, Remote *remote)
 {
 	uint32_t rid = 0;
+	// queued files are recorded before anything else is changed. new dirs do not get in their way
+	if (action.type != Action::ADDFILE && action.type != Action::MODFILE && action.type != Action::ADDDIR)
+	{
+		int res = collectFiles(remote, true);
+		if (res != Aresq::OK)
+			return res;
+	}
 	switch (action.type)
 	{
 	case Action::ADDDIR:
-		return addDir(action.name, strlen(action.name), action.isignore, rid, remote);
+		return addDir(action.name, action.namelen, action.isignore, rid, remote);
 	case Action::ADDFILE:
 	case Action::MODFILE:
-		return addFile(action.name, strlen(action.name), action.isignore, action.keephist, rid, remote);
+		return addFile(action.name, action.namelen, action.isignore, action.keephist, rid, remote);
 	case Action::DELDIR:
-		return delDir(action.name, strlen(action.name), action.isignore, action.keephist, false, remote);
+		return delDir(action.name, action.namelen, action.isignore, action.keephist, false, remote);
 	case Action::DELFILE:
-		return delFile(action.name, strlen(action.name), action.isignore, action.keephist, false, remote);
+		return delFile(action.name, action.namelen, action.isignore, action.keephist, false, remote);
+	case Action::RENAME:
+		return renameRec(action.name, action.namelen, action.dst, action.dstlen, remote);
 	}
 	PELOG_ERROR_RETURN((PLV_WARNING, "Unsupported action %d\n", action.type), Aresq::NOTIMPLEMENTED);
 }
\ No newline at end of file
@@ -1,8 +1,11 @@
 #pragma once
 
 #include <vector>
+#include <array>
 #include <deque>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
 #include "record.h"
 #include "auto_buf.hpp"
 #include "fsadapter.h"
@@ -16,13 +19,17 @@ public:
 	~Root();
 
 	// back up contents of `root` into remote/`name`, using `recpath` as local registry
-	int load(int id, const char *name, const char *root, const char *rec_path, bool keephist, AresqIgnore *aresqignore);
+	// dir listings over `listmem` bytes are sorted in temp files under `rec_path`
+	int load(int id, const char *name, const char *root, const char *rec_path, bool keephist, size_t listmem, AresqIgnore *aresqignore);
 
 	struct Action
 	{
 		enum { NONE, ADDDIR, DELDIR, ADDFILE, DELFILE, MODFILE, RENAME} type = NONE;
-		abufchar name;
-		abufchar dst;
+		// paths point into the path arena of Root, valid until the next refreshStep()
+		const char *name = NULL;
+		size_t namelen = 0;
+		const char *dst = NULL;
+		size_t dstlen = 0;
 		bool isignore;
 		bool keephist;
 		//union
@@ -42,15 +49,29 @@ public:
 	// return: 0: finished, >0: one step, <0: error
 	int refreshStep(int state, Action &action);
 	int perform(Action &action, Remote *remote);
+	// files modified less than `secs` ago are not uploaded by refresh, but queued till they stop changing.
+	// 0: upload at once
+	void setSettle(uint32_t secs) { settle = secs; }
+	// another backup on the same remote, searched for an existing copy of new files too
+	void addPeer(Root *peer) { peers.push_back(peer); }
+	// next file of the settle queue not modified for the settle window, the action is to be perform()ed.
+	// return: 1: one action, 0: none ready, `wait` seconds till one may be, 0 if the queue is empty
+	int settleStep(Action &action, uint32_t &wait);
+	size_t settling() const { return settleq.size(); }
 	//int addDir(const char *dir) { uint32_t did = 0;  return addDir(dir, strlen(dir), did); }
 	//int addFile(const char *file, Remote *remote) { uint32_t fid = 0;  return addFile(file, strlen(file), fid, remote); }
 
 	int addDir(const char *dir, size_t dlen, bool isignore, uint32_t &did, Remote *remote);
 	int delDir(const char *dir, size_t dlen, bool isignore, bool keephist, bool noremote, Remote *remote);
 	int delDir(uint32_t rid, uint32_t pid, const char *dir, size_t dlen, bool isignore, bool keephist, bool noremote, Remote *remote);
+	// fid is 0 if the file is queued on remote, and recorded later by collectFiles()
 	int addFile(const char *file, size_t flen, bool isignore, bool keephist, uint32_t &fid, Remote *remote);
+	// record files queued on remote and completed. `all`: wait for all of them, e.g. at the end of refresh
+	int collectFiles(Remote *remote, bool all);
 	int delFile(const char *filename, size_t flen, bool isignore, bool keephist, bool noremote, Remote *remote);
 	int delFile(uint32_t rid, uint32_t pid, const char *filename, size_t flen, bool isignore, bool keephist, bool noremote, Remote *remote);
+	// move record `src` with all its contents to `dst`, on remote and locally
+	int renameRec(const char *src, size_t slen, const char *dst, size_t dlen, Remote *remote);
 	int eraseName(uint32_t rid);
 
 	// look for the specific name under pid, return rid if found, otherwise pre or parent id
@@ -71,6 +92,7 @@ private:
 	std::string recpath;	// the dir used as local registry
 
 	bool keephist;
+	size_t listmem;
 
 	AresqIgnore *ignore;
 
@@ -92,6 +114,29 @@ private:
 	//     size(): file size, lower 3-bytes only
 	std::vector<RecordItem> _records;
 	std::vector<char> _rname;
+	// content hash of file records by record id, 0 if unknown. in `hash` file, 8 bytes each
+	// used to tell files only touched from those actually changed
+	std::vector<uint64_t> _hashes;
+	FILE *hashfp = NULL;	// `hash` file kept open once written, each recorded file changes a hash
+	// content hash -> rid of files, to find an existing copy of new files on remote
+	std::unordered_multimap<uint64_t, uint32_t> hashidx;
+	uint32_t findCopy(uint64_t hash, uint64_t fsize, uint32_t exclude) const;
+	// SHA-256 of the contents of copy sources by record id, known once they are copied from or to.
+	// in `sha` file, 32 bytes each, 0 if unknown. a copy is made only if both agree, a hash match
+	// only tells one may exist
+	typedef std::array<uint8_t, 32> Sha256;
+	std::unordered_map<uint32_t, Sha256> shas;
+	int copySha(uint32_t rid, Sha256 &sha);
+	int setSha(uint32_t rid, const Sha256 &sha);	// write to disk
+	// lower 3-bytes of size of files ever hashed, tells a copy may exist before reading the file
+	std::unordered_set<uint32_t> copysizes;
+	bool copySize(uint64_t fsize) const;
+	std::vector<Root *> peers;
+	// getFileId() of files with more than one hard link by record id, 0 otherwise. in `link` file, 8 bytes each
+	std::vector<uint64_t> _links;
+	// file id -> rid, to find another link of a new file already uploaded
+	std::unordered_multimap<uint64_t, uint32_t> linkidx;
+	uint32_t findLink(uint64_t fileid, uint64_t ftime, uint64_t fsize, uint32_t exclude) const;
 
 	//Remote *_remote = NULL;
 
@@ -110,9 +155,26 @@ private:
 			RETURN,
 		} stage = INIT;
 		uint32_t prog = 0;
-		std::vector<FsItem> files;
+		FsStream files;	// REMOVE and NEW both walk through it once, dropped afterwards
+		std::shared_ptr<const IgnoreMatcher> ignrules;	// DIRIGNORE of this dir
+		size_t ignoff = 0;	// where names beneath this dir start in relative paths
 	};
 	std::deque<RefreshIter> restate;
+	PathArena actpath;	// storage of Action paths, reset on each refreshStep()
+	std::vector<AresqIgnore::Scope> ignscopes;	// DIRIGNORE rules of restate, deepest first
+	void setActionName(Action &action, const RefreshIter &reiter, const char *name);
+	// rename detection. deleted items are held back till the end of refresh, in case they show up
+	// somewhere else as new ones, which are then moved on remote instead of being uploaded again
+	std::map<uint32_t, uint32_t> pendel;	// rid of deleted items -> name() when detected
+	std::vector<std::pair<uint64_t, uint32_t>> moveidx;	// moveKey() -> rid of records on startRefresh, sorted
+	static uint64_t moveKey(bool isdir, uint32_t time, uint32_t size24)
+		{ return (uint64_t)time << 32 | (isdir ? 0x80000000u : size24); }
+	uint32_t findMoved(const RefreshIter &reiter, const FsItem &file, const char *name);
+	bool sameChildren(uint32_t did, const abufchar &dir);
+	// files still being written, kept across refreshes. path relative to root -> keephist of the action
+	uint32_t settle = 0;
+	std::map<std::string, bool> settleq;
+	bool deferSettle(Action &action, uint32_t ftime);
 	std::map<std::string, int> failstate;	// record fail during refresh, for debugging
 	bool recordFail(const char *path)
 	{
@@ -165,11 +227,34 @@ private:
 
 	inline const char *getName(uint32_t rid) const { AuVerify(rid > 1 && rid < _records.size()); return _records[rid].name(_rname); }
 	inline const char *getName(const RecordItem &rec) const { return rec.name(_rname); }
+	uint32_t parentRec(uint32_t rid) const;
+	int recPath(uint32_t rid, abufchar &path) const;	// path relative to local root
 
 	// records operations
 	uint32_t allocRName(const char *name, size_t len);	// alloc string in _rname, and write to disk
 	uint32_t allocRec(std::vector<uint32_t> &cids);		// alloc a new item in _record. change in memory only, use writeRec() to write to disk
 	int recycleRec(uint32_t rid, std::vector<uint32_t> &cids);
 	int writeRec(std::vector<uint32_t> &cids);	// write back records to file
+	uint64_t getHash(uint32_t rid) const { return rid < _hashes.size() ? _hashes[rid] : 0; }
+	int setHash(uint32_t rid, uint64_t hash);	// write to disk if changed
+	uint64_t getLink(uint32_t rid) const { return rid < _links.size() ? _links[rid] : 0; }
+	int setLink(uint32_t rid, uint64_t fileid);	// write to disk if changed
+
+	// a file uploaded, or queued on remote
+	struct FileUpload
+	{
+		std::string path;	// relative to root, if queued
+		uint64_t ftime = 0;
+		uint64_t fsize = 0;
+		uint64_t hash = 0;
+		uint64_t fileid = 0;
+		uint32_t nlink = 0;
+		bool isignore = false;
+		bool pendingfail = false;
+		bool copied = false;
+		Sha256 sha = Sha256();	// of a copied file
+	};
+	std::deque<FileUpload> uploads;	// queued, to be recorded in this order
+	int recordFile(uint32_t pid, const char *file, size_t flen, const FileUpload &up, uint32_t &fid);
 };
 
@@ -43,6 +43,12 @@ void f()
  
     // shollow copy
     buf2.scopyFrom(string1);
+
+    // move and swap only exchange pointers (or the few inline bytes), nothing is reallocated
+    abuf<char> buf4(std::move(buf2));
+    buf4.swap(buf3);
+
+    // short contents (up to abuf<T>::INLINE_COUNT elements) are stored inline, without heap allocation
  
     // Explicit release is not required. But `buf3.resize(0)` can do the trick if necessary
 } 
@@ -59,8 +65,16 @@ To debug memory issues, enable the following
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <utility>
 #include "audbg.h"
 
+// VS2013 does not know noexcept
+#if defined(_MSC_VER) && _MSC_VER < 1900
+#	define ABUF_NOEXCEPT
+#else
+#	define ABUF_NOEXCEPT noexcept
+#endif
+
 #ifdef _DEBUG
 #	define _ABUF_DEBUG 1
 #endif
@@ -72,31 +86,42 @@ To debug memory issues, enable the following
 template <typename T>
 	class abuf
 {
+public:
+	// contents up to INLINE_COUNT elements are kept inside the object, which covers most file names
+	enum { INLINE_BYTES = 32, INLINE_COUNT = INLINE_BYTES / sizeof(T) };
 protected:
 	T *_buf;
 #ifdef _ABUF_DEBUG_PAD_
-	uint8_t *_inbuf;
+	uint8_t *_inbuf;	// NULL if _buf is inline
 #endif
 	size_t _size;
+	union
+	{
+		uint8_t _bytes[INLINE_BYTES];
+		uint64_t _align;
+	} _inl;
 protected:
 	abuf(const T *);
 	abuf &operator =(const T *);
 
+	bool isinline() const { return _buf == (const T *)_inl._bytes; }
+
 	// in debug mode, append 4 extra bytes (0xfdfdfdfdu) to both beginning and end of _buf
 	// and check the values frequently
 	// if only _ABUF_DEBUG_PAD_ defined but not _ABUF_DEBUG, just do the padding but not checking
+	// inline buffer is not padded
 #ifdef _ABUF_DEBUG_PAD_
 #	define abuf_mem_check_dword 0xfdfdfdfdu
 #endif
 #ifdef _ABUF_DEBUG
 	// Failure of this assertion indicates there was an overflow while using abuf. Check your code!
 #	define abuf_mem_check() do { \
-	if(_size > 0) \
+	if(_size > 0 && !isinline()) \
 		AuVerify( (*(uint32_t*)_inbuf) == abuf_mem_check_dword && \
 			(*(uint32_t*)(_inbuf + 4 + _size * sizeof(T))) ==  abuf_mem_check_dword); \
 	} while (false)
 #	define abufchar_mem_check() do { \
-	if(_size > 0) \
+	if(_size > 0 && !isinline()) \
 		AuVerify( (*(uint32_t*)_inbuf) == abuf_mem_check_dword && \
 			(*(uint32_t*)(_inbuf + 4 + _size * sizeof(char))) ==  abuf_mem_check_dword); \
 	} while (false)
@@ -105,6 +130,45 @@ protected:
 #	define abufchar_mem_check() ((void)0)
 #endif
 
+	// release heap memory, and become null
+	void freebuf()
+	{
+		if (!isinline())
+		{
+#ifdef _ABUF_DEBUG_PAD_
+			free(_inbuf);
+#else
+			free(_buf);
+#endif
+		}
+#ifdef _ABUF_DEBUG_PAD_
+		_inbuf = NULL;
+#endif
+		_buf = NULL;
+		_size = 0;
+	}
+
+	// take over contents of r, which must be null before. r becomes null
+	void takefrom(abuf &r)
+	{
+		if (r.isinline())
+		{
+			memcpy(_inl._bytes, r._inl._bytes, r._size * sizeof(T));
+			_buf = (T *)_inl._bytes;
+		}
+		else
+		{
+			_buf = r._buf;
+#ifdef _ABUF_DEBUG_PAD_
+			_inbuf = r._inbuf;
+			r._inbuf = NULL;
+#endif
+		}
+		_size = r._size;
+		r._buf = NULL;
+		r._size = 0;
+	}
+
 public:
 	abuf():_buf(NULL), _size(0)
 #ifdef _ABUF_DEBUG_PAD_
@@ -116,8 +180,18 @@ public:
 	 * @param element_count number of elements wanted
 	 * @param clear whether fill all elements with 0
 	 */
-	abuf(size_t element_count, bool clear = false)
+	abuf(size_t element_count, bool clear = false) : abuf()
 	{
+		if(element_count == 0)
+			return;
+		if(element_count <= INLINE_COUNT)
+		{
+			_buf = (T *)_inl._bytes;
+			_size = element_count;
+			if(clear)
+				memset(_buf, 0, element_count * sizeof(T));
+			return;
+		}
 		if(clear)
 		{
 #ifdef _ABUF_DEBUG_PAD_
@@ -158,36 +232,53 @@ public:
 	{
 		resize(r.size());
 		if (size() > 0)
-			memcpy(buf(), r.buf(), size());
+			memcpy(buf(), r.buf(), size() * sizeof(T));
+	}
+
+	abuf(abuf &&r) ABUF_NOEXCEPT : abuf()
+	{
+		takefrom(r);
 	}
 
 	abuf(const T *r, size_t size) : abuf()
 	{
 		resize(size);
 		if (size > 0)
-			memcpy(buf(), r, size);
+			memcpy(buf(), r, size * sizeof(T));
 	}
 
 	abuf& operator =(const abuf &r)
 	{
+		if (this == &r)
+			return *this;
 		resize(0);
 		resize(r.size());
 		if (size() > 0)
-			memcpy(buf(), r.buf(), size());
+			memcpy(buf(), r.buf(), size() * sizeof(T));
 		return *this;
 	}
 
+	abuf& operator =(abuf &&r) ABUF_NOEXCEPT
+	{
+		if (this != &r)
+		{
+			freebuf();
+			takefrom(r);
+		}
+		return *this;
+	}
+
+	void swap(abuf &r) ABUF_NOEXCEPT
+	{
+		abuf tmp(std::move(r));
+		r = std::move(*this);
+		*this = std::move(tmp);
+	}
+
 	~abuf()
 	{
 		abuf_mem_check();
-#ifdef _ABUF_DEBUG_PAD_
-		free(_inbuf);
-		_inbuf = NULL;
-#else
-		free(_buf);
-#endif
-		_buf = NULL;
-		_size = 0;
+		freebuf();
 	}
 
 	/** 
@@ -207,36 +298,40 @@ public:
 	int resize(size_t new_element_count, bool force_shrink = false)
 	{
 		abuf_mem_check();
-		if(new_element_count > _size || new_element_count < _size && new_element_count > 0 && force_shrink)
+		if(new_element_count == 0)
+		{
+			freebuf();
+		}
+		else if((_buf == NULL || isinline()) && new_element_count <= INLINE_COUNT)	// stay inline
+		{
+			_buf = (T *)_inl._bytes;
+			if(new_element_count > _size || force_shrink)
+				_size = new_element_count;
+		}
+		else if(new_element_count > _size || new_element_count < _size && force_shrink)
 		{
+			bool wasinline = isinline();
 #ifdef _ABUF_DEBUG_PAD_
-			uint8_t *nbuf = (uint8_t *)realloc(_inbuf, new_element_count * sizeof(T) + 8);
+			uint8_t *nbuf = (uint8_t *)realloc(wasinline ? NULL : _inbuf, new_element_count * sizeof(T) + 8);
 #else
-			uint8_t *nbuf = (uint8_t *)realloc(_buf, new_element_count * sizeof(T));
+			uint8_t *nbuf = (uint8_t *)realloc(wasinline ? NULL : _buf, new_element_count * sizeof(T));
 #endif
-			if(!nbuf && new_element_count != 0)	// if realloc fails, return value is NULL and the input _buf would be untouched
+			if(!nbuf)	// if realloc fails, return value is NULL and the input _buf would be untouched
 				return 1;
 #ifdef _ABUF_DEBUG_PAD_
+			if(wasinline)
+				memcpy(nbuf + 4, _inl._bytes, _size * sizeof(T));
 			_inbuf = nbuf;
 			*(uint32_t*)_inbuf = abuf_mem_check_dword;
 			*(uint32_t*)(_inbuf + new_element_count * sizeof(T) + 4) = abuf_mem_check_dword;
 			_buf = (T *)(_inbuf + 4);
 #else
+			if(wasinline)
+				memcpy(nbuf, _inl._bytes, _size * sizeof(T));
 			_buf = (T *)nbuf;
 #endif
 			_size = new_element_count;
 		}
-		else if(new_element_count == 0)
-		{
-#ifdef _ABUF_DEBUG_PAD_
-			free(_inbuf);
-			_inbuf = NULL;
-#else
-			free(_buf);
-#endif
-			_buf = NULL;
-			_size = 0;
-		}
 		abuf_mem_check();
 		return 0;
 	}
@@ -319,6 +414,9 @@ public:
 			memcpy(_buf, copy._buf, _size);
 		abufchar_mem_check();
 	}
+	abufchar(abufchar &&r) ABUF_NOEXCEPT : abuf<char>(std::move(r)) {}
+	abufchar &operator =(const abufchar &r) { abuf<char>::operator =(r); return *this; }
+	abufchar &operator =(abufchar &&r) ABUF_NOEXCEPT { abuf<char>::operator =(std::move(r)); return *this; }
 	abufchar(const char *copy = NULL)
 	{
 		abuf<char>();
@@ -7,6 +7,7 @@
 
 #ifdef _WIN32
 #include <windows.h>
+#include <winioctl.h>
 #include <shlobj.h>
 #include <tchar.h>
 #define DIRSEP '\\'
@@ -104,9 +105,9 @@ inline uint64_t filetime2Timet(FILETIME ft)
 	return ((uint64_t)ft.dwHighDateTime << 32 | ft.dwLowDateTime) / 10000000 - UINT64_C(11644473600);
 }
 
-int ListDir(const abufchar &u8dir, std::vector<FsItem> &items)
+int ListDir(const abufchar &u8dir, FsStream &items)
 {
-	items.clear();
+	items.close();
 
 	// convert to utf16 and append "\\*" to the end for `dir`
 	size_t dirlen = utf8to16_len(u8dir);
@@ -124,6 +125,7 @@ int ListDir(const abufchar &u8dir, std::vector<FsItem> &items)
 	dir[dirlen] = 0;
 	if (hFind == INVALID_HANDLE_VALUE)
 		return -1;
+	abuf<char> name;
 	do
 	{
 		if (ffd.dwFileAttributes == INVALID_FILE_ATTRIBUTES)
@@ -131,34 +133,37 @@ int ListDir(const abufchar &u8dir, std::vector<FsItem> &items)
 		if (ffd.cFileName[0] == L'.' && (ffd.cFileName[1] == 0 ||
 			ffd.cFileName[1] == L'.' && ffd.cFileName[2] == 0))
 			continue;	// exluce "." and ".." dirs
-		items.resize(items.size() + 1);
-		FsItem &item = items.back();
-		utf16to8(ffd.cFileName, item.name);
-		item.size = ((uint64_t)ffd.nFileSizeHigh * (MAXDWORD + (uint64_t)1)) + ffd.nFileSizeLow;
-		item.isdir(ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY ? true : false);
-		item.time = (uint32_t)filetime2Timet(item.isdir() ? ffd.ftCreationTime : ffd.ftLastWriteTime);
+		utf16to8(ffd.cFileName, name);
+		FsItem *item = items.add(name, strlen(name));
+		if (!item)
+		{
+			FindClose(hFind);
+			items.close();
+			PELOG_ERROR_RETURN((PLV_ERROR, "ListDir add item failed %s\n", u8dir.buf()), -1);
+		}
+		item->size = ((uint64_t)ffd.nFileSizeHigh * (MAXDWORD + (uint64_t)1)) + ffd.nFileSizeLow;
+		item->isdir(ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY ? true : false);
+		item->time = (uint32_t)filetime2Timet(item->isdir() ? ffd.ftCreationTime : ffd.ftLastWriteTime);
 	} while (FindNextFileW(hFind, &ffd));
+	FindClose(hFind);
 
-	// sort
-	std::sort(items.begin(), items.end(),
-		[](const FsItem &l, const FsItem &r) { return pathCmpSt(l.name, r.name) < 0; });
-
-	// dedupe and split
-	const char *lname = "";
-	for (size_t i = 0; i < items.size(); ++i)
+	// sort, dedupe and get ready for reading
+	if (items.finish(u8dir) != 0)
 	{
-		if (pathCmpDp(items[i].name, lname) == 0)
-		{
-			PELOG_LOG((PLV_WARNING, "DUP-CASE %s: %s. drop\n", u8dir.buf(), items[i].name.buf()));
-			items.erase(items.begin() + i);
-			--i;
-		}
-		else
-		lname = items[i].name;
+		items.close();
+		return -1;
 	}
 	return 0;
 }
 
+int RemoveFile(const char *filename)
+{
+	abuf<utf16_t> path;
+	utf8to16(filename, path);
+	normDirSep(path);
+	return _wremove(path);
+}
+
 int pathCmpMt(const char *l, const char *r)	// case insensitive match on windows
 {
 	return pathCmpDp(l, r);
@@ -192,8 +197,261 @@ int getFileAttr(const char *base, const char *filename, size_t fnlen, uint64_t &
 	return 0;
 }
 
+int getFileId(const char *base, const char *filename, size_t fnlen, uint64_t &fileid, uint32_t &nlink)
+{
+	fileid = 0;
+	nlink = 0;
+	abuf<wchar_t> path;
+	buildPath(base, filename, fnlen, path);
+	// attributes only, does not conflict with any sharing mode of other handles
+	HANDLE h = CreateFileW(path, FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+	if (h == INVALID_HANDLE_VALUE)
+		return -1;
+	BY_HANDLE_FILE_INFORMATION info;
+	BOOL ok = GetFileInformationByHandle(h, &info);
+	CloseHandle(h);
+	if (!ok)
+		return -1;
+	fileid = ((uint64_t)info.nFileIndexHigh << 32 | info.nFileIndexLow) ^ info.dwVolumeSerialNumber * 0x9E3779B97F4A7C15ULL;
+	nlink = info.nNumberOfLinks;
+	return 0;
+}
+
+int LocalFile::open(const char *filename)
+{
+	close();
+	abuf<utf16_t> path;
+	utf8to16(filename, path);
+	normDirSep(path);
+	// FILE_WRITE_ATTRIBUTES is only for keeping last access time, do without it if not granted
+	bool keepatime = true;
+	HANDLE h = CreateFileW(path, GENERIC_READ | FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE,
+		NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (h == INVALID_HANDLE_VALUE && GetLastError() == ERROR_ACCESS_DENIED)
+	{
+		keepatime = false;
+		h = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+			NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	}
+	if (h == INVALID_HANDLE_VALUE)
+		return -1;
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(h, &size))
+	{
+		CloseHandle(h);
+		return -1;
+	}
+	if (keepatime)
+	{
+		FILETIME ft = { 0xFFFFFFFF, 0xFFFFFFFF };	// do not update last access time on this handle
+		SetFileTime(h, NULL, &ft, NULL);
+	}
+	BY_HANDLE_FILE_INFORMATION info;
+	_sparse = GetFileInformationByHandle(h, &info) && (info.dwFileAttributes & FILE_ATTRIBUTE_SPARSE_FILE);
+	_h = h;
+	_size = size.QuadPart;
+	_pos = 0;
+	_error = false;
+	return 0;
+}
+
+void LocalFile::close()
+{
+	if (_h != INVALID_HANDLE_VALUE)
+		CloseHandle(_h);
+	_h = INVALID_HANDLE_VALUE;
+	_size = _pos = 0;
+}
+
+size_t LocalFile::read(void *buf, size_t len)
+{
+	size_t total = 0;
+	while (total < len)
+	{
+		DWORD got = 0;
+		DWORD toread = (DWORD)std::min(len - total, (size_t)0x40000000);
+		if (!ReadFile(_h, (char *)buf + total, toread, &got, NULL))
+		{
+			_error = true;
+			break;
+		}
+		if (got == 0)
+			break;
+		total += got;
+	}
+	_pos += total;
+	return _error ? 0 : total;
+}
+
+void LocalFile::release(uint64_t pos)
+{
+	// no way to drop cache for buffered handles on windows
+}
+
+bool LocalFile::nextData(uint64_t pos, uint64_t &start, uint64_t &end)
+{
+	if (pos >= _size)
+		return false;
+	start = pos;
+	end = _size;
+	FILE_ALLOCATED_RANGE_BUFFER query, range;
+	query.FileOffset.QuadPart = pos;
+	query.Length.QuadPart = _size - pos;
+	DWORD got = 0;
+	// one range is enough, ERROR_MORE_DATA only tells there are more after it
+	if (_sparse && (DeviceIoControl(_h, FSCTL_QUERY_ALLOCATED_RANGES, &query, sizeof(query), &range, sizeof(range), &got, NULL) ||
+		GetLastError() == ERROR_MORE_DATA))
+	{
+		if (got < sizeof(range))
+			return false;
+		start = std::max(pos, (uint64_t)range.FileOffset.QuadPart);
+		end = std::min(_size, (uint64_t)(range.FileOffset.QuadPart + range.Length.QuadPart));
+	}
+	LARGE_INTEGER to;
+	to.QuadPart = start;
+	if (!SetFilePointerEx(_h, to, NULL, FILE_BEGIN))
+	{
+		_error = true;
+		return false;
+	}
+	_pos = start;
+	return start < end;
+}
+
 // end of win32 specific
 #elif defined __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+int LocalFile::open(const char *filename)
+{
+	close();
+	// O_NOATIME is only allowed for owner of the file or privileged users
+	int fd = ::open(filename, O_RDONLY | O_CLOEXEC | O_NOATIME);
+	if (fd < 0 && errno == EPERM)
+		fd = ::open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+	{
+		::close(fd);
+		return -1;
+	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	_fd = fd;
+	_size = st.st_size;
+	_sparse = (uint64_t)st.st_blocks * 512 < (uint64_t)st.st_size;
+	_pos = _dropped = _ahead = 0;
+	_aheadcached = _keep = false;
+	_error = false;
+	return 0;
+}
+
+void LocalFile::close()
+{
+	if (_fd >= 0)
+		::close(_fd);
+	_fd = -1;
+	_size = _pos = 0;
+}
+
+// whether all pages of the range are in page cache. mapping does not fault pages in
+bool LocalFile::iscached(uint64_t off, size_t len)
+{
+	static const uint64_t pagesize = sysconf(_SC_PAGESIZE);
+	if (off >= _size)
+		return false;
+	len = (size_t)std::min((uint64_t)len, _size - off);
+	uint64_t start = off & ~(pagesize - 1);
+	size_t maplen = (size_t)(off + len - start);
+	void *addr = mmap(NULL, maplen, PROT_READ, MAP_SHARED, _fd, start);
+	if (addr == MAP_FAILED)
+		return false;
+	abuf<unsigned char> vec((maplen + pagesize - 1) / pagesize);
+	bool cached = mincore(addr, maplen, vec) == 0;
+	for (size_t i = 0; cached && i < vec.size(); ++i)
+		cached = (vec[i] & 1) != 0;
+	munmap(addr, maplen);
+	return cached;
+}
+
+size_t LocalFile::read(void *buf, size_t len)
+{
+	// check the cache state before our own reading, or prefetching, pulls the pages in
+	_keep = _keep || (_pos < _ahead ? _aheadcached : iscached(_pos, len));
+	size_t total = 0;
+	while (total < len)
+	{
+		ssize_t got = ::read(_fd, (char *)buf + total, len - total);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got < 0)
+		{
+			_error = true;
+			break;
+		}
+		if (got == 0)
+			break;
+		total += got;
+	}
+	_pos += total;
+	// prefetch the next range of the same size
+	if (!_error && total == len && _pos < _size && _pos >= _ahead)
+	{
+		_aheadcached = iscached(_pos, len);
+		posix_fadvise(_fd, _pos, len, POSIX_FADV_WILLNEED);
+		_ahead = _pos + len;
+	}
+	return _error ? 0 : total;
+}
+
+void LocalFile::release(uint64_t pos)
+{
+	if (pos <= _dropped)
+		return;
+	if (!_keep)
+		posix_fadvise(_fd, _dropped, pos - _dropped, POSIX_FADV_DONTNEED);
+	_dropped = pos;
+	_keep = false;
+}
+
+bool LocalFile::nextData(uint64_t pos, uint64_t &start, uint64_t &end)
+{
+	if (pos >= _size)
+		return false;
+	off_t data = lseek(_fd, pos, SEEK_DATA);
+	if (data < 0 && errno == ENXIO)	// a hole till the end
+		return false;
+	off_t hole = data < 0 ? -1 : lseek(_fd, data, SEEK_HOLE);
+	start = data < 0 ? pos : data;
+	end = hole < 0 ? _size : std::min((uint64_t)hole, _size);
+	if (lseek(_fd, start, SEEK_SET) < 0)
+	{
+		_error = true;
+		return false;
+	}
+	_pos = start;
+	return start < end;
+}
+
+int getFileId(const char *base, const char *filename, size_t fnlen, uint64_t &fileid, uint32_t &nlink)
+{
+	fileid = 0;
+	nlink = 0;
+	abuf<char> path;
+	buildPath(base, strlen(base), filename, fnlen, path);
+	struct stat st;
+	if (stat(path, &st) != 0)
+		return -1;
+	fileid = (uint64_t)st.st_ino ^ (uint64_t)st.st_dev * 0x9E3779B97F4A7C15ULL;
+	nlink = (uint32_t)st.st_nlink;
+	return 0;
+}
 #endif	// end of linux specific
 
 int buildPath(const char **dir, size_t size, abuf<char> &path)
@@ -240,6 +498,296 @@ int buildPath(const char *dir, size_t dirlen, const char *file, size_t filelen,
 	return 0;
 }
 
+size_t PathArena::put(const char *dir, size_t dirlen, const char *file, size_t filelen)
+{
+	size_t need = _used + (dirlen != 0 ? dirlen + 1 : 0) + filelen + 1;
+	if (need > _buf.size())
+		AuVerify(_buf.resize(need > _buf.size() * 2 ? need : _buf.size() * 2) == 0);
+	size_t off = _used;
+	char *po = _buf + off;
+	if (dirlen > 0)
+	{
+		memcpy(po, dir, dirlen);
+		po += dirlen;
+		*po++ = '/';
+	}
+	memcpy(po, file, filelen);
+	po[filelen] = 0;
+	_used = need;
+	return off;
+}
+
+int FsList::reserve(size_t count, size_t namebytes)
+{
+	size_t ncap = count > _cap ? std::max(count, std::max(_cap * 2, (size_t)64)) : _cap;
+	size_t nnamecap = namebytes > namecap() ? std::max(namebytes, std::max(namecap() * 2, (size_t)1024)) : namecap();
+	if (ncap == _cap && nnamecap == namecap())
+		return 0;
+	size_t oldnameoff = _cap * sizeof(FsItem);
+	if (_mem.resize(ncap * sizeof(FsItem) + nnamecap) != 0)
+		return -1;
+	if (ncap != _cap)	// item area grows, move names after it
+		memmove(_mem.buf() + ncap * sizeof(FsItem), _mem.buf() + oldnameoff, _nused);
+	_cap = ncap;
+	return 0;
+}
+
+FsItem *FsList::add(const char *name, size_t nlen)
+{
+	AuVerify(nlen < 0x10000);
+	if (reserve(_count + 1, _nused + nlen + 1) != 0)
+		return NULL;
+	FsItem *item = items() + _count++;
+	*item = FsItem();
+	item->name = (uint32_t)_nused;
+	item->nlen = (uint16_t)nlen;
+	item->hash = pathHashDp(name, nlen);
+	char *pname = (char *)_mem.buf() + _cap * sizeof(FsItem) + _nused;
+	memcpy(pname, name, nlen);
+	pname[nlen] = 0;
+	_nused += nlen + 1;
+	return item;
+}
+
+void FsList::sort()
+{
+	const char *names = (const char *)_mem.buf() + _cap * sizeof(FsItem);
+	std::sort(items(), items() + _count,
+		[names](const FsItem &l, const FsItem &r) { return pathCmpSt(names + l.name, names + r.name) < 0; });
+}
+
+static inline bool writeRunItem(FILE *fp, const FsItem &item, const char *name)
+{
+	return fwrite(&item, sizeof(item), 1, fp) == 1 && fwrite(name, 1, item.nlen, fp) == item.nlen;
+}
+
+FsItem *FsStream::add(const char *name, size_t nlen)
+{
+	// spill before the batch grows over the limit
+	if (_memlimit > 0 && !_tmp.empty() && !_list.empty() &&
+			_list.bytes() + sizeof(FsItem) + nlen + 1 > _memlimit && spill() != 0)
+		return NULL;
+	return _list.add(name, nlen);
+}
+
+int FsStream::finish(const char *dir)
+{
+	_dir = dir;
+	if (!_runs.empty())
+	{
+		if (!_list.empty() && spill() != 0)
+			return -1;
+		FsList().swap(_list);	// everything is in runs now
+		while (_runs.size() > MAXRUNS)	// keep number of open files limited
+		{
+			if (mergeRuns(MAXRUNS) != 0)
+				return -1;
+		}
+		PELOG_LOG((PLV_VERBOSE, "Listing of %s spilled to %d runs\n", dir, (int)_runs.size()));
+		return rewind();	// dups are dropped while merging
+	}
+
+	if (onbatch)
+		onbatch(_list);
+	_list.sort();
+	// dedupe. keep the first one of names only different in case
+	size_t out = 0;
+	for (size_t i = 0; i < _list.size(); ++i)
+	{
+		if (out > 0 && pathCmpDp(_list.name(i), _list.name(out - 1)) == 0)
+			PELOG_LOG((PLV_WARNING, "DUP-CASE %s: %s. drop\n", dir, _list.name(i)));
+		else
+			_list[out++] = _list[i];
+	}
+	_list.truncate(out);
+	return rewind();
+}
+
+void FsStream::close()
+{
+	for (Run &run : _runs)
+		removeRun(run);
+	_runs.clear();
+	_heap.clear();
+	FsList().swap(_list);
+	_cur = 0;
+	_fail = false;
+}
+
+int FsStream::rewind()
+{
+	_cur = 0;
+	_fail = false;
+	if (_runs.empty())
+		return 0;
+	_heap.clear();
+	for (size_t i = 0; i < _runs.size(); ++i)
+	{
+		Run &run = _runs[i];
+		int res = -1;
+		if (run.fp ? fseek(run.fp, 0, SEEK_SET) == 0 : openRun(run, _NCT("rb")) == 0)
+			res = readRun(run);
+		if (res < 0)
+		{
+			_fail = true;
+			_heap.clear();
+			PELOG_ERROR_RETURN((PLV_ERROR, "Read listing run failed %s.%u\n", _tmp.c_str(), run.seq), -1);
+		}
+		if (res > 0)
+			_heap.push_back(i);
+	}
+	std::make_heap(_heap.begin(), _heap.end(), [this](size_t l, size_t r) { return heapLess(l, r); });
+	return 0;
+}
+
+void FsStream::next()
+{
+	if (_runs.empty())
+	{
+		++_cur;
+		return;
+	}
+	if (_heap.empty())
+		return;
+	const Run &top = _runs[_heap.front()];
+	_last.resize(top.item.nlen + 1);
+	memcpy(_last, top.name, top.item.nlen + 1);
+	if (popHeap() != 0)
+		return;
+	// names only different in case are next to each other in sort order
+	while (!_heap.empty() && pathCmpDp(name(), _last) == 0)
+	{
+		PELOG_LOG((PLV_WARNING, "DUP-CASE %s: %s. drop\n", _dir.c_str(), name()));
+		if (popHeap() != 0)
+			return;
+	}
+}
+
+bool FsStream::heapLess(size_t l, size_t r) const
+{
+	return pathCmpSt(_runs[l].name, _runs[r].name) > 0;
+}
+
+int FsStream::popHeap()
+{
+	auto cmp = [this](size_t l, size_t r) { return heapLess(l, r); };
+	std::pop_heap(_heap.begin(), _heap.end(), cmp);
+	Run &run = _runs[_heap.back()];
+	int res = readRun(run);
+	if (res > 0)
+		std::push_heap(_heap.begin(), _heap.end(), cmp);
+	else
+		_heap.pop_back();
+	if (res < 0)
+	{
+		_fail = true;
+		_heap.clear();
+		PELOG_ERROR_RETURN((PLV_ERROR, "Read listing run failed %s.%u\n", _tmp.c_str(), run.seq), -1);
+	}
+	return 0;
+}
+
+int FsStream::spill()
+{
+	if (onbatch)
+		onbatch(_list);
+	_list.sort();
+	_runs.emplace_back();
+	Run &run = _runs.back();
+	run.seq = _seq++;
+	if (openRun(run, _NCT("wb")) != 0)
+		return -1;
+	bool ok = true;
+	for (size_t i = 0; ok && i < _list.size(); ++i)
+		ok = writeRunItem(run.fp, _list[i], _list.name(i));
+	ok = fclose(run.fp) == 0 && ok;
+	run.fp = NULL;
+	if (!ok)
+		PELOG_ERROR_RETURN((PLV_ERROR, "Write listing run failed %s.%u\n", _tmp.c_str(), run.seq), -1);
+	_list.clear();
+	return 0;
+}
+
+int FsStream::mergeRuns(size_t count)
+{
+	AuVerify(count <= _runs.size());
+	auto cmp = [this](size_t l, size_t r) { return heapLess(l, r); };
+	_runs.emplace_back();
+	Run &out = _runs.back();	// refs into deque stay valid on push/pop at ends
+	out.seq = _seq++;
+	std::vector<size_t> heap;
+	bool ok = openRun(out, _NCT("wb")) == 0;
+	for (size_t i = 0; ok && i < count; ++i)
+	{
+		int res = -1;
+		ok = openRun(_runs[i], _NCT("rb")) == 0 && (res = readRun(_runs[i])) >= 0;
+		if (res > 0)
+			heap.push_back(i);
+	}
+	std::make_heap(heap.begin(), heap.end(), cmp);
+	while (ok && !heap.empty())
+	{
+		std::pop_heap(heap.begin(), heap.end(), cmp);
+		Run &run = _runs[heap.back()];
+		int res = writeRunItem(out.fp, run.item, run.name) ? readRun(run) : -1;
+		ok = res >= 0;
+		if (res > 0)
+			std::push_heap(heap.begin(), heap.end(), cmp);
+		else
+			heap.pop_back();
+	}
+	if (out.fp && fclose(out.fp) != 0)
+		ok = false;
+	out.fp = NULL;
+	for (size_t i = 0; i < count; ++i)
+	{
+		removeRun(_runs.front());
+		_runs.pop_front();
+	}
+	if (!ok)
+		PELOG_ERROR_RETURN((PLV_ERROR, "Merge listing runs failed %s\n", _tmp.c_str()), -1);
+	return 0;
+}
+
+int FsStream::openRun(Run &run, const NCHART *mode)
+{
+	std::string filename = _tmp + '.' + std::to_string(run.seq);
+	if (!(run.fp = OpenFile(filename.c_str(), mode)))
+		PELOG_ERROR_RETURN((PLV_ERROR, "Open listing run failed %s\n", filename.c_str()), -1);
+	setvbuf(run.fp, NULL, _IOFBF, RUNBUFSIZE);
+	return 0;
+}
+
+int FsStream::readRun(Run &run)
+{
+	if (fread(&run.item, sizeof(run.item), 1, run.fp) != 1)
+		return ferror(run.fp) ? -1 : 0;
+	if (run.name.resize(run.item.nlen + 1) != 0 || fread(run.name, 1, run.item.nlen, run.fp) != run.item.nlen)
+		return -1;
+	run.name[run.item.nlen] = 0;
+	return 1;
+}
+
+void FsStream::removeRun(Run &run)
+{
+	if (run.fp)
+		fclose(run.fp);
+	run.fp = NULL;
+	RemoveFile((_tmp + '.' + std::to_string(run.seq)).c_str());
+}
+
+// FNV-1a over ascii lower cased bytes
+uint32_t pathHashDp(const char *name, size_t len)
+{
+	uint32_t hash = 2166136261u;
+	for (const unsigned char *p = (const unsigned char *)name, *pe = p + len; p < pe; ++p)
+	{
+		unsigned char c = *p >= 'A' && *p <= 'Z' ? *p + ('a' - 'A') : *p;
+		hash = (hash ^ c) * 16777619u;
+	}
+	return hash;
+}
+
 int pathCmpSt(const char *l, const char *r)		// keep case diffs near each other, used for sort
 {
 	// compare case insensitively first
@@ -4,6 +4,9 @@
 #include <string>
 #include <stdint.h>
 #include <vector>
+#include <deque>
+#include <functional>
+#include <algorithm>
 
 #ifdef _WIN32
 #include "utfconv.h"
@@ -19,12 +22,16 @@ typedef char NCHART;
 
 void Utf8toNchar(const char *utf8, abuf<NCHART> &ncs);
 
+// one item of FsList. fixed size, the name is kept in the name area of the list
 struct FsItem
 {
-	abuf<char> name;
+	uint32_t name = 0;	// offset in name area of the list
+	uint16_t nlen = 0;
+	uint8_t flag = 0;
+	uint8_t reserved = 0;
+	uint32_t hash = 0;	// pathHashDp() of name
 	uint32_t time = 0;
 	uint64_t size = 0;
-	uint8_t flag = 0;
 	inline bool isdir() const { return getflag(0); }
 	inline void isdir(bool flag) { setflag(flag, 0); }
 	inline bool isignore() const { return getflag(1); }
@@ -34,6 +41,106 @@ private:
 	inline void setflag(bool flag, int bit) { if (flag) this->flag |= (1u << bit); else this->flag &= ~(1u << bit); }
 };
 
+// Contents of one dir. Items and names share one buffer:
+//     [FsItem * capacity][names, null terminated]
+// so a listing takes a single allocation and is released with a single free
+class FsList
+{
+	abuf<uint8_t> _mem;
+	size_t _count = 0;
+	size_t _cap = 0;	// item capacity
+	size_t _nused = 0;	// bytes used in name area
+	inline FsItem *items() { return (FsItem *)_mem.buf(); }
+	inline const FsItem *items() const { return (const FsItem *)_mem.buf(); }
+	inline size_t namecap() const { return _mem.size() - _cap * sizeof(FsItem); }
+	int reserve(size_t count, size_t namebytes);
+public:
+	size_t size() const { return _count; }
+	bool empty() const { return _count == 0; }
+	size_t bytes() const { return _count * sizeof(FsItem) + _nused; }	// memory taken by contents
+	FsItem &operator [](size_t i) { return items()[i]; }
+	const FsItem &operator [](size_t i) const { return items()[i]; }
+	const char *name(size_t i) const { return name(items()[i]); }
+	const char *name(const FsItem &item) const { return (const char *)_mem.buf() + _cap * sizeof(FsItem) + item.name; }
+	// append an item, return NULL if out of memory
+	FsItem *add(const char *name, size_t nlen);
+	// drop items from `count` on. names stay in name area until clear()
+	void truncate(size_t count) { if (count < _count) _count = count; }
+	// keep memory for reuse
+	void clear() { _count = 0; _nused = 0; }
+	// sort items with pathCmpSt(), names are not moved
+	void sort();
+	void swap(FsList &r) { _mem.swap(r._mem); std::swap(_count, r._count); std::swap(_cap, r._cap); std::swap(_nused, r._nused); }
+};
+
+// Sorted and deduplicated contents of one dir, read in order through a cursor.
+// Listings smaller than `memlimit` bytes are kept in memory. Larger ones are sorted in runs,
+// which are spilled to temp files and merged while reading, so memory stays bounded for dirs
+// of any size.
+//
+// Usage:
+//    stream.setup(tmpprefix, memlimit);
+//    ListDir(dir, stream);	// add() for each entry, then finish()
+//    for (stream.rewind(); !stream.end(); stream.next())
+//        use(stream.name(), stream.item());
+//    if (stream.fail())
+//        ...	// a temp file could not be read, the listing is incomplete
+class FsStream
+{
+	FsStream(const FsStream &) = delete;
+	FsStream &operator =(const FsStream &) = delete;
+public:
+	FsStream() {}
+	~FsStream() { close(); }
+
+	// temp files are named "<tmpprefix>.<n>". memlimit 0 or empty tmpprefix: never spill
+	void setup(const char *tmpprefix, size_t memlimit) { close(); _tmp = tmpprefix; _memlimit = memlimit; }
+	// called on each batch of new items before it is sorted and kept or spilled, e.g. to set flags
+	std::function<void(FsList &)> onbatch;
+
+	// append an entry, return NULL on failure
+	FsItem *add(const char *name, size_t nlen);
+	// all entries added, sort and dedupe, and rewind to the first item. `dir` is for logs only
+	int finish(const char *dir);
+	// drop contents, free memory and remove temp files
+	void close();
+
+	int rewind();
+	bool end() const { return _runs.empty() ? _cur >= _list.size() : _heap.empty(); }
+	const FsItem &item() const { return _runs.empty() ? _list[_cur] : _runs[_heap.front()].item; }
+	const char *name() const { return _runs.empty() ? _list.name(_cur) : _runs[_heap.front()].name.buf(); }
+	void next();
+	bool fail() const { return _fail; }
+
+private:
+	enum { MAXRUNS = 64, RUNBUFSIZE = 64 * 1024 };
+	struct Run
+	{
+		unsigned seq = 0;
+		FILE *fp = NULL;
+		FsItem item;
+		abuf<char> name;
+	};
+	std::string _tmp;
+	size_t _memlimit = 0;
+	std::string _dir;	// for logs
+	FsList _list;	// all items if not spilled, otherwise the batch being built
+	size_t _cur = 0;	// current item in _list
+	std::deque<Run> _runs;	// spilled runs
+	std::vector<size_t> _heap;	// min-heap of runs not yet exhausted, by their current name
+	abuf<char> _last;	// last name returned from the merge, to drop dups
+	unsigned _seq = 0;
+	bool _fail = false;
+
+	int spill();
+	int mergeRuns(size_t count);	// merge the first `count` runs into a new one
+	int openRun(Run &run, const NCHART *mode);
+	int readRun(Run &run);	// 1: got an item, 0: end, <0: error
+	void removeRun(Run &run);
+	bool heapLess(size_t l, size_t r) const;	// heap order, smallest name on top
+	int popHeap();	// move the top run forward
+};
+
 class FileHandle
 {
 	FILE *fp;
@@ -45,26 +152,86 @@ public:
 	operator FILE *() { return fp; }
 };
 
+// Sequential reader of local files for backup, trying not to disturb other programs on the host:
+//  - access time of the file is kept
+//  - the OS is told the file is read sequentially, and data ahead of the cursor is prefetched
+//  - data passed to release() is dropped from the page cache, unless it was cached before we read it
+// Dropping pages is linux only. Windows gets sequential scan hints and keeps last access time.
+class LocalFile
+{
+	LocalFile(const LocalFile &) = delete;
+	LocalFile &operator =(const LocalFile &) = delete;
+#ifdef _WIN32
+	void *_h = (void *)-1;	// INVALID_HANDLE_VALUE
+#else
+	int _fd = -1;
+	uint64_t _dropped = 0;	// pages before this have been released
+	uint64_t _ahead = 0;	// prefetch has been issued up to here
+	bool _aheadcached = false;	// the prefetched range was cached before prefetching
+	bool _keep = false;	// some data read since last release() was cached before
+	bool iscached(uint64_t off, size_t len);
+#endif
+	uint64_t _size = 0;
+	uint64_t _pos = 0;
+	bool _error = false;
+	bool _sparse = false;
+public:
+	LocalFile() {}
+	~LocalFile() { close(); }
+	int open(const char *filename);
+	void close();
+	uint64_t size() const { return _size; }
+	uint64_t tell() const { return _pos; }
+	// return bytes read, 0 at end of file or on error
+	size_t read(void *buf, size_t len);
+	bool error() const { return _error; }
+	// data before `pos` has been consumed and will not be read again
+	void release(uint64_t pos);
+	// the file may have holes, less space allocated than its size
+	bool sparse() const { return _sparse; }
+	// range of data [start, end) at or after `pos`, and move to `start` for reading it. false if
+	// only a hole is left. the whole file is data on file systems telling nothing about holes
+	bool nextData(uint64_t pos, uint64_t &start, uint64_t &end);
+};
+
 int CreateDir(const char *dir);
 
 uint64_t getDirTime(const char *base, const char *dir, size_t dlen);
 int getFileAttr(const char *base, const char *filename, size_t fnlen, uint64_t &ftime, uint64_t &fsize);
+// identity of the file data, equal for hard links of the same file on the same volume. `nlink`: number of links
+int getFileId(const char *base, const char *filename, size_t fnlen, uint64_t &fileid, uint32_t &nlink);
 
 int buildPath(const char *dir, const char *filename, abuf<NCHART> &path);
 int buildPath(const char *dir, const char *filename, size_t flen, abuf<NCHART> &path);
 int buildPath(const char **dir, size_t size, abuf<char> &path);
 int buildPath(const char *dir, size_t dirlen, const char *file, size_t filelen, abuf<char> &path);
 inline int buildPath(const char *dir, const char *filename, abuf<char> &path) { const char *dirs[] = { dir, filename };  return buildPath(dirs, 2, path); }
+
+// Scratch storage for paths built during one refresh. Memory is kept over reset(), so that
+// building paths does not allocate in steady state.
+// Strings are addressed by offset, since the storage may move when it grows
+class PathArena
+{
+	abuf<char> _buf;
+	size_t _used = 0;
+public:
+	void reset() { _used = 0; }
+	// store "dir/file" (or "file" if dir is empty), return offset of the new string
+	size_t put(const char *dir, size_t dirlen, const char *file, size_t filelen);
+	const char *get(size_t off) const { return _buf.buf() + off; }
+};
 FILE *OpenFile(const char *filename, const NCHART *mode);
 FILE *OpenFile(const char *dir, const char *filename, const NCHART *mode);
 
-int ListDir(const abufchar &dir, std::vector<FsItem> &items);
+int ListDir(const abufchar &dir, FsStream &items);
+int RemoveFile(const char *filename);
 
 int pathCmpSt(const char *l, const char *r);		// keep case diffs near each other but different, used for sort
 int pathCmpDp(const char *l, const char *r);	// completely case insensitive
 int pathCmpDp(const char *l, size_t ll, const char *r);	// completely case insensitive
 int pathCmpMt(const char *l, const char *r);	// to match local file system, St if case sensitive, otherwise Dp
 int pathCmpMt(const char *l, size_t ll, const char *r);	// to match local file system, St if case sensitive, otherwise Dp
+uint32_t pathHashDp(const char *name, size_t len);	// hash that equals for names equal in pathCmpDp()
 
 int pathAbs2Rel(abufchar &path, const char *base);
 const char *pathAbs2Rel(const char *path, const char *base);
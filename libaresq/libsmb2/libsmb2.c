@@ -2612,6 +2612,12 @@ smb2_get_max_write_size(struct smb2_context *smb2)
         return smb2->max_write_size;
 }
 
+int
+smb2_get_credits(struct smb2_context *smb2)
+{
+        return smb2->credits;
+}
+
 smb2_file_id *
 smb2_get_file_id(struct smb2fh *fh)
 {
@@ -595,6 +595,12 @@ int smb2_fsync(struct smb2_context *smb2, struct smb2fh *fh);
 uint32_t smb2_get_max_read_size(struct smb2_context *smb2);
 uint32_t smb2_get_max_write_size(struct smb2_context *smb2);
 
+/*
+ * Credits granted by the server and not used by requests sent yet.
+ * Each read/write takes one credit for every 64kb of data.
+ */
+int smb2_get_credits(struct smb2_context *smb2);
+
 struct smb2_read_cb_data {
         struct smb2fh *fh;
         uint8_t *buf;
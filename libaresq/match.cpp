@@ -23,11 +23,11 @@
 using namespace std;
 
 // returns TRUE if text string matches gitignore-style glob pattern
-bool gitignore_glob_match(const string& text, const string& glob)
+// text is not required to be null terminated
+bool gitignore_glob_match(const char *text, size_t n, const string& glob)
 {
   size_t i = 0;
   size_t j = 0;
-  size_t n = text.size();
   size_t m = glob.size();
   size_t text1_backup = string::npos;
   size_t glob1_backup = string::npos;
@@ -47,9 +47,14 @@ bool gitignore_glob_match(const string& text, const string& glob)
   }
   else if (glob.find('/') == string::npos)
   {
-    size_t sep = text.rfind(PATHSEP);
-    if (sep != string::npos)
-      i = sep + 1;
+    for (size_t sep = n; sep > 0; --sep)
+    {
+      if (text[sep - 1] == PATHSEP)
+      {
+        i = sep;
+        break;
+      }
+    }
   }
   while (i < n)
   {